@@ -0,0 +1,297 @@
+#!/bin/sh
+# LC-2K benchmark suite: a fixed set of workloads through the assembler and
+# both simulators, reported as throughput with its spread over repetitions.
+#
+#   bench/bench.sh [-d build-dir] [-r repetitions] [-o results-file]
+#                  [-c baseline-file [-t tolerance-percent]]
+#
+# Results are tab separated, one row per workload and tool:
+#   workload  tool  unit  mean  stdev  cv%  min  max  repetitions
+# With -c every row is compared against the same row of an earlier
+# results file; a throughput more than the tolerance (default 5%) below
+# the baseline is a regression and makes the script exit with status 1.
+#
+# Workloads, all generated here so that every run measures the same thing:
+#   labels   200k-line label-heavy program (tools/generator, fixed seed)
+#   hazards  200k-line hazard-dense program (tools/generator, fixed seed)
+#   loop     a three-instruction counting loop, 4M iterations
+#   memory   sums and copies a 256-word array, 2000 passes
+#   chain    a loop of 16 dependent add/nor, 300k iterations
+#   dotsoft  dot product of two 256-word arrays, 100 passes, multiplying by
+#            shift-and-add over 10 bits
+#   dotmul   the same with the mul extension (-x)
+#   inputs   sums the words of a 64-word array above a threshold, run as
+#            20000 instances with random arrays (tools/batch)
+# Assembly is measured in source lines/s, the functional simulator in
+# MIPS and the pipeline in simulated Mcycles/s, both in fast mode (-f).
+# dotsoft and dotmul are measured in products/s, so their ratio is what
+# the extension gains.
+# inputs is measured in instances/s, through the batch engine and as
+# serial scalar runs (batch -S).
+# The pipeline runs the programs as scheduled by `assemble -S`, since
+# it leaves hazards to the program.
+
+usage() {
+  echo "usage: bench.sh [-d build-dir] [-r repetitions] [-o results-file] [-c baseline-file [-t tolerance-percent]]" >&2
+  exit 2
+}
+
+build=build
+reps=5
+results=
+baseline=
+tolerance=5
+while getopts d:r:o:c:t: opt; do
+  case $opt in
+    d) build=$OPTARG ;;
+    r) reps=$OPTARG ;;
+    o) results=$OPTARG ;;
+    c) baseline=$OPTARG ;;
+    t) tolerance=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+[ $# -ge $OPTIND ] && usage
+[ "$reps" -ge 1 ] 2>/dev/null || usage
+for tool in assemble simulate pipeline generate batch; do
+  [ -x "$build/$tool" ] || { echo "[ERROR] $build/$tool missing, run make first" >&2; exit 2; }
+done
+work=$build/bench
+mkdir -p "$work"
+[ -n "$results" ] || results=$work/results.tsv
+
+# Workloads //////////////////////////////////////////
+"$build/generate" -p labels -n 200000 -s 41 "$work/labels.as"
+"$build/generate" -p hazards -n 200000 -s 42 "$work/hazards.as"
+
+cat > "$work/loop.as" <<'EOF'
+        lw      0       1       n
+        lw      0       2       neg1
+loop    add     1       2       1
+        beq     1       0       done
+        beq     0       0       loop
+done    halt
+n       .fill   4000000
+neg1    .fill   -1
+EOF
+
+{
+  cat <<'EOF'
+        lw      0       6       neg1
+        lw      0       7       passes
+outer   lw      0       1       len
+        add     0       0       3
+inner   add     1       6       1
+        lw      1       2       src
+        add     3       2       3
+        sw      1       3       dst
+        beq     1       0       next
+        beq     0       0       inner
+next    add     7       6       7
+        beq     7       0       done
+        beq     0       0       outer
+done    sw      0       3       total
+        halt
+neg1    .fill   -1
+passes  .fill   2000
+len     .fill   256
+total   .fill   0
+EOF
+  awk 'BEGIN { for (i = 0; i < 256; i++) printf "%-8s.fill   %d\n", i ? "" : "src", i * 7 - 900
+               for (i = 0; i < 256; i++) printf "%-8s.fill   0\n", i ? "" : "dst" }'
+} > "$work/memory.as"
+
+{
+  cat <<'EOF'
+        lw      0       6       neg1
+        lw      0       7       n
+        lw      0       1       seed
+loop    add     1       1       2
+EOF
+  awk 'BEGIN { for (i = 0; i < 15; i++)
+                 printf "        %-8s%d       %d       %d\n", i % 3 == 2 ? "nor" : "add",
+                        2 + i % 3, 1 + (i + 1) % 3, 2 + (i + 1) % 3 }'
+  cat <<'EOF'
+        add     7       6       7
+        beq     7       0       done
+        beq     0       0       loop
+done    halt
+neg1    .fill   -1
+n       .fill   300000
+seed    .fill   12345
+EOF
+} > "$work/chain.as"
+
+# dot: the dot product around a body that leaves arr1[i] * arr2[i] in 5
+# (r2 = arr1[i], r3 = arr2[i], r1 = i)
+dot() {
+  cat <<'EOF'
+        lw      0       7       passes
+        sw      0       7       left
+outer   lw      0       1       len
+elem    lw      0       7       neg1
+        add     1       7       1
+        lw      1       2       arr1
+        lw      1       3       arr2
+EOF
+  cat
+  cat <<'EOF'
+        lw      0       7       total
+        add     7       5       7
+        sw      0       7       total
+        beq     1       0       next
+        beq     0       0       elem
+next    lw      0       7       left
+        lw      0       6       neg1
+        add     7       6       7
+        sw      0       7       left
+        beq     7       0       done
+        beq     0       0       outer
+done    halt
+neg1    .fill   -1
+one     .fill   1
+nmask   .fill   -2
+nlimit  .fill   -1025
+passes  .fill   100
+left    .fill   0
+len     .fill   256
+idx     .fill   0
+total   .fill   0
+EOF
+  awk 'BEGIN { for (i = 0; i < 256; i++) printf "%-8s.fill   %d\n", i ? "" : "arr1", (i * 37 + 11) % 1000
+               for (i = 0; i < 256; i++) printf "%-8s.fill   %d\n", i ? "" : "arr2", (i * 91 + 7) % 1000 }'
+}
+
+# r3 = ~arr2[i]; bit k of arr2[i] is set when ~r3 & (1 << k), tested as
+# nor(r3, ~(1 << k)) with r4 = ~(1 << k) shifted along
+dot > "$work/dotsoft.as" <<'EOF'
+        sw      0       1       idx
+        nor     3       3       3
+        lw      0       4       nmask
+        add     0       0       5
+        lw      0       6       one
+        lw      0       1       nlimit
+bit     nor     3       4       7
+        beq     7       0       skip
+        add     5       2       5
+skip    add     2       2       2
+        add     4       4       4
+        add     4       6       4
+        beq     4       1       mdone
+        beq     0       0       bit
+mdone   lw      0       1       idx
+EOF
+
+dot > "$work/dotmul.as" <<'EOF'
+        mul     2       3       5
+EOF
+
+{
+  cat <<'EOF'
+        lw      0       6       neg1
+        lw      0       7       thr
+        lw      0       5       low
+        lw      0       1       len
+        add     0       0       3
+loop    add     1       6       1
+        lw      1       2       data
+        nor     7       7       4
+        add     2       4       4
+        nor     4       5       4
+        beq     4       0       skip
+        add     3       2       3
+skip    beq     1       0       done
+        beq     0       0       loop
+done    sw      0       3       total
+        halt
+neg1    .fill   -1
+thr     .fill   500
+low     .fill   2147483647
+len     .fill   64
+total   .fill   0
+EOF
+  awk 'BEGIN { for (i = 0; i < 64; i++) printf "%-8s.fill   0\n", i ? "" : "data" }'
+} > "$work/inputs.as"
+
+for w in labels hazards loop memory chain dotsoft dotmul inputs; do
+  x=
+  [ $w = dotmul ] && x=-x
+  "$build/assemble" $x "$work/$w.as" "$work/$w.mc" > /dev/null || exit 1
+  "$build/assemble" $x -S "$work/$w.as" "$work/$w.s.mc" > /dev/null || exit 1
+done
+
+# Measurements //////////////////////////////////////////
+now() {
+  date +%s%N
+}
+
+# measure workload tool unit count-per-run command...: one row of results
+measure() {
+  name=$1 tool=$2 unit=$3 count=$4
+  shift 4
+  samples=
+  i=0
+  while [ $i -lt "$reps" ]; do
+    t0=$(now)
+    "$@" > /dev/null 2>&1 || { echo "[ERROR] $tool failed on $name" >&2; exit 1; }
+    t1=$(now)
+    samples="$samples $(awk -v c="$count" -v ns=$((t1 - t0)) 'BEGIN { printf "%.6g", c / (ns / 1e9) }')"
+    i=$((i + 1))
+  done
+  echo "$samples" | awk -v w="$name" -v t="$tool" -v u="$unit" '{
+    for (i = 1; i <= NF; i++) { s += $i; q += $i * $i; if (i == 1 || $i < lo) lo = $i; if ($i > hi) hi = $i }
+    m = s / NF
+    v = NF > 1 ? (q - NF * m * m) / (NF - 1) : 0
+    sd = v > 0 ? sqrt(v) : 0
+    printf "%s\t%s\t%s\t%.2f\t%.2f\t%.1f\t%.2f\t%.2f\t%d\n", w, t, u, m, sd, 100 * sd / m, lo, hi, NF
+  }' >> "$results.tmp"
+}
+
+# last number printed as "total of N <what>"
+total() {
+  "$@" 2>/dev/null | awk '/^total of/ { n = $3 } END { print n + 0 }'
+}
+
+: > "$results.tmp"
+for w in labels hazards; do
+  measure $w assemble lines/s "$(wc -l < "$work/$w.as")" "$build/assemble" "$work/$w.as" "$work/$w.out.mc"
+done
+for w in loop memory chain; do
+  n=$(total "$build/simulate" -f "$work/$w.mc")
+  measure $w simulate MIPS "$(awk -v n="$n" 'BEGIN { print n / 1e6 }')" "$build/simulate" -f "$work/$w.mc"
+done
+for w in loop memory chain; do
+  n=$(total "$build/pipeline" -f "$work/$w.s.mc")
+  measure $w pipeline Mcycles/s "$(awk -v n="$n" 'BEGIN { print n / 1e6 }')" "$build/pipeline" -f "$work/$w.s.mc"
+done
+for w in dotsoft dotmul; do
+  measure $w simulate products/s 25600 "$build/simulate" -f -x "$work/$w.mc"
+  measure $w pipeline products/s 25600 "$build/pipeline" -f -x "$work/$w.s.mc"
+done
+measure inputs batch instances/s 20000 "$build/batch" -n 20000 -r 21,64,1000 "$work/inputs.mc"
+measure inputs serial instances/s 20000 "$build/batch" -S -n 20000 -r 21,64,1000 "$work/inputs.mc"
+
+{
+  printf '# workload\ttool\tunit\tmean\tstdev\tcv%%\tmin\tmax\trepetitions\n'
+  printf '# %s, %s, %s\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -srm)" "$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+  cat "$results.tmp"
+} > "$results"
+rm -f "$results.tmp"
+column -t -s "$(printf '\t')" "$results" 2>/dev/null || cat "$results"
+
+# Comparison //////////////////////////////////////////
+[ -n "$baseline" ] || exit 0
+[ -r "$baseline" ] || { echo "[ERROR] error in opening file $baseline" >&2; exit 2; }
+echo
+awk -F '\t' -v tol="$tolerance" '
+  /^#/ { next }
+  FNR == NR { base[$1 FS $2] = $4; next }
+  {
+    key = $1 FS $2
+    if (!(key in base)) { printf "%-8s %-9s %10.4g %-10s   (not in baseline)\n", $1, $2, $4, $3; next }
+    change = 100 * ($4 - base[key]) / base[key]
+    verdict = change < -tol ? "REGRESSION" : change > tol ? "faster" : "ok"
+    printf "%-8s %-9s %10.4g -> %-10.4g %-10s %+6.1f%%  %s\n", $1, $2, base[key], $4, $3, change, verdict
+    if (change < -tol) bad++
+  }
+  END { exit bad > 0 }' "$baseline" "$results"
@@ -0,0 +1,223 @@
+#!/bin/sh
+# LC-2K end-to-end checks: the tools run on the sample programs and on
+# small programs written here, and what they produce is compared with
+# what it has to be.
+#
+#   check/check.sh [-d build-dir]
+#
+# Every check prints one line, "ok" or "FAIL" and what it covers; the
+# script exits with status 1 if any failed.
+#
+# Checks:
+#   gdb      a scripted session against `simulate -g` (tools/gdbclient):
+#            a breakpoint, continue, registers and memory read and written,
+#            a single step and a detach, after which the program runs out
+#            to the same final state as without the debugger; and a
+#            program that faults, which stops with SIGSEGV at the faulting
+#            instruction and keeps the session open
+#   -O       every sample program (project1/assembler/test*.as and
+#            project2/testcase*.as) assembled with and without -O ends in
+#            the same registers and data words, in simulate and in
+#            pipeline, apart from the addresses the optimizer moved
+#   -S       the same samples scheduled with -S end in the same registers
+#            and data words in `pipeline -j` and in simulate as they do
+#            unscheduled in simulate, apart from the addresses moved
+#   -n       four cores of `simulate -n` each store their core index, which
+#            every core starts with in reg 7, to a word of their own
+
+usage() {
+  echo "usage: check.sh [-d build-dir]" >&2
+  exit 2
+}
+
+build=build
+while getopts d: opt; do
+  case $opt in
+    d) build=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+[ $# -ge $OPTIND ] && usage
+for tool in assemble simulate pipeline gdbclient; do
+  [ -x "$build/$tool" ] || { echo "[ERROR] $build/$tool missing, run make first" >&2; exit 2; }
+done
+work=$build/check
+mkdir -p "$work"
+samples=$(dirname "$0")/..
+failed=0
+
+# check what status: one line of the report
+check() {
+  if [ "$2" -eq 0 ]; then
+    echo "ok    $1"
+  else
+    echo "FAIL  $1"
+    failed=1
+  fi
+}
+
+# final state a run prints, from the last "state:" on
+final() {
+  awk '/^[[:space:]]*state:/ { n = 0 } { s[n++] = $0 } END { for (i = 0; i < n; i++) print s[i] }'
+}
+
+# samestate map plain.mc other.mc plain-run other-run: the final
+# registers and .fill words of two runs of a program agree. The map is
+# the address map the assembler printed for the other one, "old -> new"
+# or "new <- old" per word, with "-" for a word it removed or inserted
+# (a word it does not list was removed too). A value of the plain run
+# that is an address matches the address the word moved to (a removed
+# word's address stands for the next word kept), and
+# one that is a word of the plain image matches that word as relocated.
+samestate() {
+  awk '
+    FNR == 1 { f++ }
+    f == 1 && ($2 == "->" || $2 == "<-") {
+      old = $2 == "->" ? $1 : $3
+      new = $2 == "->" ? $3 : $1
+      if (old == "-")
+        next
+      order[n++] = old
+      moved[old] = new
+      fill[old] = / \.fill /
+      if (old + 0 > last)
+        last = old + 0
+      if (new != "-" && new + 1 > end)
+        end = new + 1
+      next
+    }
+    f == 2 || f == 3 {
+      image[f, FNR - 1] = $1
+      next
+    }
+    $1 == "reg[" || $1 == "mem[" || $1 == "dataMem[" {
+      v[f, ($1 == "reg[" ? "r" : "m") $2] = $4
+    }
+    function same(p, o) { return p == o || (p in moved && moved[p] == o) || ((p, o) in relocated) }
+    END {
+      for (a = last; a >= 0; a--)
+        if ((a in moved) && moved[a] != "-")
+          end = moved[a]
+        else
+          moved[a] = end
+      for (i = 0; i < n; i++)
+        relocated[image[2, order[i]], image[3, moved[order[i]]]] = 1
+      bad = 0
+      for (r = 0; r < 8; r++)
+        if (!same(v[4, "r" r], v[5, "r" r])) {
+          printf "reg[ %d ] %s, %s\n", r, v[4, "r" r], v[5, "r" r]
+          bad = 1
+        }
+      for (i = 0; i < n; i++) {
+        a = order[i]
+        if (fill[a] && !same(v[4, "m" a], v[5, "m" moved[a]])) {
+          printf "mem[ %d ] %s, mem[ %d ] %s\n", a, v[4, "m" a], moved[a], v[5, "m" moved[a]]
+          bad = 1
+        }
+      }
+      exit bad
+    }' "$@"
+}
+
+# session name program: runs `simulate -g` on program with the session
+# on stdin, leaves the exchanges in name.log and the simulator's output
+# and exit status in name.out and name.status
+session() {
+  rm -f "$work/$1.sock"
+  ( "$build/simulate" -g "$work/$1.sock" "$2" > "$work/$1.out" 2>&1; echo $? > "$work/$1.status" ) &
+  "$build/gdbclient" "$work/$1.sock" > "$work/$1.log" 2>&1
+  status=$?
+  wait
+  return $status
+}
+
+# gdb ///////////////////////////////////////////////////
+"$build/assemble" "$samples/project1/assembler/test1.as" "$work/gdb.mc" > /dev/null || exit 1
+session gdb "$work/gdb.mc" <<'EOS'
+qSupported      PacketSize=*
+?               S05
+# loop, word 3
+Z0,c,4          OK
+c               S05
+p8              0c000000
+g               00000000010000000f0000000000000000000000000000000f000000000000000c000000
+# the 'h' and 'e' of hw0, written back as they were
+m3c,8           6800000065000000
+M40,4:65000000  OK
+m40,4           65000000
+P1=07000000     OK
+p1              07000000
+P1=01000000     OK
+p-2             E01
+p9              E01
+z0,c,4          OK
+s               S05
+p8              10000000
+D               OK
+EOS
+check "gdb: breakpoint, registers, memory, step and detach" $?
+"$build/simulate" "$work/gdb.mc" | final > "$work/gdb.plain"
+final < "$work/gdb.out" | cmp -s - "$work/gdb.plain"
+check "gdb: the detached program runs out as without the debugger" $?
+
+printf '        add 0 0 1\n        lw 0 2 -1\n        halt\n' > "$work/fault.as"
+"$build/assemble" "$work/fault.as" "$work/fault.mc" > /dev/null || exit 1
+session fault "$work/fault.mc" <<'EOS'
+c               S0b
+?               S0b
+p8              04000000
+s               S0b
+D               OK
+EOS
+check "gdb: a fault stops the program and keeps the session" $?
+[ "$(cat "$work/fault.status")" -eq 1 ] && grep -q "^\[ERROR\] memory address out of bound" "$work/fault.out"
+check "gdb: the fault is reported once the client detaches" $?
+
+# -O ////////////////////////////////////////////////////
+for as in "$samples"/project1/assembler/test*.as "$samples"/project2/testcase*.as; do
+  name=$(basename "$as" .as)
+  "$build/assemble" "$as" "$work/$name.mc" > /dev/null || exit 1
+  "$build/assemble" -O "$as" "$work/$name.O.mc" > "$work/$name.O.map" || exit 1
+  for tool in simulate pipeline; do
+    "$build/$tool" "$work/$name.mc" > "$work/$name.$tool" 2>&1
+    "$build/$tool" "$work/$name.O.mc" > "$work/$name.O.$tool" 2>&1
+    samestate "$work/$name.O.map" "$work/$name.mc" "$work/$name.O.mc" \
+              "$work/$name.$tool" "$work/$name.O.$tool" > "$work/$name.O.$tool.diff"
+    check "-O: $name in $tool" $?
+  done
+done
+
+# -S ////////////////////////////////////////////////////
+for as in "$samples"/project1/assembler/test*.as "$samples"/project2/testcase*.as; do
+  name=$(basename "$as" .as)
+  "$build/assemble" -S "$as" "$work/$name.S.mc" > "$work/$name.S.map" || exit 1
+  "$build/simulate" "$work/$name.S.mc" > "$work/$name.S.simulate" 2>&1
+  "$build/pipeline" -j "$work/$name.S.mc" > "$work/$name.S.pipeline" 2>&1
+  for tool in simulate pipeline; do
+    samestate "$work/$name.S.map" "$work/$name.mc" "$work/$name.S.mc" \
+              "$work/$name.simulate" "$work/$name.S.$tool" > "$work/$name.S.$tool.diff"
+    check "-S: $name in $tool$([ $tool = pipeline ] && echo " -j")" $?
+  done
+done
+
+# -n ////////////////////////////////////////////////////
+cat > "$work/cores.as" <<'EOS'
+        lw      0 1 base
+        add     1 7 1
+        lw      0 2 one
+        add     2 7 2
+        sw      1 2 0
+        halt
+base    .fill   slots
+one     .fill   1
+slots   .fill   0
+        .fill   0
+        .fill   0
+        .fill   0
+EOS
+"$build/assemble" "$work/cores.as" "$work/cores.mc" > /dev/null || exit 1
+"$build/simulate" -n 4 "$work/cores.mc" > "$work/cores.out" 2>&1
+[ "$(awk '$1 == "mem[" && $2 >= 8 { printf "%s ", $4 }' "$work/cores.out")" = "1 2 3 4 " ]
+check "-n: every core starts with its index in reg 7" $?
+
+exit $failed
@@ -0,0 +1,253 @@
+/* Call-graph profiler: a shadow call stack kept from jalr, written as folded stacks */
+#ifndef LC2K_CALLPROF_H
+#define LC2K_CALLPROF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Every jalr either returns or calls. It returns when it jumps to the
+ * return address of one of the PROF_SEARCH innermost frames, which pops
+ * that frame and everything called from it; any other jalr calls its
+ * target and pushes a frame that returns to the jalr's pc+1. So
+ * `jalr 4 7` / `jalr 7 3` pairs nest, and a routine that jumps away
+ * through jalr is popped along with its caller.
+ *
+ * Each distinct stack is a node of a call tree. The simulator hands in
+ * its running counters at every jalr, and whatever they moved by since
+ * the last one is charged to the node the code was in, so nothing is
+ * done per instruction. Frames deeper than PROF_MAXDEPTH are charged to
+ * the frame at that depth, and past PROF_MAXSTACK calls that never return
+ * are not followed at all.
+ *
+ * Routines are named after the label at their entry in a label map, the
+ * "address label" lines of `assemble -L`, as label+offset when the entry
+ * has none of its own, and by address without a map.
+ */
+#define PROF_MAXDEPTH 256
+#define PROF_MAXSTACK (1 << 16)
+#define PROF_SEARCH   16
+#define PROF_NAMESIZE 24
+
+/* what a stack is charged */
+#define PROF_INSTS   0 /* instructions */
+#define PROF_CYCLES  1 /* the pipeline's cycles */
+#define PROF_STALLS  2 /* and the cycles it held an instruction in decode */
+#define PROF_WEIGHTS 3
+
+typedef struct profNodeStruct {
+  int entry;             /* address the routine was called at */
+  int parent, child, sibling;
+  int depth;             /* 0 for the root, the program's start */
+  long weight[PROF_WEIGHTS];
+} profNode;
+
+typedef struct profFrameStruct {
+  int ret;               /* where the call returns to */
+  int node;
+} profFrame;
+
+typedef struct profLabelStruct {
+  int addr;
+  char name[8];
+} profLabel;
+
+typedef struct callProfStruct {
+  profNode *nodes;       /* nodes[0] is the root */
+  int numNodes, maxNodes;
+  profFrame *stack;      /* stack[0] is the root's, it never returns */
+  int depth;
+  long mark[PROF_WEIGHTS]; /* the counters as of the last jalr */
+  profLabel *labels;     /* by address */
+  int numLabels;
+} callProf;
+
+static int __profLabelCmp(const void *a, const void *b)
+{
+  const profLabel *x = (const profLabel *)a, *y = (const profLabel *)b;
+
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* lines that are not "address label" are skipped */
+static inline int __profReadLabels(callProf *prof, const char *text, size_t len)
+{
+  const char *p = text, *end = text + len, *eol;
+  char line[64];
+  profLabel *l;
+  int max = 0;
+
+  while (p < end) {
+    eol = (const char *)memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    if (eol - p < (long)sizeof(line)) {
+      memcpy(line, p, eol - p);
+      line[eol - p] = '\0';
+      if (prof->numLabels == max) {
+        max = max ? 2 * max : 256;
+        l = (profLabel *)realloc(prof->labels, max * sizeof(profLabel));
+        if (l == NULL)
+          return -1;
+        prof->labels = l;
+      }
+      l = &prof->labels[prof->numLabels];
+      if (sscanf(line, "%d %7s", &l->addr, l->name) == 2)
+        prof->numLabels++;
+    }
+    p = eol < end ? eol + 1 : end;
+  }
+  qsort(prof->labels, prof->numLabels, sizeof(profLabel), __profLabelCmp);
+  return 0;
+}
+
+/* an empty profile at the program's start; labels may be NULL. -1 when out of memory */
+static inline int profOpen(callProf *prof, const char *labels, size_t len)
+{
+  memset(prof, 0, sizeof(*prof));
+  prof->maxNodes = 256;
+  prof->nodes = (profNode *)calloc(prof->maxNodes, sizeof(profNode));
+  prof->stack = (profFrame *)malloc(PROF_MAXSTACK * sizeof(profFrame));
+  if (prof->nodes == NULL || prof->stack == NULL
+      || (labels != NULL && __profReadLabels(prof, labels, len) < 0)) {
+    free(prof->nodes);
+    free(prof->stack);
+    free(prof->labels);
+    return -1;
+  }
+  prof->nodes[0].parent = prof->nodes[0].child = prof->nodes[0].sibling = -1;
+  prof->numNodes = 1;
+  prof->stack[0].ret = -1;
+  prof->stack[0].node = 0;
+  return 0;
+}
+
+static inline void profClose(callProf *prof)
+{
+  free(prof->nodes);
+  free(prof->stack);
+  free(prof->labels);
+}
+
+/* a new program: back at the root with the counters at 0, the weights are kept */
+static inline void profRestart(callProf *prof)
+{
+  prof->depth = 0;
+  memset(prof->mark, 0, sizeof(prof->mark));
+}
+
+/* charges what the counters moved by since the last call to the current stack */
+static inline void profCharge(callProf *prof, const long *now)
+{
+  profNode *n = &prof->nodes[prof->stack[prof->depth].node];
+  int w;
+
+  for (w = 0; w < PROF_WEIGHTS; w++) {
+    n->weight[w] += now[w] - prof->mark[w];
+    prof->mark[w] = now[w];
+  }
+}
+
+/* the child of `node` entered at `entry`, `node` itself when it is too deep
+   or there is no memory for another */
+static inline int __profChild(callProf *prof, int node, int entry)
+{
+  profNode *n;
+  int c;
+
+  for (c = prof->nodes[node].child; c >= 0; c = prof->nodes[c].sibling)
+    if (prof->nodes[c].entry == entry)
+      return c;
+  if (prof->nodes[node].depth == PROF_MAXDEPTH)
+    return node;
+  if (prof->numNodes == prof->maxNodes) {
+    n = (profNode *)realloc(prof->nodes, 2 * prof->maxNodes * sizeof(profNode));
+    if (n == NULL)
+      return node;
+    prof->nodes = n;
+    prof->maxNodes *= 2;
+  }
+  c = prof->numNodes++;
+  n = &prof->nodes[c];
+  memset(n, 0, sizeof(*n));
+  n->entry = entry;
+  n->parent = node;
+  n->depth = prof->nodes[node].depth + 1;
+  n->child = -1;
+  n->sibling = prof->nodes[node].child;
+  prof->nodes[node].child = c;
+  return c;
+}
+
+/* a jalr at pc jumped to target, with the counters at `now` including it */
+static inline void profJalr(callProf *prof, int pc, int target, const long *now)
+{
+  int d, low;
+
+  profCharge(prof, now);
+  low = prof->depth > PROF_SEARCH ? prof->depth - PROF_SEARCH : 1;
+  for (d = prof->depth; d >= low; d--) {
+    if (prof->stack[d].ret == target) {
+      prof->depth = d - 1;
+      return;
+    }
+  }
+  if (prof->depth + 1 == PROF_MAXSTACK)
+    return;
+  d = ++prof->depth;
+  prof->stack[d].ret = pc + 1;
+  prof->stack[d].node = __profChild(prof, prof->stack[d - 1].node, target);
+}
+
+/* the routine entered at addr, as named in the folded stacks */
+static inline void __profName(const callProf *prof, int addr, char *name)
+{
+  int lo = 0, hi = prof->numLabels, mid;
+
+  /* the last label at or before addr */
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (prof->labels[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    snprintf(name, PROF_NAMESIZE, "%d", addr);
+  else if (prof->labels[lo - 1].addr == addr)
+    snprintf(name, PROF_NAMESIZE, "%s", prof->labels[lo - 1].name);
+  else
+    snprintf(name, PROF_NAMESIZE, "%s+%d", prof->labels[lo - 1].name, addr - prof->labels[lo - 1].addr);
+}
+
+static void __profFold(const callProf *prof, FILE *out, int node, char *path, size_t len, int w)
+{
+  const profNode *n = &prof->nodes[node];
+  char name[PROF_NAMESIZE];
+  int c;
+
+  __profName(prof, n->entry, name);
+  len += sprintf(path + len, "%s%s", len ? ";" : "", name);
+  if (n->weight[w] > 0)
+    fprintf(out, "%s %ld\n", path, n->weight[w]);
+  for (c = n->child; c >= 0; c = prof->nodes[c].sibling)
+    __profFold(prof, out, c, path, len, w);
+}
+
+/* one "caller;...;callee count" line of weight w per stack it is not 0 for,
+   the input of flamegraph.pl and most flame graph viewers. -1 when out of memory */
+static inline int profWrite(const callProf *prof, FILE *out, int w)
+{
+  char *path;
+
+  path = (char *)malloc((PROF_MAXDEPTH + 1) * PROF_NAMESIZE);
+  if (path == NULL)
+    return -1;
+  path[0] = '\0';
+  __profFold(prof, out, 0, path, 0, w);
+  free(path);
+  return 0;
+}
+
+#endif
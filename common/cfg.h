@@ -0,0 +1,173 @@
+/* Control flow recovered from LC-2K machine-code images, for the tools */
+#ifndef LC2K_CFG_H
+#define LC2K_CFG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "isa.h"
+
+/*
+ * Code is whatever is reachable from address 0: falling through, both
+ * ways of a beq (only the target when regA == regB), and the word after
+ * a jalr as if the call returned; the jalr target itself is unknown.
+ * halt ends a path. Every other word of the image is data.
+ * Basic blocks start at 0, at branch targets and after beq, jalr and halt.
+ */
+#define CFG_NONE (-1)
+
+struct cfgBlock {
+  int begin, end;       /* words [begin, end) */
+  int fall, taken;      /* successor blocks, CFG_NONE when absent */
+  int numPreds;
+  int fallPred;         /* the block falling into this one, or CFG_NONE */
+};
+
+struct cfg {
+  int *words;
+  int size;
+  int ext;              /* extensions to decode, ISA_EXT* */
+  unsigned char *isCode;
+  int *blockOf;         /* block of each code word, CFG_NONE for data */
+  struct cfgBlock *blocks;
+  int numBlocks;
+  int numIndirect;      /* jalrs, whose targets are unknown */
+  int numWild;          /* branches and fall-throughs out of the image */
+};
+
+/* reads one decimal word per line; NULL when a line is not a number */
+static inline int *cfgLoadImage(FILE *fp, int *size)
+{
+  char line[1000];
+  int *words = NULL;
+  int n = 0, cap = 0;
+  char *end;
+
+  while(fgets(line, sizeof(line), fp) != NULL){
+    if(n == cap){
+      cap = cap ? 2 * cap : 1024;
+      words = (int *)realloc(words, cap * sizeof(int));
+    }
+    words[n] = (int)strtol(line, &end, 10);
+    if(end == line){
+      free(words);
+      return NULL;
+    }
+    n++;
+  }
+  *size = n;
+  return words != NULL ? words : (int *)malloc(sizeof(int));
+}
+
+static inline int __cfgEndsBlock(int op)
+{
+  return op == OP_BEQ || op == OP_JALR || op == OP_HALT;
+}
+
+static inline void cfgBuild(struct cfg *g, int *words, int size, int ext)
+{
+  unsigned char *leader;
+  int *stack, top = 0;
+  int pc, op, target, b;
+  unsigned w;
+
+  memset(g, 0, sizeof(*g));
+  g->words = words;
+  g->size = size;
+  g->ext = ext;
+  g->isCode = (unsigned char *)calloc(size + 1, 1);
+  g->blockOf = (int *)malloc((size + 1) * sizeof(int));
+  leader = (unsigned char *)calloc(size + 1, 1);
+  stack = (int *)malloc((size + 1) * sizeof(int));
+
+  // 1. Reachability, marking where blocks must start
+  if(size > 0){
+    stack[top++] = 0;
+    leader[0] = 1;
+  }
+  while(top > 0){
+    for(pc = stack[--top]; pc < size && !g->isCode[pc]; pc++){
+      w = words[pc];
+      op = isaOpcode(w, ext);
+      if(isaDecode(op) == NULL)
+        break;          /* not an instruction: the path ends in data */
+      g->isCode[pc] = 1;
+      if(op == OP_HALT)
+        break;
+      if(op == OP_JALR)
+        g->numIndirect++;
+      if(op == OP_BEQ){
+        target = pc + 1 + isaOffset(w);
+        if(target < 0 || target >= size){
+          g->numWild++;
+        } else {
+          leader[target] = 1;
+          if(!g->isCode[target])
+            stack[top++] = target;
+        }
+        if(isaRegA(w) == isaRegB(w))
+          break;        /* always taken */
+      }
+      if(__cfgEndsBlock(op))
+        leader[pc + 1] = 1;
+    }
+    if(pc == size)
+      g->numWild++;
+  }
+
+  // 2. Blocks: maximal runs of code words without a leader inside
+  for(pc = 0; pc < size; pc++){
+    g->blockOf[pc] = CFG_NONE;
+    if(!g->isCode[pc])
+      continue;
+    if(pc == 0 || leader[pc] || !g->isCode[pc - 1]
+       || __cfgEndsBlock(isaOpcode(words[pc - 1], ext))){
+      if((g->numBlocks & (g->numBlocks - 1)) == 0)  /* 0, 1, 2, 4, ...: double */
+        g->blocks = (struct cfgBlock *)realloc(g->blocks,
+                      (2 * g->numBlocks + 1) * sizeof(struct cfgBlock));
+      g->blocks[g->numBlocks].begin = pc;
+      g->numBlocks++;
+    }
+    g->blocks[g->numBlocks - 1].end = pc + 1;
+    g->blockOf[pc] = g->numBlocks - 1;
+  }
+
+  // 3. Edges
+  for(b = 0; b < g->numBlocks; b++){
+    g->blocks[b].fall = g->blocks[b].taken = CFG_NONE;
+    g->blocks[b].fallPred = CFG_NONE;
+    g->blocks[b].numPreds = 0;
+  }
+  for(b = 0; b < g->numBlocks; b++){
+    pc = g->blocks[b].end - 1;
+    w = words[pc];
+    op = isaOpcode(w, ext);
+    if(op == OP_BEQ){
+      target = pc + 1 + isaOffset(w);
+      if(target >= 0 && target < size && g->blockOf[target] != CFG_NONE){
+        g->blocks[b].taken = g->blockOf[target];
+        g->blocks[g->blockOf[target]].numPreds++;
+      }
+      if(isaRegA(w) == isaRegB(w))
+        continue;
+    } else if(op == OP_HALT){
+      continue;
+    }
+    if(pc + 1 < size && g->blockOf[pc + 1] != CFG_NONE){
+      g->blocks[b].fall = g->blockOf[pc + 1];
+      g->blocks[g->blockOf[pc + 1]].numPreds++;
+      g->blocks[g->blockOf[pc + 1]].fallPred = b;
+    }
+  }
+  free(leader);
+  free(stack);
+}
+
+static inline void cfgFree(struct cfg *g)
+{
+  free(g->isCode);
+  free(g->blockOf);
+  free(g->blocks);
+}
+
+#endif
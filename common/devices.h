@@ -0,0 +1,211 @@
+/* Memory-mapped devices: a buffered console and a cycle timer */
+#ifndef LC2K_DEVICES_H
+#define LC2K_DEVICES_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The devices answer the top 16 words of the 32-bit address space, so a
+ * program reaches them with a negative offset from register 0:
+ *
+ *   -1  console  sw: writes the low byte
+ *   -2  putint   sw: writes the word in decimal
+ *   -3  timer    lw: cycles run so far (instructions in the functional
+ *                simulator), low 32 bits
+ *   -4  alarm    sw n: goes off n cycles from now (n <= 0 turns it off)
+ *                lw: 1 once it went off, 0 before
+ *
+ * Any other access to the region is out of bound, as it is without devices.
+ * The simulators only look here after an access already failed their
+ * bounds check, so ordinary accesses cost nothing more.
+ *
+ * Console bytes go into a ring that a writer thread drains to the file
+ * in large writes, so printing costs a store instead of a system call.
+ * The writer is woken every DEV_BATCH bytes, when the ring is full and on
+ * devFlush(); otherwise it drains the ring every DEV_TICKMS milliseconds.
+ */
+#define DEV_BASE    0xfffffff0u
+#define DEV_CONSOLE 0xffffffffu
+#define DEV_PUTINT  0xfffffffeu
+#define DEV_TIMER   0xfffffffdu
+#define DEV_ALARM   0xfffffffcu
+
+#define DEV_RINGSIZE (1 << 16)
+#define DEV_BATCH    4096
+#define DEV_TICKMS   10
+
+typedef struct devStruct {
+  int fd;                /* console output */
+  char *ring;
+  unsigned long head;    /* written by the simulator only */
+  unsigned long tail;    /* written by the writer only */
+  int closing;
+  pthread_mutex_t lock;
+  pthread_cond_t more;   /* bytes to write, or closing */
+  pthread_cond_t room;   /* the writer moved tail */
+  pthread_t writer;
+  long alarm;            /* cycle the alarm goes off, -1 when off */
+} devices;
+
+#define devAddr(addr) ((unsigned int)(addr) >= DEV_BASE)
+
+static void *__devWriter(void *arg)
+{
+  devices *dev = (devices *)arg;
+  unsigned long head, tail = dev->tail;
+  struct timespec ts;
+  size_t at, len;
+  ssize_t done;
+
+  while (1) {
+    pthread_mutex_lock(&dev->lock);
+    while (__atomic_load_n(&dev->head, __ATOMIC_ACQUIRE) == tail && !dev->closing) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += DEV_TICKMS * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&dev->more, &dev->lock, &ts);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    head = __atomic_load_n(&dev->head, __ATOMIC_ACQUIRE);
+    if (head == tail)
+      break; /* closing, and nothing left */
+
+    /* up to the end of the ring, the rest on the next turn */
+    while (tail != head) {
+      at = tail % DEV_RINGSIZE;
+      len = head - tail < DEV_RINGSIZE - at ? head - tail : DEV_RINGSIZE - at;
+      done = write(dev->fd, dev->ring + at, len);
+      /* a console that cannot be written drops its output rather than stall */
+      tail += done > 0 ? (size_t)done : len;
+    }
+    __atomic_store_n(&dev->tail, tail, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&dev->lock);
+    pthread_cond_broadcast(&dev->room);
+    pthread_mutex_unlock(&dev->lock);
+  }
+  return NULL;
+}
+
+static inline void __devKick(devices *dev)
+{
+  pthread_mutex_lock(&dev->lock);
+  pthread_cond_signal(&dev->more);
+  pthread_mutex_unlock(&dev->lock);
+}
+
+/* waits until the writer has taken everything up to `upto` off the ring */
+static inline void __devWait(devices *dev, unsigned long upto)
+{
+  pthread_mutex_lock(&dev->lock);
+  while ((long)(upto - __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE)) > 0) {
+    pthread_cond_signal(&dev->more);
+    pthread_cond_wait(&dev->room, &dev->lock);
+  }
+  pthread_mutex_unlock(&dev->lock);
+}
+
+static inline void __devPut(devices *dev, char c)
+{
+  unsigned long head = dev->head;
+
+  if (head - __atomic_load_n(&dev->tail, __ATOMIC_ACQUIRE) == DEV_RINGSIZE)
+    __devWait(dev, head - DEV_RINGSIZE + DEV_BATCH);
+  dev->ring[head % DEV_RINGSIZE] = c;
+  __atomic_store_n(&dev->head, head + 1, __ATOMIC_RELEASE);
+  if ((head + 1) % DEV_BATCH == 0)
+    __devKick(dev);
+}
+
+/* console output to fd, the timer off; -1 when the writer cannot start */
+static inline int devOpen(devices *dev, int fd)
+{
+  dev->fd = fd;
+  dev->ring = (char *)malloc(DEV_RINGSIZE);
+  dev->head = dev->tail = 0;
+  dev->closing = 0;
+  dev->alarm = -1;
+  if (dev->ring == NULL)
+    return -1;
+  pthread_mutex_init(&dev->lock, NULL);
+  pthread_cond_init(&dev->more, NULL);
+  pthread_cond_init(&dev->room, NULL);
+  if (pthread_create(&dev->writer, NULL, __devWriter, dev) != 0) {
+    pthread_cond_destroy(&dev->room);
+    pthread_cond_destroy(&dev->more);
+    pthread_mutex_destroy(&dev->lock);
+    free(dev->ring);
+    return -1;
+  }
+  return 0;
+}
+
+/* returns once every console byte so far is written */
+static inline void devFlush(devices *dev)
+{
+  __devWait(dev, dev->head);
+}
+
+/* writes out the console and stops the writer; fd is left open */
+static inline void devClose(devices *dev)
+{
+  pthread_mutex_lock(&dev->lock);
+  dev->closing = 1;
+  pthread_cond_signal(&dev->more);
+  pthread_mutex_unlock(&dev->lock);
+  pthread_join(dev->writer, NULL);
+  pthread_cond_destroy(&dev->room);
+  pthread_cond_destroy(&dev->more);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev->ring);
+}
+
+/* a new program: the alarm is off again */
+static inline void devReset(devices *dev)
+{
+  dev->alarm = -1;
+}
+
+/* the word at addr as of cycle `now`, -1 when it cannot be read */
+static inline int devRead(devices *dev, unsigned int addr, long now, int *data)
+{
+  switch (addr) {
+    case DEV_TIMER:
+      *data = (int)now;
+      return 0;
+    case DEV_ALARM:
+      *data = dev->alarm >= 0 && now >= dev->alarm;
+      return 0;
+  }
+  return -1;
+}
+
+/* -1 when addr cannot be written */
+static inline int devWrite(devices *dev, unsigned int addr, long now, int data)
+{
+  char digits[12];
+  int i, n;
+
+  switch (addr) {
+    case DEV_CONSOLE:
+      __devPut(dev, (char)data);
+      return 0;
+    case DEV_PUTINT:
+      n = snprintf(digits, sizeof(digits), "%d", data);
+      for (i = 0; i < n; i++)
+        __devPut(dev, digits[i]);
+      return 0;
+    case DEV_ALARM:
+      dev->alarm = data > 0 ? now + data : -1;
+      return 0;
+  }
+  return -1;
+}
+
+#endif
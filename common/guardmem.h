@@ -0,0 +1,166 @@
+/* Guard-page protected flat memory for the unchecked fast simulation mode */
+#ifndef LC2K_GUARDMEM_H
+#define LC2K_GUARDMEM_H
+
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * The accessible words sit in the middle of a PROT_NONE reservation that
+ * covers every index a 32-bit address can produce, so accesses can skip
+ * the bounds compare: an out-of-bound index faults, and the SIGSEGV handler
+ * turns the fault back into the word index for the caller's diagnostic.
+ * The end of the accessible words is placed on a page boundary so the very
+ * first word past the bound already faults (with `negative` set, `words`
+ * should fill whole pages so no index below 0 lands on an accessible page).
+ *
+ * Regions and the handler are shared by the process: the table is changed
+ * under a lock and read by the handler with atomic loads, the handler is
+ * installed once, and a fault that is not on a region armed by the
+ * faulting thread goes on to the handler that was there before.
+ */
+#define GM_MAXREGIONS 4
+
+typedef struct guardMemStruct {
+  char *region;        /* whole reservation */
+  size_t size;
+  int *base;           /* word 0 */
+  unsigned long words; /* accessible words [0, words) */
+} guardMem;
+
+typedef struct guardTrapStruct {
+  sigjmp_buf env;
+  long addr;           /* faulting word index */
+  const struct guardMemStruct *gm; /* and the region it is in */
+} guardTrap;
+
+static guardMem *__guardRegions[GM_MAXREGIONS];
+static pthread_mutex_t __guardLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t __guardOnce = PTHREAD_ONCE_INIT;
+static struct sigaction __guardOldAction;
+static __thread guardTrap *__guardTrap;
+
+static void __guardMemHandler(int sig, siginfo_t *info, void *ctx)
+{
+  char *fault = (char *)info->si_addr;
+  guardMem *gm;
+  int i;
+
+  for (i = 0; __guardTrap != NULL && i < GM_MAXREGIONS; i++) {
+    gm = __atomic_load_n(&__guardRegions[i], __ATOMIC_ACQUIRE);
+    if (gm == NULL || fault < gm->region || fault >= gm->region + gm->size)
+      continue;
+    __guardTrap->addr = (fault - (char *)gm->base) / (long)sizeof(int);
+    __guardTrap->gm = gm;
+    siglongjmp(__guardTrap->env, 1);
+  }
+  /* not ours: chain, or let the fault kill the process as usual once
+     the instruction runs again */
+  if (__guardOldAction.sa_flags & SA_SIGINFO)
+    __guardOldAction.sa_sigaction(sig, info, ctx);
+  else if (__guardOldAction.sa_handler != SIG_DFL && __guardOldAction.sa_handler != SIG_IGN)
+    __guardOldAction.sa_handler(sig);
+  else
+    signal(sig, SIG_DFL);
+}
+
+static void __guardMemInstall(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = __guardMemHandler;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, &__guardOldAction);
+}
+
+/*
+ * Map `words` accessible words. `negative` also guards negative indices
+ * (signed addresses); otherwise only [0, 2^32) is covered.
+ */
+static inline int guardMemMap(guardMem *gm, unsigned long words, int negative)
+{
+  size_t pagesz = sysconf(_SC_PAGESIZE);
+  size_t span = (size_t)sizeof(int) << 32;
+  size_t low = negative ? span / 2 : 0;
+  size_t high = span - low;
+  size_t bytes = (words * sizeof(int) + pagesz - 1) / pagesz * pagesz;
+  int i;
+
+  gm->size = low + bytes + high;
+  gm->region = (char *)mmap(NULL, gm->size, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (gm->region == MAP_FAILED)
+    return -1;
+  if (bytes != 0 && mprotect(gm->region + low, bytes, PROT_READ | PROT_WRITE) < 0) {
+    munmap(gm->region, gm->size);
+    return -1;
+  }
+  gm->base = (int *)(gm->region + low + bytes - words * sizeof(int));
+  gm->words = words;
+  pthread_mutex_lock(&__guardLock);
+  for (i = 0; i < GM_MAXREGIONS && __guardRegions[i] != NULL; i++)
+    ;
+  if (i < GM_MAXREGIONS)
+    __atomic_store_n(&__guardRegions[i], gm, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&__guardLock);
+  if (i == GM_MAXREGIONS) {
+    munmap(gm->region, gm->size);
+    return -1;
+  }
+  return 0;
+}
+
+static inline void guardMemUnmap(guardMem *gm)
+{
+  int i;
+
+  pthread_mutex_lock(&__guardLock);
+  for (i = 0; i < GM_MAXREGIONS; i++)
+    if (__guardRegions[i] == gm)
+      __atomic_store_n(&__guardRegions[i], NULL, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&__guardLock);
+  munmap(gm->region, gm->size);
+  gm->region = NULL;
+  gm->base = NULL;
+}
+
+/* drop write access once the contents are loaded (e.g. instruction memory) */
+static inline void guardMemReadOnly(guardMem *gm)
+{
+  size_t pagesz = sysconf(_SC_PAGESIZE);
+  char *start = (char *)((unsigned long)gm->base / pagesz * pagesz);
+
+  mprotect(start, (char *)(gm->base + gm->words) - start, PROT_READ);
+}
+
+/*
+ * Faults on the guard pages of this thread land on trap->env from here on.
+ * Arm it in the frame that runs the unchecked accesses, then sigsetjmp on
+ * trap.env as the whole of an if: it comes back 1 when a guarded access
+ * faulted, with trap.addr holding the word index and trap.gm its region.
+ * Disarm it on every way out of that frame, before trap goes away.
+ *
+ *   guardMemArm(&trap);
+ *   if(sigsetjmp(trap.env, 1) != 0)
+ *     ...the fault...
+ *   ...
+ *   guardMemDisarm();
+ */
+static inline void guardMemArm(guardTrap *trap)
+{
+  pthread_once(&__guardOnce, __guardMemInstall);
+  __guardTrap = trap;
+}
+
+static inline void guardMemDisarm(void)
+{
+  __guardTrap = NULL;
+}
+
+#endif
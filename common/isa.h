@@ -0,0 +1,191 @@
+/* LC-2K instruction set: the one table the assembler, simulators and tools decode with */
+#ifndef LC2K_ISA_H
+#define LC2K_ISA_H
+
+#include <string.h>
+
+/*
+ * ISA_TABLE(X) lists every instruction as  X(NAME, mnemonic, opcode, format).
+ * Everything below is generated from it: OP_<NAME>, and isaTable[] indexed
+ * by opcode. Opcodes past 7 are extensions: their low 3 bits go in the
+ * opcode field and the rest in the unused bits above it. Without the
+ * extensions those bits must be 0, so an extension instruction is never
+ * taken for a base one.
+ *
+ *   R: opcode | regA | regB | 0 ... | destReg
+ *   I: opcode | regA | regB | offset (16 bits, signed)
+ *   J: opcode | regA | regB | 0 ...
+ *   O: opcode | 0 ...
+ */
+#define ISA_TABLE(X)             \
+  X(ADD,  "add",  0, RTYPE)      \
+  X(NOR,  "nor",  1, RTYPE)      \
+  X(LW,   "lw",   2, ITYPE)      \
+  X(SW,   "sw",   3, ITYPE)      \
+  X(BEQ,  "beq",  4, ITYPE)      \
+  X(JALR, "jalr", 5, JTYPE)      \
+  X(HALT, "halt", 6, OTYPE)      \
+  X(NOOP, "noop", 7, OTYPE)      \
+  X(SWAP, "swap", 8, ITYPE)      \
+  X(MUL,  "mul",  9, RTYPE)      \
+  X(DIV,  "div", 10, RTYPE)      \
+  X(SLL,  "sll", 11, RTYPE)      \
+  X(SRL,  "srl", 12, RTYPE)
+
+#define ISA_OPSHIFT    22
+#define ISA_EXTMASK    0x3ff /* opcode field and the unused bits above it */
+#define ISA_MAXBASEOP  7
+#define ISA_BADOP      (-1)  /* isaOpcode() of a word that is no instruction */
+
+/* extensions isaOpcode() decodes, or'ed together */
+#define ISA_EXTARITH   0x1   /* mul, div, sll, srl */
+#define ISA_EXTSWAP    0x2   /* swap, which only multi-core runs execute */
+#define ISA_EXTALL     (ISA_EXTARITH | ISA_EXTSWAP)
+
+enum instType {RTYPE, ITYPE, JTYPE, OTYPE};
+
+enum isaOpcode {
+#define ISA_ENUM(name, mnemonic, opcode, format) OP_##name = opcode,
+  ISA_TABLE(ISA_ENUM)
+#undef ISA_ENUM
+  ISA_NUMOPS
+};
+
+struct isaEntry {
+  const char *name;     /* NULL for opcodes nobody defines */
+  int opcode;
+  enum instType format;
+  int numArgs;          /* operands the assembler expects */
+};
+
+static const struct isaEntry isaTable[ISA_NUMOPS] = {
+#define ISA_ENTRY(name, mnemonic, opcode, format) \
+  [opcode] = {mnemonic, opcode, format, format == OTYPE ? 0 : format == JTYPE ? 2 : 3},
+  ISA_TABLE(ISA_ENTRY)
+#undef ISA_ENTRY
+};
+
+// Decoding ////////////////////////////////////////////
+/* ISA_BADOP for an extension opcode ext does not enable; isaDecode()
+   still rejects the opcodes nobody defines */
+static inline int isaOpcode(unsigned int w, int ext)
+{
+  int op = (w >> ISA_OPSHIFT) & ISA_EXTMASK;
+
+  if(op <= ISA_MAXBASEOP)
+    return op;
+  if(op == OP_SWAP)
+    return ext & ISA_EXTSWAP ? op : ISA_BADOP;
+  return ext & ISA_EXTARITH ? op : ISA_BADOP;
+}
+static inline int isaRegA(unsigned int w)   { return (w >> 19) & 0x7; }
+static inline int isaRegB(unsigned int w)   { return (w >> 16) & 0x7; }
+static inline int isaDest(unsigned int w)   { return w & 0x7; }
+static inline int isaOffset(unsigned int w) { return (int)(short)(w & 0xffff); }
+
+/* the table entry of an opcode, NULL when it is not an instruction */
+static inline const struct isaEntry *isaDecode(int opcode)
+{
+  if((unsigned)opcode >= ISA_NUMOPS || isaTable[opcode].name == NULL)
+    return NULL;
+  return &isaTable[opcode];
+}
+
+static inline const struct isaEntry *isaByName(const char *name)
+{
+  int i;
+
+  for(i = 0; i < ISA_NUMOPS; i++){
+    if(isaTable[i].name != NULL && !strcmp(isaTable[i].name, name))
+      return &isaTable[i];
+  }
+  return NULL;
+}
+
+// Encoding ////////////////////////////////////////////
+static inline unsigned int isaEncode(int opcode, int regA, int regB, int field)
+{
+  return ((unsigned)opcode << ISA_OPSHIFT) | ((regA & 0x7) << 19)
+         | ((regB & 0x7) << 16) | (field & 0xffff);
+}
+
+/*
+ * The arithmetic extension, destReg = regA op regB, defined for every
+ * input: shifts take the low 5 bits of regB and srl shifts in zeros; div
+ * truncates toward zero, x / 0 is -1 and INT_MIN / -1 is INT_MIN.
+ */
+static inline int isaArith(int opcode)
+{
+  return opcode >= OP_MUL && opcode <= OP_SRL;
+}
+static inline int isaArithResult(int opcode, int a, int b)
+{
+  switch(opcode){
+    case OP_MUL:
+      return (int)((unsigned)a * (unsigned)b);
+    case OP_DIV:
+      if(b == 0)
+        return -1;
+      return b == -1 ? (int)(0u - (unsigned)a) : a / b;
+    case OP_SLL:
+      return (int)((unsigned)a << (b & 31));
+    case OP_SRL:
+      return (int)((unsigned)a >> (b & 31));
+  }
+  return 0;
+}
+
+/*
+ * Registers an instruction reads and writes, as bit masks over r0..r7.
+ * r0 always reads as 0, so it is left out of both.
+ */
+static inline int isaReads(unsigned int w, int ext)
+{
+  int mask;
+
+  switch(isaOpcode(w, ext)){
+    case OP_ADD:
+    case OP_NOR:
+    case OP_SW:
+    case OP_BEQ:
+    case OP_SWAP:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SLL:
+    case OP_SRL:
+      mask = (1 << isaRegA(w)) | (1 << isaRegB(w));
+      break;
+    case OP_LW:
+    case OP_JALR:
+      mask = 1 << isaRegA(w);
+      break;
+    default:
+      mask = 0;
+  }
+  return mask & ~1;
+}
+static inline int isaWrites(unsigned int w, int ext)
+{
+  int mask;
+
+  switch(isaOpcode(w, ext)){
+    case OP_ADD:
+    case OP_NOR:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SLL:
+    case OP_SRL:
+      mask = 1 << isaDest(w);
+      break;
+    case OP_LW:
+    case OP_JALR:
+    case OP_SWAP:
+      mask = 1 << isaRegB(w);
+      break;
+    default:
+      mask = 0;
+  }
+  return mask & ~1;
+}
+
+#endif
@@ -0,0 +1,220 @@
+/* Sparse paged word memory shared by the LC-2K simulators */
+#ifndef LC2K_PAGEMEM_H
+#define LC2K_PAGEMEM_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Word addresses are split as  [ dir | table | offset ]
+ *   offset: PM_PAGEBITS  (1024 words = 4 KB pages)
+ *   table : PM_TABLEBITS (1024 pages per directory entry)
+ *   dir   : whatever is left of the configured address bits
+ * Pages and tables are allocated on first write; reads of untouched
+ * memory return 0 without allocating anything. The calls that allocate
+ * return -1 when memory runs out and leave every word as it was; pages
+ * they allocated before that stay, holding 0.
+ */
+#define PM_PAGEBITS   10
+#define PM_TABLEBITS  10
+#define PM_PAGEWORDS  (1 << PM_PAGEBITS)
+#define PM_PAGEMASK   (PM_PAGEWORDS - 1)
+#define PM_TABLEMASK  ((1 << PM_TABLEBITS) - 1)
+#define PM_NOTAG      (~0u)
+#define PM_MINBITS    PM_PAGEBITS
+#define PM_MAXBITS    32
+
+typedef struct pageMemStruct {
+  int ***dir;           /* dir -> table -> page */
+  unsigned long limit;  /* number of addressable words */
+  unsigned int numDir;
+  unsigned int numPages;
+  /* last translated page, checked before walking the tables */
+  unsigned int lastTag;
+  int *lastPage;
+} pageMem;
+
+static inline int pageMemInit(pageMem *pm, int addrBits)
+{
+  unsigned long limit = 1ul << addrBits;
+
+  pm->limit = limit;
+  pm->numDir = (limit + (1ul << (PM_PAGEBITS+PM_TABLEBITS)) - 1)
+                 >> (PM_PAGEBITS+PM_TABLEBITS);
+  pm->numPages = 0;
+  pm->lastTag = PM_NOTAG;
+  pm->lastPage = NULL;
+  pm->dir = (int ***)calloc(pm->numDir, sizeof(int **));
+  return pm->dir == NULL ? -1 : 0;
+}
+
+static inline void pageMemFree(pageMem *pm)
+{
+  unsigned int d, t;
+
+  for (d = 0; d < pm->numDir; d++) {
+    if (pm->dir[d] == NULL)
+      continue;
+    for (t = 0; t <= PM_TABLEMASK; t++)
+      free(pm->dir[d][t]);
+    free(pm->dir[d]);
+  }
+  free(pm->dir);
+  pm->dir = NULL;
+  pm->numDir = pm->numPages = 0;
+  pm->lastTag = PM_NOTAG;
+  pm->lastPage = NULL;
+}
+
+/* walk the tables for page number `tag`, allocating it when `alloc` is set;
+   NULL when it is not there or cannot be allocated */
+static inline int *__pageMemLookup(pageMem *pm, unsigned int tag, int alloc)
+{
+  int ***table = &pm->dir[tag >> PM_TABLEBITS];
+  int **page;
+
+  if (*table == NULL) {
+    if (!alloc)
+      return NULL;
+    if ((*table = (int **)calloc(PM_TABLEMASK+1, sizeof(int *))) == NULL)
+      return NULL;
+  }
+  page = &(*table)[tag & PM_TABLEMASK];
+  if (*page == NULL) {
+    if (!alloc)
+      return NULL;
+    if ((*page = (int *)calloc(PM_PAGEWORDS, sizeof(int))) == NULL)
+      return NULL;
+    pm->numPages++;
+  }
+  pm->lastTag = tag;
+  pm->lastPage = *page;
+  return *page;
+}
+
+/* callers are responsible for checking addr < pm->limit */
+static inline int pageMemRead(pageMem *pm, unsigned int addr)
+{
+  unsigned int tag = addr >> PM_PAGEBITS;
+
+  if (tag != pm->lastTag && __pageMemLookup(pm, tag, 0) == NULL)
+    return 0;
+  return pm->lastPage[addr & PM_PAGEMASK];
+}
+
+static inline int pageMemWrite(pageMem *pm, unsigned int addr, int data)
+{
+  unsigned int tag = addr >> PM_PAGEBITS;
+
+  if (tag != pm->lastTag && __pageMemLookup(pm, tag, 1) == NULL)
+    return -1;
+  pm->lastPage[addr & PM_PAGEMASK] = data;
+  return 0;
+}
+
+/* every word back to 0, the pages stay allocated for the next use */
+static inline void pageMemClear(pageMem *pm)
+{
+  unsigned int d, t;
+
+  for (d = 0; d < pm->numDir; d++) {
+    if (pm->dir[d] == NULL)
+      continue;
+    for (t = 0; t <= PM_TABLEMASK; t++)
+      if (pm->dir[d][t] != NULL)
+        memset(pm->dir[d][t], 0, PM_PAGEWORDS * sizeof(int));
+  }
+}
+
+/* deep copy that only touches the pages src actually allocated */
+static inline int pageMemClone(pageMem *dst, const pageMem *src)
+{
+  unsigned int d, t;
+
+  dst->limit = src->limit;
+  dst->numDir = src->numDir;
+  dst->numPages = src->numPages;
+  dst->lastTag = PM_NOTAG;
+  dst->lastPage = NULL;
+  dst->dir = (int ***)calloc(src->numDir, sizeof(int **));
+  if (dst->dir == NULL)
+    return -1;
+  for (d = 0; d < src->numDir; d++) {
+    if (src->dir[d] == NULL)
+      continue;
+    dst->dir[d] = (int **)calloc(PM_TABLEMASK+1, sizeof(int *));
+    if (dst->dir[d] == NULL)
+      goto fail;
+    for (t = 0; t <= PM_TABLEMASK; t++) {
+      if (src->dir[d][t] == NULL)
+        continue;
+      dst->dir[d][t] = (int *)malloc(PM_PAGEWORDS * sizeof(int));
+      if (dst->dir[d][t] == NULL)
+        goto fail;
+      memcpy(dst->dir[d][t], src->dir[d][t], PM_PAGEWORDS * sizeof(int));
+    }
+  }
+  return 0;
+fail:
+  pageMemFree(dst);
+  return -1;
+}
+
+/* copy words [0, n) into a zeroed flat array, skipping untouched pages */
+static inline void pageMemCopyOut(pageMem *pm, int *flat, unsigned long n)
+{
+  unsigned long addr, len;
+  int *page;
+
+  for (addr = 0; addr < n; addr += PM_PAGEWORDS) {
+    len = n - addr < PM_PAGEWORDS ? n - addr : PM_PAGEWORDS;
+    if ((page = __pageMemLookup(pm, addr >> PM_PAGEBITS, 0)) != NULL)
+      memcpy(flat + addr, page, len * sizeof(int));
+  }
+}
+
+/* allocate the page of words [addr, addr+len) of a flat array, all within
+   one page, when they hold non-zero data; a new page reads as 0, so what
+   the memory holds does not change */
+static inline int pageMemReservePage(pageMem *pm, const int *flat, unsigned long addr,
+                                     unsigned long len)
+{
+  unsigned long i;
+
+  if (__pageMemLookup(pm, addr >> PM_PAGEBITS, 0) != NULL)
+    return 0;
+  for (i = 0; i < len; i++)
+    if (flat[addr + i] != 0)
+      return __pageMemLookup(pm, addr >> PM_PAGEBITS, 1) == NULL ? -1 : 0;
+  return 0;
+}
+
+/* copy words [addr, addr+len) of a flat array back, all within one page;
+   nothing is copied when the page cannot be allocated */
+static inline int pageMemCopyInPage(pageMem *pm, const int *flat, unsigned long addr,
+                                    unsigned long len)
+{
+  int *page;
+
+  if (pageMemReservePage(pm, flat, addr, len) < 0)
+    return -1;
+  if ((page = __pageMemLookup(pm, addr >> PM_PAGEBITS, 0)) != NULL)
+    memcpy(page + (addr & PM_PAGEMASK), flat + addr, len * sizeof(int));
+  return 0;
+}
+
+/* copy a flat array back, allocating only pages that hold non-zero data;
+   every page is allocated before any word is copied */
+static inline int pageMemCopyIn(pageMem *pm, const int *flat, unsigned long n)
+{
+  unsigned long addr;
+
+  for (addr = 0; addr < n; addr += PM_PAGEWORDS)
+    if (pageMemReservePage(pm, flat, addr, n - addr < PM_PAGEWORDS ? n - addr : PM_PAGEWORDS) < 0)
+      return -1;
+  for (addr = 0; addr < n; addr += PM_PAGEWORDS)
+    pageMemCopyInPage(pm, flat, addr, n - addr < PM_PAGEWORDS ? n - addr : PM_PAGEWORDS);
+  return 0;
+}
+
+#endif
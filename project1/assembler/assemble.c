@@ -1,9 +1,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include "../../common/isa.h"
 
 #define MAXLINELENGTH 1000
 #define MAXLABELSIZE  6
+#define MAXNESTING    16 /* .include and macro expansion depth */
+#define MAXLOCALS     0xfffff /* macro-local labels, as "@" and 5 hex digits */
+#define MAXTHREADS    16
+#define CHUNKSIZE     4096 /* statements per second-pass job */
 #define MAXINT16 32767
 #define MININT16 (-32768)
 #define MAXINT32 2147483647
@@ -12,7 +20,6 @@
 // Types ///////////////////////////////////////////
 typedef int word_t;
 typedef short half_t;
-enum instType {RTYPE, ITYPE, JTYPE, OTYPE};
 
 struct symbol{
   char name[MAXLABELSIZE+2];
@@ -20,6 +27,21 @@ struct symbol{
   struct symbol *next;
 };
 
+struct macroLine{
+  char *tok[5]; /* label, opcode, arg0..arg2 */
+  unsigned short col[5];
+  int line;
+  int local;    /* its label is the body's local-th, -1 when it has none */
+};
+struct macro{
+  char name[MAXLABELSIZE+2];
+  char *param[3];
+  struct macroLine *body;
+  int numLines;
+  int numLocals;
+  struct macro *next;
+};
+
 typedef struct {
   word_t destReg:  3; 
   word_t unused2: 13;
@@ -55,26 +77,51 @@ typedef union instruction {
   word_t  x32;
 } instruction;
 
+struct errorRecord{
+  int code, addr;
+  const char *file;
+  int line, col;
+  char arg[MAXLINELENGTH];
+};
+
+struct statement {
+  const char *file;    /* source file, after .include */
+  int line;            /* source line number */
+  char *label;         /* tokens as read, "" when absent; */
+  char *opcode;        /* all five live in label's block */
+  char *arg[3];
+  unsigned short col[5]; /* 1-based column of each token, 0 when absent */
+  instruction inst;    /* filled in by the second pass */
+  int labelRef;        /* address operand named a label */
+  int external;        /* ... one that another object defines */
+  int removed;         /* dropped by the optimizer */
+};
+
 // Globals ///////////////////////////////////////////
 static struct symbol *entry;
+static struct symbol *lastSymbol;
+static struct symbol **symbolIndex;
+static unsigned symbolMask, numSymbols;
 static struct symbol notfound = {
   "404", 0, 0
 };
-static struct isa {
-  char *name;
-  int opcode;
-  enum instType format;
-} isa[] = {
-  {"add", 0, RTYPE},
-  {"nor", 1, RTYPE},
-  {"lw",  2, ITYPE},
-  {"sw",  3, ITYPE},
-  {"beq", 4, ITYPE},
-  {"jalr", 5, JTYPE},
-  {"halt", 6, OTYPE},
-  {"noop", 7, OTYPE},
-};
-static int pc;
+static __thread int pc; /* each second-pass thread translates its own */
+static struct statement *stmts;
+static int numStmts, stmtCap;
+static struct macro *macros;
+static int numLocalLabels; /* renamed so far, see __statement() */
+static char **sources; /* names of every file read */
+static int numSources;
+static int objectMode; /* -c: undefined globals become imports */
+static int extended;   /* -x: the extension instructions assemble too */
+static int maxErrors;  /* -e: report up to this many errors, 0 stops at the first */
+static int numErrors;
+static struct {        /* the line pass one is on, for error reports */
+  const char *file;
+  int line;
+  char **tok;
+  const unsigned short *col;
+} where;
 
 // Errors ///////////////////////////////////////////
 #define ER_WRONGUSAGE   0
@@ -88,9 +135,12 @@ static int pc;
 #define ER_LABELINVALID 8
 #define ER_DUPLICATE    9
 #define ER_UNDEFINED    10
+#define ER_NESTING      11
+#define ER_MACRO        12
+#define ER_EXTENSION    13
 
 char* errorMsg[] = {
-  [ER_WRONGUSAGE]   "usage: assemble <assembly-code-file> <machine-code-file>",
+  [ER_WRONGUSAGE]   "usage: assemble [-c] [-x] [-O] [-S] [-i cache-file] [-e max-errors] [-L label-map] <assembly-code-file> <machine-code-file|object-file>",
   [ER_OPENFILE]     "error in opening file",
   [ER_LINEOVFL]     "line too long",
   [ER_UNRECOGNIZE]  "unrecognized opcode",
@@ -101,19 +151,40 @@ char* errorMsg[] = {
   [ER_LABELINVALID] "valid labels contain a maximum of 6 characters and can consist of letters and numbers (but must start with a letter)",
   [ER_DUPLICATE]    "duplicate labels",
   [ER_UNDEFINED]    "use of undefined label",
+  [ER_NESTING]      ".include or macro nested too deep",
+  [ER_MACRO]        "bad macro definition",
+  [ER_EXTENSION]    "extension instruction without -x",
 };
 
 // Functions ///////////////////////////////////////////
 instruction translate(int, char*, char*, char*, char*);
 void addLabel(char*, word_t);
 struct symbol*  readLabel(const char*);
+int     isGlobalLabel(const char*);
 #ifdef _DEBUG
 void    checkLabels();
 #else
 #define checkLabels() {}
 #endif
 void    freeSymbols();
-int     readAndParse(FILE*, char*, char*, char*, char*, char*);
+void    relocateLabels(const int*);
+void    writeLabels(FILE*);
+int     readAndParse(FILE*, char*, char*, char*, char*, char*, unsigned short*);
+void    setTokens(struct statement*, char**);
+void    freeTokens(struct statement*);
+void    readProgram(FILE*, const char*);
+void    resolveExternals();
+void    freeProgram();
+void    writeObject(FILE*);
+void    loadCache(const char*, const char*);
+int     reuseWord(int, word_t*);
+void    patchOutput(const char*);
+void    saveCache(const char*, const char*);
+void    translateProgram(int, int);
+void    reportError(const struct errorRecord*);
+void    writeTranslation(FILE*);
+void    optimize(FILE*);
+void    schedule(FILE*);
 int     isNumber(const char*);
 void    raiseError(int, const char*);
 
@@ -121,52 +192,116 @@ void    raiseError(int, const char*);
 //                      main start                       //
 ///////////////////////////////////////////////////////////
 int main(int argc, char *argv[]){
-  char *inFileString, *outFileString;
-  FILE *inFilePtr, *outFilePtr;
-  char label[MAXLINELENGTH], opcode[MAXLINELENGTH], arg0[MAXLINELENGTH], arg1[MAXLINELENGTH], arg2[MAXLINELENGTH];
-  instruction inst;
+  char *inFileString, *outFileString, *cacheFileString = NULL, *mapFileString = NULL;
+  FILE *inFilePtr, *outFilePtr, *mapFilePtr = NULL;
+  int opt, optimizing = 0, scheduling = 0, plain;
+  struct statement *stmt;
 
-  if(argc != 3){
+  while((opt = getopt(argc, argv, "ce:i:L:OSx")) != -1){
+    switch(opt){
+      case 'c':
+        objectMode = 1;
+        break;
+      case 'e':
+        maxErrors = atoi(optarg);
+        if(maxErrors < 1)
+          raiseError(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'i':
+        cacheFileString = optarg;
+        break;
+      case 'L':
+        mapFileString = optarg;
+        break;
+      case 'O':
+        optimizing = 1;
+        break;
+      case 'S':
+        scheduling = 1;
+        break;
+      case 'x':
+        extended = 1;
+        break;
+      default:
+        raiseError(ER_WRONGUSAGE, argv[0]);
+    }
+  }
+  if(argc - optind != 2){
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+  /* the cache works on the plain statement-per-word output only */
+  if(cacheFileString && (objectMode || optimizing || scheduling)){
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+  /* labels of an object only get their addresses from the linker */
+  if(mapFileString && objectMode){
     raiseError(ER_WRONGUSAGE, argv[0]);
   }
 
-  inFileString = argv[1];
-  outFileString = argv[2];
+  inFileString = argv[optind];
+  outFileString = argv[optind+1];
   inFilePtr = fopen(inFileString, "r");
   if(inFilePtr == NULL){
     raiseError(ER_OPENFILE, inFileString);
   }
-  outFilePtr = fopen(outFileString, "w");
+  outFilePtr = fopen(outFileString, cacheFileString ? "a" : "w");
   if(outFilePtr == NULL) {
     raiseError(ER_OPENFILE, outFileString);
   }
-
-  // 1. First pass: calculate the address for every symbolic label
-  pc = 0;
-  while(readAndParse(inFilePtr, label, opcode, arg0, arg1, arg2)){
-    if(opcode[0] == '\0')
-      continue;
-    if(strlen(label) > 0){
-      addLabel(label, pc);
-    }
-    pc++;
+  if(mapFileString){
+    mapFilePtr = fopen(mapFileString, "w");
+    if(mapFilePtr == NULL)
+      raiseError(ER_OPENFILE, mapFileString);
   }
-  rewind(inFilePtr);
+
+  // 1. First pass: read the statements and calculate the address for every symbolic label
+  readProgram(inFilePtr, inFileString);
+  fclose(inFilePtr);
+  if(objectMode)
+    resolveExternals();
 
   checkLabels();
-  // 2. Second pass: generate a machine-language instruction (in decimal)
-  pc = 0;
-  while(readAndParse(inFilePtr, label, opcode, arg0, arg1, arg2)){
-    if(opcode[0] == '\0')
-      continue;
-    inst = translate(pc, opcode, arg0, arg1, arg2);
+  if(cacheFileString){
+    fclose(outFilePtr);
+    loadCache(cacheFileString, outFileString);
+  }
+  // 2. Second pass: generate a machine-language instruction for every statement
+  plain = !objectMode && !cacheFileString && !optimizing && !scheduling;
+  translateProgram(cacheFileString != NULL, plain);
+
+  // 3. Optionally reorder and shrink the program, relocating what moved
+  if(scheduling)
+    schedule(stdout);
+  if(optimizing)
+    optimize(stdout);
+
+  // 4. Write the words out, or an object that still has to be linked
+  if(objectMode){
+    writeObject(outFilePtr);
+  } else if(cacheFileString){
+    patchOutput(outFileString);
+    saveCache(cacheFileString, outFileString);
+  } else if(plain){
+    writeTranslation(outFilePtr);
+  } else {
+    pc = 0;
+    for(stmt = stmts; stmt < stmts + numStmts; stmt++){
+      if(stmt->removed)
+        continue;
 #ifdef _DEBUG
-    fprintf(outFilePtr, "(address %d): %d (hex 0x%x)\n", pc, inst.x32, inst.x32);
+      fprintf(outFilePtr, "(address %d): %d (hex 0x%x)\n", pc, stmt->inst.x32, stmt->inst.x32);
 #else
-    fprintf(outFilePtr, "%d\n", inst.x32);
+      fprintf(outFilePtr, "%d\n", stmt->inst.x32);
 #endif
-    pc++;
+      pc++;
+    }
   }
+  // 5. Optionally the final address of every label, for the simulators' profilers
+  if(mapFilePtr){
+    writeLabels(mapFilePtr);
+    fclose(mapFilePtr);
+  }
+  freeProgram();
   freeSymbols();
 
   exit(0);
@@ -177,32 +312,50 @@ int main(int argc, char *argv[]){
 
 
 // Definitions ///////////////////////////////////////////
+/* symbols stay in definition order on the list, the index finds them by name */
+unsigned __symbolHash(const char name[]){
+  unsigned h = 2166136261u;
+
+  while(*name)
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  return h;
+}
+void __indexSymbol(struct symbol *sym){
+  unsigned i;
+
+  for(i = __symbolHash(sym->name) & symbolMask; symbolIndex[i] != 0; i = (i + 1) & symbolMask)
+    ;
+  symbolIndex[i] = sym;
+}
 void __addSymbol(char name[], word_t word){
-  struct symbol **itr;
-  struct symbol *sym, *prev;
-
-  prev = 0;
-  itr = &entry;
-  sym = *itr;
-  while(sym != 0){
-    prev = sym;
-    itr = &sym->next;
-    sym = *itr;
-  }
-  
-  *itr = (struct symbol*)malloc(sizeof(struct symbol));
-  sym = *itr;
+  struct symbol *sym, *itr;
+
+  if(2 * (numSymbols + 1) > symbolMask){
+    symbolMask = symbolMask ? 2 * symbolMask + 1 : 1023;
+    free(symbolIndex);
+    symbolIndex = (struct symbol**)calloc(symbolMask + 1, sizeof(struct symbol*));
+    for(itr = entry; itr != 0; itr = itr->next)
+      __indexSymbol(itr);
+  }
+
+  sym = (struct symbol*)malloc(sizeof(struct symbol));
   strncpy(sym->name, name, MAXLABELSIZE+1);
   sym->word = word;
   sym->next = 0;
-  if(prev) prev->next = sym;
+  if(lastSymbol) lastSymbol->next = sym;
+  else entry = sym;
+  lastSymbol = sym;
+  numSymbols++;
+  __indexSymbol(sym);
 }
 struct symbol* __readSymbol(const char name[]){
-  struct symbol *itr;
+  unsigned i;
 
-  for(itr = entry; itr != 0; itr = itr->next){
-    if(!strcmp(name, itr->name))
-      return itr;
+  if(symbolIndex == 0)
+    return &notfound;
+  for(i = __symbolHash(name) & symbolMask; symbolIndex[i] != 0; i = (i + 1) & symbolMask){
+    if(!strcmp(name, symbolIndex[i]->name))
+      return symbolIndex[i];
   }
   return &notfound;
 }
@@ -227,6 +380,10 @@ void __freeSymbols(){
     free(itr);
     itr = nxt;
   }
+  free(symbolIndex);
+  entry = lastSymbol = 0;
+  symbolIndex = 0;
+  symbolMask = numSymbols = 0;
 }
 int __isValidLabel(char name[]){
   if(strlen(name) > MAXLABELSIZE)
@@ -239,15 +396,24 @@ int __isValidLabel(char name[]){
 }
 
 void addLabel(char name[], word_t word){
-  if(__isValidLabel(name) == 0)
+  /* with -e the line still assembles, just without its label */
+  if(__isValidLabel(name) == 0){
     raiseError(ER_LABELINVALID, name);
-  if(__readSymbol(name) != &notfound)
+    return;
+  }
+  if(__readSymbol(name) != &notfound){
     raiseError(ER_DUPLICATE, name);
+    return;
+  }
   __addSymbol(name, word);
 }
 struct symbol* readLabel(const char name[]){
   return __readSymbol(name);
 }
+/* labels starting with an upper-case letter are visible to other objects */
+int isGlobalLabel(const char name[]){
+  return name[0] >= 'A' && name[0] <= 'Z';
+}
 #ifdef _DEBUG
 void checkLabels(){
   __checkSymbols();
@@ -256,6 +422,19 @@ void checkLabels(){
 void freeSymbols(){
   __freeSymbols();
 }
+void relocateLabels(const int map[]){
+  struct symbol *itr;
+
+  for(itr = entry; itr != 0; itr = itr->next)
+    itr->word = map[itr->word];
+}
+/* "address label" lines in definition order */
+void writeLabels(FILE *filePtr){
+  struct symbol *itr;
+
+  for(itr = entry; itr != 0; itr = itr->next)
+    fprintf(filePtr, "%d %s\n", itr->word, itr->name);
+}
 
 ///////////////////////////////////////////////////////////
 int __getReg(const char reg[]){
@@ -270,7 +449,7 @@ bad:
   return -1;
 }
 half_t __getOffset(const int pc, const char opcode[], const char arg[]){
-  word_t offset;
+  word_t offset = 0;
   long tmp;
   struct symbol *symbol;
 
@@ -284,6 +463,8 @@ half_t __getOffset(const int pc, const char opcode[], const char arg[]){
     if(symbol != &notfound){
       offset = strcmp(opcode, "beq") == 0 ?
                  symbol->word - pc - 1 : symbol->word;
+    } else if(objectMode && isGlobalLabel(arg)){
+      offset = 0; /* import: the linker fills it in */
     } else {
       raiseError(ER_UNDEFINED, arg);
     }
@@ -294,7 +475,7 @@ half_t __getOffset(const int pc, const char opcode[], const char arg[]){
   return (half_t)offset;
 }
 word_t __getData(const char arg[]){
-  word_t data;
+  word_t data = 0;
   long tmp;
   struct symbol *symbol;
 
@@ -307,6 +488,8 @@ word_t __getData(const char arg[]){
     symbol = readLabel(arg);
     if(symbol != &notfound){
       data = symbol->word;
+    } else if(objectMode && isGlobalLabel(arg)){
+      data = 0; /* import: the linker fills it in */
     } else {
       raiseError(ER_UNDEFINED, arg);
     }
@@ -314,48 +497,49 @@ word_t __getData(const char arg[]){
   return data;
 }
 instruction translate(int pc, char opcode[], char arg0[], char arg1[], char arg2[]){
-  int i, sz, zero = 0;
+  const struct isaEntry *e;
+  int zero = 0;
   instruction inst = {0,};
 
   // Case1) Instructions
-  sz = sizeof(isa)/sizeof(isa[0]);
-  for(i = 0; i < sz; i++){
-    if(!strcmp(isa[i].name, opcode)){
-      switch(isa[i].format){
-        case RTYPE:
-          if(arg0[0] == '\0' || arg1[0] == '\0' || arg2[0] == '\0')
-            raiseError(ER_INSUFFICIENT, opcode);
-          inst.r.unused  = zero;
-          inst.r.opcode  = isa[i].opcode;
-          inst.r.regA    = __getReg(arg0);
-          inst.r.regB    = __getReg(arg1);
-          inst.r.unused2 = zero;
-          inst.r.destReg = __getReg(arg2);
-          return inst;
-        case ITYPE:
-          if(arg0[0] == '\0' || arg1[0] == '\0' || arg2[0] == '\0')
-            raiseError(ER_INSUFFICIENT, opcode);
-          inst.i.unused = zero;
-          inst.i.opcode = isa[i].opcode;
-          inst.i.regA   = __getReg(arg0);
-          inst.i.regB   = __getReg(arg1);
-          inst.i.offset = __getOffset(pc, opcode, arg2);
-          return inst;
-        case JTYPE:
-          if(arg0[0] == '\0' || arg1[0] == '\0')
-            raiseError(ER_INSUFFICIENT, opcode);
-          inst.j.unused  = zero;
-          inst.j.opcode  = isa[i].opcode;
-          inst.j.regA    = __getReg(arg0);
-          inst.j.regB    = __getReg(arg1);
-          inst.j.unused2 = zero;
-          return inst;
-        case OTYPE:
-          inst.o.unused  = zero;
-          inst.o.opcode  = isa[i].opcode;
-          inst.o.unused2 = zero;
-          return inst;
-      }
+  e = isaByName(opcode);
+  if(e != NULL && e->opcode > ISA_MAXBASEOP && !extended)
+    raiseError(ER_EXTENSION, opcode);
+  if(e != NULL){
+    switch(e->format){
+      case RTYPE:
+        if(arg0[0] == '\0' || arg1[0] == '\0' || arg2[0] == '\0')
+          raiseError(ER_INSUFFICIENT, opcode);
+        inst.r.unused  = e->opcode >> 3;
+        inst.r.opcode  = e->opcode & 0x7;
+        inst.r.regA    = __getReg(arg0);
+        inst.r.regB    = __getReg(arg1);
+        inst.r.unused2 = zero;
+        inst.r.destReg = __getReg(arg2);
+        return inst;
+      case ITYPE:
+        if(arg0[0] == '\0' || arg1[0] == '\0' || arg2[0] == '\0')
+          raiseError(ER_INSUFFICIENT, opcode);
+        inst.i.unused = e->opcode >> 3;
+        inst.i.opcode = e->opcode & 0x7;
+        inst.i.regA   = __getReg(arg0);
+        inst.i.regB   = __getReg(arg1);
+        inst.i.offset = __getOffset(pc, opcode, arg2);
+        return inst;
+      case JTYPE:
+        if(arg0[0] == '\0' || arg1[0] == '\0')
+          raiseError(ER_INSUFFICIENT, opcode);
+        inst.j.unused  = e->opcode >> 3;
+        inst.j.opcode  = e->opcode & 0x7;
+        inst.j.regA    = __getReg(arg0);
+        inst.j.regB    = __getReg(arg1);
+        inst.j.unused2 = zero;
+        return inst;
+      case OTYPE:
+        inst.o.unused  = e->opcode >> 3;
+        inst.o.opcode  = e->opcode & 0x7;
+        inst.o.unused2 = zero;
+        return inst;
     }
   }
   // Case2) Assembler directives
@@ -370,10 +554,935 @@ instruction translate(int pc, char opcode[], char arg0[], char arg1[], char arg2
   return inst;
 }
 
+// Peephole optimizer ///////////////////////////////////////////
+/*
+ * Runs over the translated program and drops noops and instructions that
+ * provably leave every register as it is, then relocates everything behind
+ * them. Removal must also keep the project2 pipeline correct. That
+ * pipeline has no forwarding: registers are read in ID and written in WB,
+ * so a result can be used HAZARDWINDOW slots later at the earliest. No
+ * producer/consumer pair on a fall-through path may end up closer than
+ * that. A taken branch refills the pipeline and never shortens the window.
+ * Memory is assumed to be addressed through labels. Numeric lw/sw offsets
+ * on register 0 are taken as absolute addresses and relocated as well.
+ */
+#define HAZARDWINDOW 4
+#define ALLREGS      0xfe
+
+/* translate() already refused the extensions unless -x enabled them */
+#define ISAEXT       ISA_EXTALL
+
+int __isData(const struct statement *stmt){
+  return !strcmp(stmt->opcode, ".fill");
+}
+/* bitmasks of the registers an instruction reads and writes, r0 excluded */
+void __regUsage(const struct statement *stmt, int *reads, int *writes){
+  word_t w = stmt->inst.x32;
+
+  if(__isData(stmt) || isaDecode(isaOpcode(w, ISAEXT)) == NULL){
+    *reads = *writes = ALLREGS;
+    return;
+  }
+  *reads = isaReads(w, ISAEXT);
+  *writes = isaWrites(w, ISAEXT);
+}
+/* operands the statement actually uses, the rest of the line is comment */
+int __numArgs(const char opcode[]){
+  const struct isaEntry *e = isaByName(opcode);
+
+  return e != NULL ? e->numArgs : 1;
+}
+/* nothing falls through past a halt or an unconditional beq */
+int __isBarrier(const struct statement *stmt){
+  word_t w = stmt->inst.x32;
+
+  if(__isData(stmt))
+    return 0;
+  return isaOpcode(w, ISAEXT) == OP_HALT
+         || (isaOpcode(w, ISAEXT) == OP_BEQ && isaRegA(w) == isaRegB(w));
+}
+
+/*
+ * Marks instructions whose result every register already holds, tracking
+ * known register values through each basic block. Loads count as constants
+ * only from numeric .fill words that no store can reach.
+ */
+void __foldConstants(int *redundant){
+  int *entry, *written;
+  int known, val[8], zeroSafe = 1, anyStore = 0;
+  int k, a, b, d, off, v, op, target;
+  word_t w;
+
+  entry = (int*)calloc(numStmts + 1, sizeof(int));
+  written = (int*)calloc(numStmts, sizeof(int));
+  for(k = 0; k < numStmts; k++){
+    w = stmts[k].inst.x32;
+    op = isaOpcode(w, ISAEXT);
+    if(stmts[k].label[0] != '\0')
+      entry[k] = 1;
+    if(__isData(&stmts[k]))
+      continue;
+    if((op == OP_ADD || op == OP_NOR || isaArith(op)) && isaDest(w) == 0)
+      zeroSafe = 0;
+    if((op == OP_LW || op == OP_JALR) && isaRegB(w) == 0)
+      zeroSafe = 0;
+    if(op == OP_BEQ && !stmts[k].external){
+      target = k + 1 + isaOffset(w);
+      if(target >= 0 && target < numStmts)
+        entry[target] = 1;
+    }
+    if(op == OP_JALR || op == OP_HALT)
+      entry[k+1] = 1;
+    if(op == OP_SW){
+      off = isaOffset(w);
+      if(isaRegA(w) != 0 || stmts[k].external)
+        anyStore = 1;
+      else if(off >= 0 && off < numStmts)
+        written[off] = 1;
+    }
+    if(op > OP_NOOP && !isaArith(op))
+      anyStore = 1;
+  }
+
+  /* registers start out zero */
+  known = 0xff;
+  memset(val, 0, sizeof(val));
+  for(k = 0; k < numStmts; k++){
+    if(entry[k])
+      known = zeroSafe ? 1 : 0;
+    if(__isData(&stmts[k])){
+      known = zeroSafe ? 1 : 0;
+      continue;
+    }
+    w = stmts[k].inst.x32;
+    a = isaRegA(w);
+    b = isaRegB(w);
+    d = isaDest(w);
+    off = isaOffset(w);
+    switch(isaOpcode(w, ISAEXT)){
+      case OP_ADD:
+      case OP_NOR:
+        if((known & (1 << a)) && (known & (1 << b))){
+          /* wraps at 32 bits like the simulators, signed overflow would be undefined */
+          v = isaOpcode(w, ISAEXT) == OP_ADD ? (int)((unsigned)val[a] + val[b]) : ~(val[a] | val[b]);
+          if((known & (1 << d)) && val[d] == v)
+            redundant[k] = 1;
+          known |= 1 << d;
+          val[d] = v;
+        } else {
+          if(isaOpcode(w, ISAEXT) == OP_ADD && (known & 1) && val[0] == 0
+             && ((a == 0 && b == d) || (b == 0 && a == d)))
+            redundant[k] = 1;
+          else
+            known &= ~(1 << d);
+        }
+        break;
+      case OP_MUL:
+      case OP_DIV:
+      case OP_SLL:
+      case OP_SRL:
+        if((known & (1 << a)) && (known & (1 << b))){
+          v = isaArithResult(isaOpcode(w, ISAEXT), val[a], val[b]);
+          if((known & (1 << d)) && val[d] == v)
+            redundant[k] = 1;
+          known |= 1 << d;
+          val[d] = v;
+        } else {
+          known &= ~(1 << d);
+        }
+        break;
+      case OP_LW:
+        if(a == 0 && (known & 1) && val[0] == 0 && !anyStore && !stmts[k].external
+           && off >= 0 && off < numStmts && !written[off] && __isData(&stmts[off])
+           && !stmts[off].labelRef && !stmts[off].external){
+          v = stmts[off].inst.x32;
+          if((known & (1 << b)) && val[b] == v)
+            redundant[k] = 1;
+          known |= 1 << b;
+          val[b] = v;
+        } else {
+          known &= ~(1 << b);
+        }
+        break;
+      case OP_BEQ:
+        if(stmts[k].external)
+          break;
+        if(off == 0)
+          redundant[k] = 1;
+        else if((known & (1 << a)) && (known & (1 << b)) && val[a] != val[b])
+          redundant[k] = 1;
+        break;
+      case OP_SW:
+      case OP_HALT:
+      case OP_NOOP:
+        break;
+      case OP_JALR:
+        known &= ~(1 << b);
+        break;
+      default:
+        known = 0;
+        break;
+    }
+    if(!zeroSafe)
+      known &= ~1;
+  }
+  free(entry);
+  free(written);
+}
+
+/* whether dropping stmts[k] would bring a dependent pair into the hazard window */
+int __exposesHazard(int k, const int *prev, const int *next, const int *reads, const int *writes){
+  int i, j, di, dj;
+
+  for(i = prev[k], di = 1; i >= 0 && di < HAZARDWINDOW; i = prev[i], di++){
+    if(__isBarrier(&stmts[i]))
+      break;
+    /* its own operands must have been read correctly in the first place */
+    if(writes[i] & reads[k])
+      return 1;
+    if(writes[i] == 0)
+      continue;
+    for(j = next[k], dj = 1; j < numStmts && di + dj <= HAZARDWINDOW; j = next[j], dj++){
+      if(writes[i] & reads[j])
+        return 1;
+      if(__isBarrier(&stmts[j]))
+        break;
+    }
+  }
+  return 0;
+}
+
+/* map[] takes old addresses to new ones, at[] is where each statement landed */
+void __relocate(const int *map, const int *at){
+  struct statement *stmt;
+  word_t w;
+  int k, off, target, n = numStmts;
+
+  for(k = 0; k < n; k++){
+    stmt = &stmts[k];
+    if(stmt->removed || stmt->external)
+      continue;
+    w = stmt->inst.x32;
+    if(__isData(stmt)){
+      if(stmt->labelRef && w >= 0 && w <= n)
+        stmt->inst.x32 = map[w];
+      continue;
+    }
+    off = isaOffset(w);
+    switch(isaOpcode(w, ISAEXT)){
+      case OP_BEQ:
+        target = k + 1 + off;
+        if(target < 0 || target > n)
+          continue;
+        off = map[target] - at[k] - 1;
+        break;
+      case OP_LW:
+      case OP_SW:
+        if(off < 0 || off > n || (!stmt->labelRef && isaRegA(w) != 0))
+          continue;
+        off = map[off];
+        break;
+      default:
+        continue;
+    }
+    stmt->inst.x32 = (w & ~0xffff) | (off & 0xffff);
+  }
+  relocateLabels(map);
+}
+
+void optimize(FILE *reportPtr){
+  int *redundant, *reads, *writes, *prev, *next, *map;
+  int i, k, n = numStmts, noops = 0, folded = 0;
+  struct statement *stmt;
+
+  redundant = (int*)calloc(n, sizeof(int));
+  reads = (int*)malloc(n*sizeof(int));
+  writes = (int*)malloc(n*sizeof(int));
+  prev = (int*)malloc(n*sizeof(int));
+  next = (int*)malloc(n*sizeof(int));
+  map = (int*)malloc((n+1)*sizeof(int));
+
+  __foldConstants(redundant);
+  for(k = 0; k < n; k++){
+    __regUsage(&stmts[k], &reads[k], &writes[k]);
+    prev[k] = k - 1;
+    next[k] = k + 1;
+  }
+  for(k = 0; k < n; k++){
+    stmt = &stmts[k];
+    if(__isData(stmt))
+      continue;
+    if(isaOpcode(stmt->inst.x32, ISAEXT) != OP_NOOP && !redundant[k])
+      continue;
+    if(__exposesHazard(k, prev, next, reads, writes))
+      continue;
+    stmt->removed = 1;
+    if(redundant[k])
+      folded++;
+    else
+      noops++;
+    if(prev[k] >= 0)
+      next[prev[k]] = next[k];
+    if(next[k] < n)
+      prev[next[k]] = prev[k];
+  }
+
+  map[n] = n - noops - folded;
+  for(k = n - 1; k >= 0; k--)
+    map[k] = stmts[k].removed ? map[k+1] : map[k+1] - 1;
+  __relocate(map, map);
+
+  fprintf(reportPtr, "address map (old -> new):\n");
+  for(k = 0; k < n; k++){
+    stmt = &stmts[k];
+    if(stmt->removed)
+      fprintf(reportPtr, "  %6d ->      -   ", k);
+    else
+      fprintf(reportPtr, "  %6d -> %6d   ", k, map[k]);
+    fprintf(reportPtr, "%-6s %-5s", stmt->label, stmt->opcode);
+    for(i = 0; i < __numArgs(stmt->opcode); i++)
+      fprintf(reportPtr, " %s", stmt->arg[i]);
+    fprintf(reportPtr, stmt->removed ? (redundant[k] ? "   (folded)\n" : "   (noop)\n") : "\n");
+  }
+  fprintf(reportPtr, "removed %d of %d words: %d noops, %d folded\n",
+          noops + folded, n, noops, folded);
+
+  free(redundant);
+  free(reads);
+  free(writes);
+  free(prev);
+  free(next);
+  free(map);
+}
+
+// Scheduler ///////////////////////////////////////////
+/*
+ * Rebuilds every basic block for the project2 pipeline. The noop padding
+ * is dropped and the block is list-scheduled over its dependence graph,
+ * longest path first. A noop goes back in only when no independent
+ * instruction can fill a hazard slot. A block starts at a label or a
+ * branch target and ends after a beq, jalr or halt, which stays last.
+ * Blocks longer than SCHEDWINDOW instructions are cut into windows.
+ * Results still in flight when a block falls through carry over to the
+ * next one.
+ */
+#define SCHEDWINDOW 64
+#define NOOPWORD    (OP_NOOP << 22)
+
+typedef unsigned long long nodeSet;
+
+int __isTerminator(const struct statement *stmt){
+  int op = isaOpcode(stmt->inst.x32, ISAEXT);
+
+  return !__isData(stmt) && (op == OP_BEQ || op == OP_JALR || op == OP_HALT);
+}
+int __isMemOp(const struct statement *stmt){
+  int op = isaOpcode(stmt->inst.x32, ISAEXT);
+
+  return op == OP_LW || op == OP_SW;
+}
+
+struct statement* __emit(struct statement **out, int *numOut, int *cap){
+  if(*numOut == *cap){
+    *cap = *cap ? 2 * *cap : 1024;
+    *out = (struct statement*)realloc(*out, *cap * sizeof(struct statement));
+  }
+  return &(*out)[(*numOut)++];
+}
+
+/*
+ * Schedules nodes[0..m) starting at slot `slot`; ready[r] is the first slot
+ * register r may be read in. Returns the slot of each node in slotOf[],
+ * -1 slots in `order` stand for inserted noops. Returns the number of slots.
+ */
+int __scheduleWindow(const int *nodes, int m, int slot, int *ready, int *order){
+  nodeSet preds[SCHEDWINDOW], done = 0, all;
+  int reads[SCHEDWINDOW], writes[SCHEDWINDOW], height[SCHEDWINDOW];
+  const struct statement *si, *sj;
+  int i, j, r, best, ok, len = 0, opI, opJ, memI, memJ, ext;
+
+  all = m == 64 ? ~0ULL : (1ULL << m) - 1;
+  for(j = 0; j < m; j++){
+    sj = &stmts[nodes[j]];
+    __regUsage(sj, &reads[j], &writes[j]);
+    preds[j] = 0;
+    for(i = 0; i < j; i++){
+      si = &stmts[nodes[i]];
+      opI = isaOpcode(si->inst.x32, ISAEXT);
+      opJ = isaOpcode(sj->inst.x32, ISAEXT);
+      memI = __isMemOp(si) ? opI : -1;
+      memJ = __isMemOp(sj) ? opJ : -1;
+      ext = (opI > OP_NOOP && !isaArith(opI)) || (opJ > OP_NOOP && !isaArith(opJ));
+      if((writes[i] & (reads[j] | writes[j])) || (reads[i] & writes[j])
+         || (memI >= 0 && memJ >= 0 && (memI == OP_SW || memJ == OP_SW))
+         || ext || __isTerminator(sj))
+        preds[j] |= 1ULL << i;
+    }
+  }
+  /* critical path to the end of the window, a read-after-write costs the window */
+  for(i = m - 1; i >= 0; i--){
+    height[i] = 1;
+    for(j = i + 1; j < m; j++){
+      if(!(preds[j] & (1ULL << i)))
+        continue;
+      r = height[j] + ((writes[i] & reads[j]) ? HAZARDWINDOW : 1);
+      if(r > height[i])
+        height[i] = r;
+    }
+  }
+
+  while(done != all){
+    best = -1;
+    for(j = 0; j < m; j++){
+      if((done & (1ULL << j)) || (preds[j] & ~done))
+        continue;
+      for(r = 1, ok = 1; r < 8; r++)
+        if((reads[j] & (1 << r)) && slot < ready[r])
+          ok = 0;
+      if(ok && (best < 0 || height[j] > height[best]))
+        best = j;
+    }
+    order[len++] = best;
+    if(best >= 0){
+      for(r = 1; r < 8; r++)
+        if(writes[best] & (1 << r))
+          ready[r] = slot + HAZARDWINDOW;
+      done |= 1ULL << best;
+    }
+    slot++;
+  }
+  return len;
+}
+
+void schedule(FILE *reportPtr){
+  struct statement *out = NULL, *stmt;
+  char *noopTokens[5] = {"", "noop", "", "", ""};
+  int *entry, *map, *at, *from;
+  int nodes[SCHEDWINDOW], order[SCHEDWINDOW * HAZARDWINDOW];
+  int ready[8] = {0,};
+  int numOut = 0, cap = 0, n = numStmts;
+  int i, k, e, m, len, start, blocks = 0, dropped = 0, inserted = 0;
+
+  entry = (int*)calloc(n + 1, sizeof(int));
+  map = (int*)malloc((n + 1) * sizeof(int));
+  at = (int*)malloc((n + 1) * sizeof(int));
+  from = (int*)malloc(2 * n * HAZARDWINDOW * sizeof(int) + sizeof(int));
+  for(k = 0; k < n; k++){
+    stmt = &stmts[k];
+    if(stmt->label[0] != '\0' || __isData(stmt))
+      entry[k] = 1;
+    if(__isTerminator(stmt) || __isData(stmt))
+      entry[k+1] = 1;
+    if(!__isData(stmt) && !stmt->external && isaOpcode(stmt->inst.x32, ISAEXT) == OP_BEQ){
+      e = k + 1 + isaOffset(stmt->inst.x32);
+      if(e >= 0 && e < n)
+        entry[e] = 1;
+    }
+  }
+
+  /* first pass only places statements: out[] holds copies, from[] their origin */
+  for(k = 0; k < n; k = e){
+    stmt = &stmts[k];
+    if(__isData(stmt)){
+      map[k] = at[k] = numOut;
+      from[numOut] = k;
+      *__emit(&out, &numOut, &cap) = *stmt;
+      memset(ready, 0, sizeof(ready));
+      e = k + 1;
+      continue;
+    }
+    for(e = k + 1; e < n && !entry[e]; e++)
+      ;
+    blocks++;
+    start = numOut;
+    for(i = k; i < e; ){
+      for(m = 0; i < e && m < SCHEDWINDOW; i++){
+        map[i] = at[i] = numOut;
+        if(isaOpcode(stmts[i].inst.x32, ISAEXT) == OP_NOOP){
+          dropped++;
+          continue;
+        }
+        nodes[m++] = i;
+      }
+      len = __scheduleWindow(nodes, m, numOut, ready, order);
+      for(m = 0; m < len; m++){
+        if(order[m] < 0){
+          inserted++;
+          from[numOut] = -1;
+          stmt = __emit(&out, &numOut, &cap);
+          memset(stmt, 0, sizeof(struct statement));
+          setTokens(stmt, noopTokens);
+          stmt->inst.x32 = NOOPWORD;
+        } else {
+          at[nodes[order[m]]] = numOut;
+          map[nodes[order[m]]] = numOut;
+          from[numOut] = nodes[order[m]];
+          *__emit(&out, &numOut, &cap) = stmts[nodes[order[m]]];
+        }
+      }
+    }
+    /* branch targets and labels name the block, not the instruction */
+    map[k] = start;
+    if(__isBarrier(&stmts[e-1]))
+      memset(ready, 0, sizeof(ready));
+  }
+  map[n] = at[n] = numOut;
+
+  __relocate(map, at);
+  for(i = 0; i < numOut; i++){
+    if(from[i] >= 0)
+      out[i].inst = stmts[from[i]].inst;
+  }
+  for(k = 0; k < n; k++){
+    if(isaOpcode(stmts[k].inst.x32, ISAEXT) == OP_NOOP && !__isData(&stmts[k]))
+      freeTokens(&stmts[k]);
+  }
+
+  fprintf(reportPtr, "schedule (new <- old):\n");
+  for(i = 0; i < numOut; i++){
+    stmt = &out[i];
+    if(from[i] >= 0)
+      fprintf(reportPtr, "  %6d <- %6d   ", i, from[i]);
+    else
+      fprintf(reportPtr, "  %6d <-      -   ", i);
+    fprintf(reportPtr, "%-6s %-5s", stmt->label, stmt->opcode);
+    for(k = 0; k < __numArgs(stmt->opcode); k++)
+      fprintf(reportPtr, " %s", stmt->arg[k]);
+    fprintf(reportPtr, "\n");
+  }
+  fprintf(reportPtr, "scheduled %d blocks: %d -> %d words, %d noops dropped, %d inserted\n",
+          blocks, n, numOut, dropped, inserted);
+
+  free(stmts);
+  stmts = out;
+  numStmts = numOut;
+  free(entry);
+  free(map);
+  free(at);
+  free(from);
+}
+
+// Object output ///////////////////////////////////////////
+/*
+ * Relocatable object for `link`:
+ *   <text words> <data words> <symbols> <relocations>
+ *   text words, one per line (everything before the first .fill)
+ *   data words, one per line
+ *   <label> T|D|U <offset in its section>    one per global symbol
+ *   <address> <opcode> <label>                one per symbolic operand
+ * Addresses, and words that hold a local address, count as if the object
+ * was loaded at 0 with data right behind text. Symbol offsets count from
+ * the start of their section. Imports (U) are left as 0 for the linker.
+ */
+int __objectSize(const struct statement *first, const struct statement *last){
+  int n = 0;
+
+  for(; first < last; first++)
+    n += !first->removed;
+  return n;
+}
+const char* __operandLabel(const struct statement *stmt){
+  return __isData(stmt) ? stmt->arg[0] : stmt->arg[2];
+}
+int __importedBefore(const struct statement *stmt){
+  const struct statement *prev;
+
+  for(prev = stmts; prev < stmt; prev++){
+    if(prev->external && !strcmp(__operandLabel(prev), __operandLabel(stmt)))
+      return 1;
+  }
+  return 0;
+}
+
+void writeObject(FILE *outFilePtr){
+  struct statement *stmt, *data;
+  struct symbol *sym;
+  int textSize, dataSize, numSyms = 0, numRelocs = 0, addr;
+
+  for(data = stmts; data < stmts + numStmts && (data->removed || !__isData(data)); data++)
+    ;
+  textSize = __objectSize(stmts, data);
+  dataSize = __objectSize(data, stmts + numStmts);
+  for(sym = entry; sym != 0; sym = sym->next)
+    numSyms += isGlobalLabel(sym->name);
+  for(stmt = stmts; stmt < stmts + numStmts; stmt++){
+    if(stmt->removed)
+      continue;
+    numRelocs += stmt->labelRef || stmt->external;
+    numSyms += stmt->external && !__importedBefore(stmt);
+  }
+
+  fprintf(outFilePtr, "%d %d %d %d\n", textSize, dataSize, numSyms, numRelocs);
+  for(stmt = stmts; stmt < stmts + numStmts; stmt++){
+    if(!stmt->removed)
+      fprintf(outFilePtr, "%d\n", stmt->inst.x32);
+  }
+  for(sym = entry; sym != 0; sym = sym->next){
+    if(!isGlobalLabel(sym->name))
+      continue;
+    if(sym->word < textSize)
+      fprintf(outFilePtr, "%s T %d\n", sym->name, sym->word);
+    else
+      fprintf(outFilePtr, "%s D %d\n", sym->name, sym->word - textSize);
+  }
+  for(stmt = stmts; stmt < stmts + numStmts; stmt++){
+    if(!stmt->removed && stmt->external && !__importedBefore(stmt))
+      fprintf(outFilePtr, "%s U 0\n", __operandLabel(stmt));
+  }
+  addr = 0;
+  for(stmt = stmts; stmt < stmts + numStmts; stmt++){
+    if(stmt->removed)
+      continue;
+    if(stmt->labelRef || stmt->external)
+      fprintf(outFilePtr, "%d %s %s\n", addr, stmt->opcode, __operandLabel(stmt));
+    addr++;
+  }
+}
+
+// Incremental cache ///////////////////////////////////////////
+/*
+ * -i cache-file remembers, per statement, a hash of its opcode and
+ * operands, the word it assembled to and the address its label operand
+ * had. The next run lines the new statements up against the cached ones
+ * through their common prefix and suffix. A matching statement keeps its
+ * word unless the label it names moved relative to what the word encodes.
+ * The previous output file is then patched: lines of the same length are
+ * rewritten in place, and from the first length change on the rest of the
+ * file is rewritten.
+ */
+#define CACHEMAGIC 0x314548434143324cULL /* "L2CACHE1" */
+
+struct cacheEntry{
+  unsigned long long hash;
+  word_t word;
+  int labelAddr;
+  int length;          /* of the word's line in the output file */
+};
+static struct cacheEntry *cache, *fresh; /* last run's and this run's */
+static int numCache;
+static int cachePrefix, cacheSuffix;
+static long cacheOutSize;
+
+unsigned long long __statementHash(const struct statement *stmt){
+  /* -x decides whether an extension instruction assembles at all */
+  unsigned long long h = 14695981039346656037ULL + extended;
+  const char *tok[4] = {stmt->opcode, stmt->arg[0], stmt->arg[1], stmt->arg[2]};
+  const char *c;
+  int i;
+
+  for(i = 0; i < 4; i++){
+    for(c = tok[i]; ; c++){
+      h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+      if(*c == '\0')
+        break;
+    }
+  }
+  return h;
+}
+int __labelAddr(const struct statement *stmt){
+  struct symbol *sym;
+
+  if(!stmt->labelRef)
+    return 0;
+  sym = readLabel(__operandLabel(stmt));
+  return sym == &notfound ? -1 : sym->word;
+}
+int __formatWord(char *buf, int addr, word_t word){
+#ifdef _DEBUG
+  return sprintf(buf, "(address %d): %d (hex 0x%x)\n", addr, word, word);
+#else
+  return sprintf(buf, "%d\n", word);
+#endif
+}
+
+/* no cache, or one for another output file, leaves numCache at 0 */
+void loadCache(const char *cacheFile, const char *outFile){
+  char name[MAXLINELENGTH];
+  unsigned long long magic;
+  FILE *fp;
+  int len, k;
+
+  numCache = 0;
+  fresh = (struct cacheEntry*)calloc(numStmts + 1, sizeof(struct cacheEntry));
+  for(k = 0; k < numStmts; k++)
+    fresh[k].hash = __statementHash(&stmts[k]);
+  fp = fopen(cacheFile, "rb");
+  if(fp == NULL)
+    return;
+  if(fread(&magic, sizeof(magic), 1, fp) != 1 || magic != CACHEMAGIC
+     || fread(&len, sizeof(len), 1, fp) != 1 || len < 0 || len >= MAXLINELENGTH
+     || fread(name, 1, len, fp) != len)
+    goto out;
+  name[len] = '\0';
+  if(strcmp(name, outFile)
+     || fread(&cacheOutSize, sizeof(cacheOutSize), 1, fp) != 1
+     || fread(&numCache, sizeof(numCache), 1, fp) != 1 || numCache < 0){
+    numCache = 0;
+    goto out;
+  }
+  cache = (struct cacheEntry*)malloc((numCache + 1) * sizeof(struct cacheEntry));
+  if(fread(cache, sizeof(struct cacheEntry), numCache, fp) != numCache){
+    numCache = 0;
+    goto out;
+  }
+
+  for(k = 0; k < numCache && k < numStmts; k++){
+    if(cache[k].hash != fresh[k].hash)
+      break;
+  }
+  cachePrefix = k;
+  for(k = 0; k < numCache - cachePrefix && k < numStmts - cachePrefix; k++){
+    if(cache[numCache-1-k].hash != fresh[numStmts-1-k].hash)
+      break;
+  }
+  cacheSuffix = k;
+out:
+  fclose(fp);
+}
+
+/* stores the cached word of stmts[k] in *word when it is still valid */
+int reuseWord(int k, word_t *word){
+  const struct statement *stmt = &stmts[k];
+  int old, addr;
+
+  if(k < cachePrefix)
+    old = k;
+  else if(k >= numStmts - cacheSuffix)
+    old = k - numStmts + numCache;
+  else
+    return 0;
+  if(stmt->labelRef){
+    addr = __labelAddr(stmt);
+    if(addr < 0)
+      return 0;
+    if(!strcmp(stmt->opcode, "beq") ?
+         addr - k != cache[old].labelAddr - old : addr != cache[old].labelAddr)
+      return 0;
+  }
+  *word = cache[old].word;
+  return 1;
+}
+
+/* writes the output, touching only what changed since the cached run */
+void patchOutput(const char *outFile){
+  char newText[MAXLINELENGTH];
+  FILE *fp;
+  long offset = 0;
+  int k, newLen;
+
+  fp = fopen(outFile, "r+");
+  if(fp == NULL)
+    raiseError(ER_OPENFILE, outFile);
+  fseek(fp, 0, SEEK_END);
+  if(numCache == 0 || ftell(fp) != cacheOutSize){
+    k = 0;
+  } else {
+    for(k = 0; k < numStmts && k < numCache; k++){
+      /* line k prints word k (and address k): same word, same line */
+      if(cache[k].word == stmts[k].inst.x32){
+        fresh[k].length = cache[k].length;
+        offset += cache[k].length;
+        continue;
+      }
+      newLen = __formatWord(newText, k, stmts[k].inst.x32);
+      if(newLen != cache[k].length)
+        break;
+      fseek(fp, offset, SEEK_SET);
+      fwrite(newText, 1, newLen, fp);
+      fresh[k].length = newLen;
+      offset += newLen;
+    }
+  }
+  if(k < numStmts || k < numCache){
+    fseek(fp, offset, SEEK_SET);
+    for(; k < numStmts; k++){
+      newLen = fresh[k].length = __formatWord(newText, k, stmts[k].inst.x32);
+      fwrite(newText, 1, newLen, fp);
+    }
+    fflush(fp);
+    if(ftruncate(fileno(fp), ftell(fp)) != 0)
+      raiseError(ER_OPENFILE, outFile);
+  }
+  fseek(fp, 0, SEEK_END);
+  cacheOutSize = ftell(fp);
+  fclose(fp);
+}
+
+void saveCache(const char *cacheFile, const char *outFile){
+  unsigned long long magic = CACHEMAGIC;
+  FILE *fp;
+  int len = strlen(outFile), k;
+
+  fp = fopen(cacheFile, "wb");
+  if(fp == NULL)
+    raiseError(ER_OPENFILE, cacheFile);
+  fwrite(&magic, sizeof(magic), 1, fp);
+  fwrite(&len, sizeof(len), 1, fp);
+  fwrite(outFile, 1, len, fp);
+  fwrite(&cacheOutSize, sizeof(cacheOutSize), 1, fp);
+  fwrite(&numStmts, sizeof(numStmts), 1, fp);
+  for(k = 0; k < numStmts; k++){
+    fresh[k].word = stmts[k].inst.x32;
+    fresh[k].labelAddr = __labelAddr(&stmts[k]);
+  }
+  fwrite(fresh, sizeof(struct cacheEntry), numStmts, fp);
+  fclose(fp);
+  free(cache);
+  free(fresh);
+  cache = fresh = NULL;
+}
+
+// Parallel second pass ///////////////////////////////////////////
+/*
+ * Once pass one is done the symbol table is read-only, and every
+ * statement translates on its own. The statements are cut into chunks
+ * that a small thread pool translates (and, for the plain output, also
+ * formats into a buffer per chunk). raiseError() inside a chunk does not
+ * exit: it records the error in the chunk and jumps back. Normally each
+ * chunk then stops at its own first error, and the error of the first
+ * chunk that has one is raised as usual: the first error in address
+ * order, exactly as the serial pass would have reported it. With -e the
+ * bad statement becomes a noop and the chunk goes on, up to maxErrors,
+ * and the chunks' errors are reported in address order.
+ */
+struct chunk{
+  int begin, end;
+  char *text;          /* formatted output lines, if asked for */
+  long length;
+  jmp_buf trap;
+  struct errorRecord *errors;
+  int numErrors;
+};
+static struct chunk *chunks;
+static int numChunks, nextChunk, firstFullChunk;
+static int reusing, formatting;
+static __thread struct chunk *current; /* the chunk raiseError() reports to */
+
+void __translateChunk(struct chunk *c){
+  struct statement *stmt;
+  char *p;
+  int old;
+
+  current = c;
+  pc = c->begin;
+  if(setjmp(c->trap)){
+    /* raiseError() recorded what is wrong with stmts[pc] */
+    if(c->numErrors == (maxErrors ? maxErrors : 1)){
+      current = NULL;
+      /* later chunks cannot hold any of the errors to report */
+      old = __atomic_load_n(&firstFullChunk, __ATOMIC_ACQUIRE);
+      while(c - chunks < old
+            && !__sync_bool_compare_and_swap(&firstFullChunk, old, (int)(c - chunks)))
+        old = __atomic_load_n(&firstFullChunk, __ATOMIC_ACQUIRE);
+      return;
+    }
+    stmts[pc++].inst.x32 = NOOPWORD;
+  }
+  for(; pc < c->end; pc++){
+    stmt = &stmts[pc];
+    if(reusing && reuseWord(pc, &stmt->inst.x32))
+      continue;
+    stmt->inst = translate(pc, stmt->opcode, stmt->arg[0], stmt->arg[1], stmt->arg[2]);
+  }
+  current = NULL;
+  if(!formatting)
+    return;
+  p = c->text = (char*)malloc((c->end - c->begin) * 64 + 1);
+  for(pc = c->begin; pc < c->end; pc++)
+    p += __formatWord(p, pc, stmts[pc].inst.x32);
+  c->length = p - c->text;
+}
+void* __translateWorker(void *arg){
+  int i;
+
+  while((i = __sync_fetch_and_add(&nextChunk, 1)) < numChunks){
+    /* other workers lower it as they fill up with errors */
+    if(i <= __atomic_load_n(&firstFullChunk, __ATOMIC_ACQUIRE))
+      __translateChunk(&chunks[i]);
+  }
+  return NULL;
+}
+
+/* the second pass; reuse: take words from the -i cache, format: keep the text */
+void translateProgram(int reuse, int format){
+  pthread_t threads[MAXTHREADS];
+  long n;
+  int i, k;
+
+  reusing = reuse;
+  formatting = format;
+  numChunks = (numStmts + CHUNKSIZE - 1) / CHUNKSIZE;
+  chunks = (struct chunk*)calloc(numChunks + 1, sizeof(struct chunk));
+  for(i = 0; i < numChunks; i++){
+    chunks[i].begin = i * CHUNKSIZE;
+    chunks[i].end = i + 1 < numChunks ? (i + 1) * CHUNKSIZE : numStmts;
+  }
+  nextChunk = 0;
+  firstFullChunk = numChunks;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n < 1)
+    n = 1;
+  if(n > MAXTHREADS)
+    n = MAXTHREADS;
+  if(n > numChunks)
+    n = numChunks;
+  for(i = 1; i < n; i++)
+    pthread_create(&threads[i], NULL, __translateWorker, NULL);
+  __translateWorker(NULL);
+  for(i = 1; i < n; i++)
+    pthread_join(threads[i], NULL);
+
+  pc = numStmts;
+  for(i = 0; i < numChunks; i++){
+    for(k = 0; k < chunks[i].numErrors; k++)
+      reportError(&chunks[i].errors[k]);
+    free(chunks[i].errors);
+    chunks[i].errors = NULL;
+  }
+  if(numErrors > 0){
+    fprintf(stderr, "[ERROR] %d error%s\n", numErrors, numErrors > 1 ? "s" : "");
+    exit(1);
+  }
+  if(!formatting){
+    free(chunks);
+    chunks = NULL;
+  }
+}
+
+void writeTranslation(FILE *outFilePtr){
+  int i;
+
+  for(i = 0; i < numChunks; i++){
+    fwrite(chunks[i].text, 1, chunks[i].length, outFilePtr);
+    free(chunks[i].text);
+  }
+  free(chunks);
+  chunks = NULL;
+}
+
 ///////////////////////////////////////////////////////////
-int readAndParse(FILE *inFilePtr, char *label, char *opcode, char *arg0, char *arg1, char *arg2){
+int __isBlank(char c){
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+char* __skipBlanks(char *p){
+  while(__isBlank(*p))
+    p++;
+  return p;
+}
+/* copies the field at p into dst, notes its column and returns the end of it */
+char* __copyField(char *line, char *p, char *dst, unsigned short *col){
+  *col = *p != '\0' && !__isBlank(*p) ? p - line + 1 : 0;
+  while(*p != '\0' && !__isBlank(*p))
+    *dst++ = *p++;
+  *dst = '\0';
+  return p;
+}
+int readAndParse(FILE *inFilePtr, char *label, char *opcode, char *arg0, char *arg1, char *arg2,
+                 unsigned short col[]){
   char line[MAXLINELENGTH];
   char *ptr = line;
+  int c;
   /* delete prior values */
   label[0] = opcode[0] = arg0[0] = arg1[0] = arg2[0] = '\0';
   /* read the line from the assembly-language file */
@@ -384,29 +1493,390 @@ int readAndParse(FILE *inFilePtr, char *label, char *opcode, char *arg0, char *a
   /* check for line too long (by looking for a \n) */
   if (strchr(line, '\n') == NULL) {
     raiseError(ER_LINEOVFL, line);
-  }
-  /* is there a label? */
-  ptr = line;
-  if (sscanf(ptr, "%[^\t\n\r ]", label)) {
-    /* successfully read label; advance pointer over the label */
-    ptr += strlen(label);
+    /* -e: keep what fit, drop the rest of the line */
+    while((c = fgetc(inFilePtr)) != EOF && c != '\n')
+      ;
   }
   /*
-   * Parse the rest of the line. Would be nice to have real regular
-   * expressions, but scanf will suffice.
+   * Split the line on blanks by hand: the label is whatever starts in
+   * column 0, then up to four more fields. Same fields sscanf used to find,
+   * without rescanning the format for every line.
    */
-  sscanf(ptr, "%*[\t\n\r ]%[^\t\n\r ]%*[\t\n\r ]%[^\t\n\r ]%*[\t\n\r ]%[^\t\n\r ]%*[\t\n\r ]%[^\t\n\r ]", opcode, arg0, arg1, arg2);
+  ptr = __copyField(line, line, label, &col[0]);
+  ptr = __copyField(line, __skipBlanks(ptr), opcode, &col[1]);
+  ptr = __copyField(line, __skipBlanks(ptr), arg0, &col[2]);
+  ptr = __copyField(line, __skipBlanks(ptr), arg1, &col[3]);
+  __copyField(line, __skipBlanks(ptr), arg2, &col[4]);
   return(1);
 }
 
+// Sources ///////////////////////////////////////////
+/*
+ * Pass one reads the main file into stmts[], following
+ *         .include  file
+ * (relative to the including file) and expanding macros defined as
+ *   name  .macro    p0 p1 p2
+ *         ...                 ; p0..p2 are replaced by the arguments
+ *         .endm
+ * and invoked as `label name a0 a1 a2`. Labels get their address as the
+ * statements are appended. Labels defined in a macro body are local to
+ * each expansion: they and the operands naming them are renamed to "@"
+ * and a serial number, which no label in a source can be, so a macro that
+ * branches within itself can be used any number of times.
+ */
+void __readSource(FILE*, const char*, int);
+
+struct macro* __findMacro(const char name[]){
+  struct macro *m;
+
+  for(m = macros; m != NULL; m = m->next){
+    if(!strcmp(m->name, name))
+      return m;
+  }
+  return NULL;
+}
+struct macro* __defineMacro(char name[], char *param[]){
+  struct macro *m;
+  int i;
+
+  if(__isValidLabel(name) == 0)
+    raiseError(ER_LABELINVALID, name);
+  if(__findMacro(name) != NULL)
+    raiseError(ER_DUPLICATE, name);
+  if(isaByName(name) != NULL)
+    raiseError(ER_MACRO, name);
+  m = (struct macro*)calloc(1, sizeof(struct macro));
+  strncpy(m->name, name, MAXLABELSIZE+1);
+  for(i = 0; i < 3; i++)
+    m->param[i] = strdup(param[i]);
+  m->next = macros;
+  macros = m;
+  return m;
+}
+/* the body line defining label `name` locally, -1 when there is none */
+int __macroLocal(const struct macro *m, const char name[]){
+  int i;
+
+  for(i = 0; i < m->numLines; i++){
+    if(m->body[i].local >= 0 && !strcmp(m->body[i].tok[0], name))
+      return i;
+  }
+  return -1;
+}
+void __addMacroLine(struct macro *m, char *tok[], const unsigned short col[], int line){
+  struct macroLine *ml;
+  int i, local = -1;
+
+  /* a label that is not a parameter belongs to the macro */
+  if(tok[0][0] != '\0' && strcmp(tok[0], m->param[0]) && strcmp(tok[0], m->param[1])
+     && strcmp(tok[0], m->param[2])){
+    if(__isValidLabel(tok[0]) == 0)
+      raiseError(ER_LABELINVALID, tok[0]);
+    else if(__macroLocal(m, tok[0]) >= 0)
+      raiseError(ER_DUPLICATE, tok[0]);
+    else
+      local = m->numLocals++;
+  }
+  m->body = (struct macroLine*)realloc(m->body, (m->numLines+1)*sizeof(struct macroLine));
+  ml = &m->body[m->numLines++];
+  for(i = 0; i < 5; i++){
+    ml->tok[i] = strdup(tok[i]);
+    ml->col[i] = col[i];
+  }
+  ml->line = line;
+  ml->local = local;
+}
+
+/* the five tokens share one block: a malloc per statement, not five */
+void setTokens(struct statement *stmt, char *tok[]){
+  size_t len[5], total = 0;
+  char *p;
+  int i;
+
+  for(i = 0; i < 5; i++)
+    total += len[i] = strlen(tok[i]) + 1;
+  p = (char*)malloc(total);
+  for(i = 0; i < 5; i++){
+    memcpy(p, tok[i], len[i]);
+    if(i == 0) stmt->label = p;
+    else if(i == 1) stmt->opcode = p;
+    else stmt->arg[i-2] = p;
+    p += len[i];
+  }
+}
+void freeTokens(struct statement *stmt){
+  free(stmt->label);
+}
+
+void __appendStatement(char *tok[], const unsigned short col[], const char *file, int line){
+  const struct isaEntry *e;
+  struct statement *stmt;
+
+  if(tok[0][0] != '\0'){
+    addLabel(tok[0], pc);
+  }
+  if(numStmts == stmtCap){
+    stmtCap = stmtCap ? 2*stmtCap : 1024;
+    stmts = (struct statement*)realloc(stmts, stmtCap*sizeof(struct statement));
+  }
+  stmt = &stmts[numStmts++];
+  memset(stmt, 0, sizeof(struct statement));
+  stmt->file = file;
+  stmt->line = line;
+  memcpy(stmt->col, col, sizeof(stmt->col));
+  setTokens(stmt, tok);
+  if(!strcmp(stmt->opcode, ".fill")){
+    stmt->labelRef = stmt->arg[0][0] != '\0' && !isNumber(stmt->arg[0]);
+  } else {
+    e = isaByName(stmt->opcode);
+    if(e != NULL && e->format == ITYPE)
+      stmt->labelRef = stmt->arg[2][0] != '\0' && !isNumber(stmt->arg[2]);
+  }
+  pc++;
+}
+
+void __statement(char *tok[], const unsigned short col[], const char *file, int line, int depth){
+  char path[MAXLINELENGTH], *arg, *sub[5], (*local)[MAXLABELSIZE+1];
+  const char *slash;
+  struct macro *m;
+  struct macroLine *ml;
+  FILE *fp;
+  int i, j, p, k;
+
+  if(depth > MAXNESTING)
+    raiseError(ER_NESTING, tok[1]);
+
+  if(!strcmp(tok[1], ".include")){
+    if(tok[0][0] != '\0')
+      addLabel(tok[0], pc);
+    arg = tok[2];
+    if(arg[0] == '"'){
+      arg++;
+      if(arg[0] != '\0' && arg[strlen(arg)-1] == '"')
+        arg[strlen(arg)-1] = '\0';
+    }
+    if(arg[0] == '\0'){
+      raiseError(ER_INSUFFICIENT, tok[1]);
+      return;
+    }
+    slash = strrchr(file, '/');
+    if(arg[0] != '/' && slash != NULL)
+      snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - file), file, arg);
+    else
+      snprintf(path, sizeof(path), "%s", arg);
+    fp = fopen(path, "r");
+    if(fp == NULL)
+      raiseError(ER_OPENFILE, path);
+    __readSource(fp, path, depth+1);
+    fclose(fp);
+    return;
+  }
+
+  m = __findMacro(tok[1]);
+  if(m != NULL){
+    if(tok[0][0] != '\0')
+      addLabel(tok[0], pc);
+    if(numLocalLabels + m->numLocals > MAXLOCALS)
+      raiseError(ER_MACRO, m->name);
+    local = malloc((m->numLocals + 1) * sizeof(*local));
+    for(k = 0; k < m->numLocals; k++)
+      sprintf(local[k], "@%x", numLocalLabels++);
+    for(i = 0; i < m->numLines; i++){
+      ml = &m->body[i];
+      for(j = 0; j < 5; j++){
+        sub[j] = ml->tok[j];
+        for(p = 0; p < 3; p++){
+          if(m->param[p][0] != '\0' && !strcmp(sub[j], m->param[p]))
+            sub[j] = tok[2+p];
+        }
+        if(sub[j] == ml->tok[j] && j != 1 && sub[j][0] != '\0' && (k = __macroLocal(m, sub[j])) >= 0)
+          sub[j] = local[m->body[k].local];
+      }
+      where.line = ml->line;
+      where.tok = sub;
+      where.col = ml->col;
+      /* addLabel() would refuse the renamed label */
+      if(ml->local >= 0){
+        __addSymbol(sub[0], pc);
+        sub[0] = "";
+      }
+      __statement(sub, ml->col, file, ml->line, depth+1);
+    }
+    free(local);
+    where.line = line;
+    where.tok = tok;
+    where.col = col;
+    return;
+  }
+
+  __appendStatement(tok, col, file, line);
+}
+
+void __readSource(FILE *inFilePtr, const char *path, int depth){
+  char label[MAXLINELENGTH], opcode[MAXLINELENGTH], arg0[MAXLINELENGTH], arg1[MAXLINELENGTH], arg2[MAXLINELENGTH];
+  char *tok[5] = {label, opcode, arg0, arg1, arg2};
+  unsigned short col[5];
+  struct macro *def = NULL;
+  const char *file;
+  int line;
+
+  sources = (char**)realloc(sources, (numSources+1)*sizeof(char*));
+  file = sources[numSources++] = strdup(path);
+  where.file = file;
+  where.tok = tok;
+  where.col = col;
+  for(line = 1; where.line = line, readAndParse(inFilePtr, label, opcode, arg0, arg1, arg2, col); line++){
+    if(opcode[0] == '\0')
+      continue;
+    if(def != NULL){
+      if(!strcmp(opcode, ".endm"))
+        def = NULL;
+      else
+        __addMacroLine(def, tok, col, line);
+    } else if(!strcmp(opcode, ".macro")){
+      def = __defineMacro(label, tok+2);
+    } else if(!strcmp(opcode, ".endm")){
+      raiseError(ER_MACRO, opcode);
+    } else {
+      __statement(tok, col, file, line, depth);
+      /* back from an .include */
+      where.file = file;
+      where.tok = tok;
+      where.col = col;
+    }
+  }
+  if(def != NULL)
+    raiseError(ER_MACRO, def->name);
+}
+
+void readProgram(FILE *inFilePtr, const char *path){
+  pc = 0;
+  numLocalLabels = 0;
+  __readSource(inFilePtr, path, 0);
+}
+/* -c: symbolic operands nobody here defines are left to the linker */
+void resolveExternals(){
+  struct statement *stmt;
+  const char *name;
+
+  for(stmt = stmts; stmt < stmts + numStmts; stmt++){
+    if(!stmt->labelRef)
+      continue;
+    name = __isData(stmt) ? stmt->arg[0] : stmt->arg[2];
+    if(readLabel(name) == &notfound && isGlobalLabel(name)){
+      stmt->labelRef = 0;
+      stmt->external = 1;
+    }
+  }
+}
+void freeProgram(){
+  struct macro *m;
+  int i, j;
+
+  for(i = 0; i < numStmts; i++)
+    freeTokens(&stmts[i]);
+  free(stmts);
+  stmts = NULL;
+  numStmts = stmtCap = 0;
+  while(macros != NULL){
+    m = macros;
+    macros = m->next;
+    for(i = 0; i < m->numLines; i++)
+      for(j = 0; j < 5; j++)
+        free(m->body[i].tok[j]);
+    for(i = 0; i < 3; i++)
+      free(m->param[i]);
+    free(m->body);
+    free(m);
+  }
+  for(i = 0; i < numSources; i++)
+    free(sources[i]);
+  free(sources);
+  sources = NULL;
+  numSources = 0;
+}
+
 int isNumber(const char *string){
   /* return 1 if string is a number */
-  int i;
-  return( (sscanf(string, "%d", &i)) == 1);
+  /* what sscanf("%d") accepts: blanks, a sign and at least one digit */
+  char *end;
+  strtol(string, &end, 10);
+  return(end != string);
 }
 
 ///////////////////////////////////////////////////////////
+/* column of msg among the tokens it came from, 0 when it is none of them */
+int __columnOf(const char msg[], char *const tok[], const unsigned short col[]){
+  int i;
+
+  for(i = 0; i < 5; i++){
+    if(msg == tok[i])
+      return col[i];
+  }
+  for(i = 0; i < 5; i++){
+    if(tok[i][0] != '\0' && !strcmp(msg, tok[i]))
+      return col[i];
+  }
+  return 0;
+}
+void __recordError(struct errorRecord *e, int code, const char msg[]){
+  const struct statement *stmt;
+  char *tok[5];
+
+  e->code = code;
+  e->addr = pc;
+  if(current != NULL){
+    stmt = &stmts[pc];
+    tok[0] = stmt->label;
+    tok[1] = stmt->opcode;
+    memcpy(tok + 2, stmt->arg, sizeof(stmt->arg));
+    e->file = stmt->file;
+    e->line = stmt->line;
+    e->col = __columnOf(msg, tok, stmt->col);
+  } else {
+    e->file = where.file;
+    e->line = where.line;
+    e->col = where.tok ? __columnOf(msg, where.tok, where.col) : 0;
+  }
+  snprintf(e->arg, sizeof(e->arg), "%s", msg);
+}
+void reportError(const struct errorRecord *e){
+  if(maxErrors == 0){
+    pc = e->addr;
+    raiseError(e->code, e->arg);
+  }
+  if(e->col > 0)
+    fprintf(stderr, "[ERROR] %s:%d:%d: address %d: %s (%s)\n",
+            e->file, e->line, e->col, e->addr, errorMsg[e->code], e->arg);
+  else
+    fprintf(stderr, "[ERROR] %s:%d: address %d: %s (%s)\n",
+            e->file, e->line, e->addr, errorMsg[e->code], e->arg);
+  if(++numErrors == maxErrors){
+    fprintf(stderr, "[ERROR] stopping after %d errors\n", numErrors);
+    exit(1);
+  }
+}
+/*
+ * Exits, except with -e for errors a line can be skipped over: there it
+ * is reported (or, in the second pass, recorded for translateProgram())
+ * and the caller goes on with a placeholder.
+ */
 void raiseError(int code, const char msg[]){
+  struct errorRecord e;
+
+  if(current != NULL){
+    /* inside a second-pass chunk: translateProgram() reports it */
+    current->errors = (struct errorRecord*)realloc(current->errors,
+                        (current->numErrors + 1) * sizeof(struct errorRecord));
+    __recordError(&current->errors[current->numErrors++], code, msg);
+    longjmp(current->trap, 1);
+  }
+  if(maxErrors > 0 && code != ER_WRONGUSAGE && code != ER_OPENFILE
+     && code != ER_NESTING && code != ER_MACRO){
+    __recordError(&e, code, msg);
+    reportError(&e);
+    return;
+  }
   if(code == ER_WRONGUSAGE || code == ER_OPENFILE)
     fprintf(stderr, "[ERROR] %s %s\n", errorMsg[code], msg);
   else
@@ -0,0 +1,338 @@
+/* LC-2K linker: merges objects from `assemble -c` into one machine-code file */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAXLABELSIZE  6
+#define MAXINT16 32767
+#define MININT16 (-32768)
+#define MAXTHREADS 16
+#define STACKLABEL "Stack" /* when nobody defines it: the first free address */
+
+// Types ///////////////////////////////////////////
+typedef int word_t;
+
+struct objSymbol{
+  char name[MAXLABELSIZE+2];
+  char section;  /* T, D, or U for imports */
+  int offset;
+};
+struct objReloc{
+  int addr;      /* within the object, text then data */
+  char opcode[MAXLABELSIZE+2];
+  char label[MAXLABELSIZE+2];
+};
+struct object{
+  const char *file;
+  int textSize, dataSize, numSyms, numRelocs;
+  word_t *words; /* text then data, as assembled */
+  struct objSymbol *syms;
+  struct objReloc *relocs;
+  int textBase, dataBase;
+  int error;     /* first failure, reported in file order */
+  const char *errorArg;
+};
+struct global{
+  const char *name; /* NULL for empty slots */
+  int addr;
+  int owner;        /* index of the defining object */
+};
+
+// Globals ///////////////////////////////////////////
+static struct object *objects;
+static int numObjects;
+static struct global *globals;
+static unsigned globalMask;
+static word_t *image;
+static int imageSize;
+static int nextJob;
+
+// Errors ///////////////////////////////////////////
+#define ER_NONE         0
+#define ER_WRONGUSAGE   1
+#define ER_OPENFILE     2
+#define ER_OBJFORMAT    3
+#define ER_DUPLICATE    4
+#define ER_UNDEFINED    5
+#define ER_OFFSETOVFL   6
+
+char* errorMsg[] = {
+  [ER_NONE]         "",
+  [ER_WRONGUSAGE]   "usage: link <object-file>... <machine-code-file>",
+  [ER_OPENFILE]     "error in opening file",
+  [ER_OBJFORMAT]    "malformed object file",
+  [ER_DUPLICATE]    "duplicate global labels",
+  [ER_UNDEFINED]    "use of undefined global label",
+  [ER_OFFSETOVFL]   "offsetFields that don't fit in 16bits",
+};
+
+// Functions ///////////////////////////////////////////
+void    readObject(struct object*);
+void    relocateObject(struct object*, int);
+void    runParallel(void (*)(int));
+void    raiseError(int, const char*, const char*);
+
+///////////////////////////////////////////////////////////
+//                      main start                       //
+///////////////////////////////////////////////////////////
+void __readJob(int i){
+  readObject(&objects[i]);
+}
+void __relocateJob(int i){
+  relocateObject(&objects[i], i);
+}
+unsigned __hash(const char *name){
+  unsigned h = 2166136261u;
+
+  while(*name)
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  return h;
+}
+struct global* __lookup(const char *name){
+  unsigned i;
+
+  for(i = __hash(name) & globalMask; globals[i].name != NULL; i = (i + 1) & globalMask){
+    if(!strcmp(globals[i].name, name))
+      break;
+  }
+  return &globals[i];
+}
+
+int main(int argc, char *argv[]){
+  FILE *outFilePtr;
+  struct object *obj;
+  struct objSymbol *sym;
+  struct global *g;
+  int i, j, textSize = 0, dataSize = 0, numGlobals = 0;
+
+  if(argc < 3){
+    raiseError(ER_WRONGUSAGE, NULL, argv[0]);
+  }
+  numObjects = argc - 2;
+  objects = (struct object*)calloc(numObjects, sizeof(struct object));
+  for(i = 0; i < numObjects; i++)
+    objects[i].file = argv[1+i];
+
+  // 1. Read every object
+  runParallel(__readJob);
+  for(i = 0; i < numObjects; i++){
+    if(objects[i].error)
+      raiseError(objects[i].error, objects[i].file, objects[i].errorArg);
+  }
+
+  // 2. Lay out all text first, then all data, in command line order
+  for(i = 0; i < numObjects; i++){
+    objects[i].textBase = textSize;
+    textSize += objects[i].textSize;
+    numGlobals += objects[i].numSyms;
+  }
+  for(i = 0; i < numObjects; i++){
+    objects[i].dataBase = textSize + dataSize;
+    dataSize += objects[i].dataSize;
+  }
+  imageSize = textSize + dataSize;
+
+  // 3. Global symbol table
+  for(globalMask = 1; globalMask < 2 * (unsigned)numGlobals + 2; globalMask <<= 1)
+    ;
+  globals = (struct global*)calloc(globalMask, sizeof(struct global));
+  globalMask--;
+  for(i = 0; i < numObjects; i++){
+    obj = &objects[i];
+    for(j = 0; j < obj->numSyms; j++){
+      sym = &obj->syms[j];
+      if(sym->section == 'U')
+        continue;
+      g = __lookup(sym->name);
+      if(g->name != NULL)
+        raiseError(ER_DUPLICATE, obj->file, sym->name);
+      g->name = sym->name;
+      g->owner = i;
+      g->addr = sym->section == 'T' ?
+                  obj->textBase + sym->offset : obj->dataBase + sym->offset;
+    }
+  }
+
+  // 4. Relocate every object into its place in the image
+  image = (word_t*)malloc((imageSize + 1) * sizeof(word_t));
+  runParallel(__relocateJob);
+  for(i = 0; i < numObjects; i++){
+    if(objects[i].error)
+      raiseError(objects[i].error, objects[i].file, objects[i].errorArg);
+  }
+
+  outFilePtr = fopen(argv[argc-1], "w");
+  if(outFilePtr == NULL){
+    raiseError(ER_OPENFILE, NULL, argv[argc-1]);
+  }
+  for(i = 0; i < imageSize; i++)
+    fprintf(outFilePtr, "%d\n", image[i]);
+  fclose(outFilePtr);
+
+  for(i = 0; i < numObjects; i++){
+    free(objects[i].words);
+    free(objects[i].syms);
+    free(objects[i].relocs);
+  }
+  free(objects);
+  free(globals);
+  free(image);
+  exit(0);
+}
+///////////////////////////////////////////////////////////
+//                      main end                         //
+///////////////////////////////////////////////////////////
+
+
+// Definitions ///////////////////////////////////////////
+#define __fail(obj, code, arg) do { \
+    (obj)->error = (code);         \
+    (obj)->errorArg = (arg);       \
+  } while(0)
+
+void readObject(struct object *obj){
+  FILE *fp;
+  int i, n;
+
+  fp = fopen(obj->file, "r");
+  if(fp == NULL){
+    __fail(obj, ER_OPENFILE, obj->file);
+    return;
+  }
+  if(fscanf(fp, "%d %d %d %d", &obj->textSize, &obj->dataSize,
+            &obj->numSyms, &obj->numRelocs) != 4
+     || obj->textSize < 0 || obj->dataSize < 0 || obj->numSyms < 0 || obj->numRelocs < 0)
+    goto bad;
+  n = obj->textSize + obj->dataSize;
+  obj->words = (word_t*)malloc((n + 1) * sizeof(word_t));
+  obj->syms = (struct objSymbol*)malloc((obj->numSyms + 1) * sizeof(struct objSymbol));
+  obj->relocs = (struct objReloc*)malloc((obj->numRelocs + 1) * sizeof(struct objReloc));
+  for(i = 0; i < n; i++){
+    if(fscanf(fp, "%d", &obj->words[i]) != 1)
+      goto bad;
+  }
+  for(i = 0; i < obj->numSyms; i++){
+    if(fscanf(fp, "%7s %c %d", obj->syms[i].name, &obj->syms[i].section,
+              &obj->syms[i].offset) != 3)
+      goto bad;
+    if(obj->syms[i].section != 'T' && obj->syms[i].section != 'D'
+       && obj->syms[i].section != 'U')
+      goto bad;
+  }
+  for(i = 0; i < obj->numRelocs; i++){
+    if(fscanf(fp, "%d %7s %7s", &obj->relocs[i].addr, obj->relocs[i].opcode,
+              obj->relocs[i].label) != 3)
+      goto bad;
+    if(obj->relocs[i].addr < 0 || obj->relocs[i].addr >= n)
+      goto bad;
+  }
+  fclose(fp);
+  return;
+bad:
+  fclose(fp);
+  __fail(obj, ER_OBJFORMAT, "");
+}
+
+/* a local address of the object, as assembled at 0, to its linked address */
+int __place(const struct object *obj, int local){
+  return local < obj->textSize ?
+           obj->textBase + local : obj->dataBase + local - obj->textSize;
+}
+/* resolves `label` as seen from object `self`, -1 when it is undefined */
+int __resolve(const struct object *obj, int self, const char *label, int local){
+  struct global *g;
+
+  if(label[0] < 'A' || label[0] > 'Z')
+    return __place(obj, local);
+  g = __lookup(label);
+  if(g->name != NULL)
+    return g->owner == self ? __place(obj, local) : g->addr;
+  if(!strcmp(label, STACKLABEL))
+    return imageSize;
+  return -1;
+}
+
+void relocateObject(struct object *obj, int self){
+  struct objReloc *r;
+  word_t *w;
+  int i, addr, off, target;
+
+  memcpy(image + obj->textBase, obj->words, obj->textSize * sizeof(word_t));
+  memcpy(image + obj->dataBase, obj->words + obj->textSize, obj->dataSize * sizeof(word_t));
+  for(i = 0; i < obj->numRelocs; i++){
+    r = &obj->relocs[i];
+    addr = __place(obj, r->addr);
+    w = &image[addr];
+    if(!strcmp(r->opcode, ".fill")){
+      target = __resolve(obj, self, r->label, *w);
+      if(target < 0)
+        goto undefined;
+      *w = target;
+      continue;
+    }
+    off = (int)(short)(*w & 0xffff);
+    if(!strcmp(r->opcode, "beq")){
+      target = __resolve(obj, self, r->label, r->addr + 1 + off);
+      if(target < 0)
+        goto undefined;
+      off = target - addr - 1;
+    } else {
+      off = __resolve(obj, self, r->label, off);
+      if(off < 0)
+        goto undefined;
+    }
+    if(off < MININT16 || off > MAXINT16){
+      __fail(obj, ER_OFFSETOVFL, r->label);
+      return;
+    }
+    *w = (*w & ~0xffff) | (off & 0xffff);
+  }
+  return;
+undefined:
+  __fail(obj, ER_UNDEFINED, r->label);
+}
+
+///////////////////////////////////////////////////////////
+void* __worker(void *arg){
+  void (*job)(int) = (void (*)(int))arg;
+  int i;
+
+  while((i = __sync_fetch_and_add(&nextJob, 1)) < numObjects)
+    job(i);
+  return NULL;
+}
+/* runs job(i) for every object on a small thread pool */
+void runParallel(void (*job)(int)){
+  pthread_t threads[MAXTHREADS];
+  long n;
+  int i;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n < 1)
+    n = 1;
+  if(n > MAXTHREADS)
+    n = MAXTHREADS;
+  if(n > numObjects)
+    n = numObjects;
+  nextJob = 0;
+  for(i = 1; i < n; i++)
+    pthread_create(&threads[i], NULL, __worker, (void*)job);
+  __worker((void*)job);
+  for(i = 1; i < n; i++)
+    pthread_join(threads[i], NULL);
+}
+
+///////////////////////////////////////////////////////////
+void raiseError(int code, const char file[], const char msg[]){
+  if(code == ER_WRONGUSAGE || code == ER_OPENFILE)
+    fprintf(stderr, "[ERROR] %s %s\n", errorMsg[code], msg);
+  else if(msg[0] == '\0')
+    fprintf(stderr, "[ERROR] %s: %s\n", file, errorMsg[code]);
+  else
+    fprintf(stderr, "[ERROR] %s: %s (%s)\n", file, errorMsg[code], msg);
+  exit(1);
+}
+
+// End //////////////////////////////////////////////////////
@@ -2,8 +2,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <limits.h>
+#include "../../common/pagemem.h"
+#include "../../common/guardmem.h"
+#include "../../common/isa.h"
+#include "../../common/devices.h"
+#include "../../common/callprof.h"
+#include "simulate.h"
 
-#define NUMMEMORY 65536 /* maximum number of words in memory */
+#define MEMBITS 16 /* default address bits: 65536 words of memory */
+#define MAXCORES 64
+#define QUANTUM 1000 /* default instructions per core between barriers */
+#define COREREG 7    /* register seeded with the core index */
 #define NUMREGS 8 /* number of machine registers */
 #define MAXLINELENGTH 1000
 
@@ -14,7 +33,6 @@
   __ext_v32;})
 
 typedef unsigned int word_t;
-enum instType {RTYPE, ITYPE, JTYPE, OTYPE};
 
 typedef struct {
   word_t destReg:  3;
@@ -51,41 +69,50 @@ typedef union {
   word_t  x32;
 } instruction;
 
-#define OP_ADD   0
-#define OP_NOR   1
-#define OP_LW    2
-#define OP_SW    3
-#define OP_BEQ   4
-#define OP_JALR  5
-#define OP_HALT  6
-#define OP_NOOP  7
-
-static struct isa {
-  char *name;
-  int opcode;
-  enum instType format;
-} isa[] = {
-  {"add",  OP_ADD,  RTYPE},
-  {"nor",  OP_NOR,  RTYPE},
-  {"lw",   OP_LW,   ITYPE},
-  {"sw",   OP_SW,   ITYPE},
-  {"beq",  OP_BEQ,  ITYPE},
-  {"jalr", OP_JALR, JTYPE},
-  {"halt", OP_HALT, OTYPE},
-  {"noop", OP_NOOP, OTYPE},
-};
-
 typedef struct stateStruct {
   int pc;
-  int mem[NUMMEMORY];
+  pageMem mem;
+  int *flat; /* guarded flat copy of mem while running in fast mode, */
+  int stride; /* or this instance's words of a batch, `stride` apart */
   int reg[NUMREGS];
   int numMemory;
+  int isaExt; /* extensions to decode out of the unused bits, ISA_EXT* */
+  struct storeBufferStruct *sb; /* per-core stores in multi-core mode */
+  devices *dev; /* memory-mapped devices, NULL when there are none */
+  callProf *prof; /* call-graph profile, NULL when off */
+  const volatile long *clock; /* instructions run are clockBase + *clock */
+  long clockBase;
   struct {
     int opcode;
     enum instType format;
   } cunit;
 } stateType;
 
+#define LOOPCACHE 64 /* back edges the loop skipper remembers */
+
+typedef struct {
+  int tail;      /* address of the backward beq */
+  int wait;      /* times it is taken before the loop is looked at again */
+  int backoff;
+} loopSeen;
+
+struct simStruct {
+  stateType state;
+  int flags;
+  int halted;
+  int failed;    /* a run raised an error, cleared by the next load */
+  int error;     /* ER_* and its data, of the last call that failed */
+  int errorData;
+  long executed;
+  jmp_buf trap;  /* raiseError lands here while a library call runs */
+  loopSeen loops[LOOPCACHE]; /* loops that could not be skipped */
+  devices dev;   /* state.dev points here while they are attached */
+  callProf prof; /* state.prof points here while profiling */
+};
+
+/* handle of the library call running on this thread, NULL outside of one */
+static __thread simHandle *simActive;
+
 // Error handling
 #define ER_WRONGUSAGE     0
 #define ER_OPENFILE       1
@@ -94,20 +121,28 @@ typedef struct stateStruct {
 #define ER_OUTOFBOUNDREG  5
 #define ER_UNRECOGNIZE    6
 #define ER_WRITEREG0      7
+#define ER_GDBSOCKET      8
+#define ER_OUTOFMEMORY    9
 
-char* errorMsg[] = {
-  [ER_WRONGUSAGE]     "usage: simulate <machine-code file>",
+static char* errorMsg[] = {
+  [ER_WRONGUSAGE]     "usage: simulate [-f] [-x] [-g port|socket-path] [-m address-bits] [-n cores [-q quantum]] [-d console-file] [-F folded-file [-L label-map]] <machine-code file> (with -n, core i starts with i in reg 7)",
   [ER_OPENFILE]       "error in opening file",
   [ER_WRONGADDRESS]   "error in reading address",
   [ER_OUTOFBOUNDMEM]  "memory address out of bound",
   [ER_OUTOFBOUNDREG]  "register number out of bound",
   [ER_UNRECOGNIZE]    "unrecognized opcode",
   [ER_WRITEREG0]      "illegal write to register 0",
+  [ER_GDBSOCKET]      "error in setting up gdb remote socket",
+  [ER_OUTOFMEMORY]    "out of memory for the page of address",
 };
 
+static __attribute__((noreturn)) void __simFail(int, int);
+
 #ifdef _DEBUG
 #define raiseError(code, data)                          \
   do {                                                  \
+    if (simActive)                                      \
+      __simFail(code, data);                            \
     fprintf(stderr, "[ERROR] [%s:%d] %s -> %d\n",       \
             __FILE__, __LINE__, errorMsg[code], data);  \
     exit(1);                                            \
@@ -115,6 +150,8 @@ char* errorMsg[] = {
 #else
 #define raiseError(code, data)              \
   do {                                      \
+    if (simActive)                          \
+      __simFail(code, data);                \
     fprintf(stderr, "[ERROR] %s -> %d\n",   \
             (errorMsg[code]), (data));      \
     exit(1);                                \
@@ -126,10 +163,21 @@ char* errorMsg[] = {
             (errorMsg[code]), (msg));       \
     exit(1);                                \
   } while(0);
+/* reports the error a library call returned */
+#define raiseSimError(sim)                  \
+  do {                                      \
+    int __code, __data;                     \
+    __code = simError((sim), &__data);      \
+    raiseError(__code, __data);             \
+  } while(0)
 
 // Function declarations
-int  run(stateType *);
-void printState(stateType *);
+static int  step(stateType *);
+static void printState(stateType *);
+#ifndef LC2K_LIBRARY
+static long runCores(simHandle *, int, int);
+static int  runGdb(simHandle *, const char *);
+static char *readFile(const char *, size_t *);
 
 ///////////////////////////////////////////////////////////
 //                      main start                       //
@@ -137,30 +185,118 @@ void printState(stateType *);
 
 int main(int argc, char *argv[])
 {
-  char line[MAXLINELENGTH] = {0,};
-  stateType state = {0,};
-  FILE *filePtr;
-  int instCount;
+  simHandle *sim;
+  char *text;
+  size_t len;
+  const char *gdbAddr = NULL;
+  const char *console = NULL;
+  const char *folded = NULL, *labelMap = NULL;
+  char *labels = NULL;
+  size_t labelsLen = 0;
+  FILE *foldedPtr = NULL;
+  int memBits = MEMBITS;
+  int flags = SIM_TRACE, ext = 0;
+  int numCores = 0, quantum = QUANTUM;
+  int opt, i, data, consoleFd = -1;
 
-  if (argc != 2)
+  while ((opt = getopt(argc, argv, "d:F:fg:L:m:n:q:x")) != -1) {
+    switch (opt) {
+      case 'f':
+        flags = SIM_FAST;
+        break;
+      case 'x':
+        ext = SIM_ISAEXT;
+        break;
+      case 'n':
+        numCores = atoi(optarg);
+        if (numCores < 1 || numCores > MAXCORES)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'q':
+        quantum = atoi(optarg);
+        if (quantum < 1)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'g':
+        gdbAddr = optarg;
+        break;
+      case 'd':
+        console = optarg;
+        break;
+      case 'F':
+        folded = optarg;
+        break;
+      case 'L':
+        labelMap = optarg;
+        break;
+      case 'm':
+        memBits = atoi(optarg);
+        if (memBits < PM_MINBITS || memBits > PM_MAXBITS)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      default:
+        raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+    }
+  }
+  /* cores have no devices or fast mode, only plain runs are profiled */
+  if (argc - optind != 1 || (console && numCores) || (flags == SIM_FAST && numCores)
+      || (folded && (numCores || gdbAddr)) || (labelMap && !folded))
     raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
 
-  filePtr = fopen(argv[1], "r");
-  if (filePtr == NULL)
-    raiseErrorMsg(ER_OPENFILE, argv[1]);
-
-  /* read in the entire machine-code file into memory */
-  for (state.numMemory = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL; state.numMemory++) {
-    if (sscanf(line, "%d", state.mem+state.numMemory) != 1)
-      raiseError(ER_WRONGADDRESS, state.numMemory);
-    printf("memory[%d]=%d\n", state.numMemory, state.mem[state.numMemory]);
+  text = readFile(argv[optind], &len);
+  if (text == NULL)
+    raiseErrorMsg(ER_OPENFILE, argv[optind]);
+  if (console) {
+    consoleFd = strcmp(console, "-") == 0 ? STDOUT_FILENO
+      : open(console, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (consoleFd < 0)
+      raiseErrorMsg(ER_OPENFILE, console);
   }
+  if (labelMap && (labels = readFile(labelMap, &labelsLen)) == NULL)
+    raiseErrorMsg(ER_OPENFILE, labelMap);
+  if (folded && (foldedPtr = fopen(folded, "w")) == NULL)
+    raiseErrorMsg(ER_OPENFILE, folded);
+  sim = simOpen(memBits, flags | ext);
+  if (sim == NULL)
+    raiseErrorMsg(ER_OPENFILE, "out of memory");
+
+  /* the entire machine-code file goes into memory */
+  if (simLoadText(sim, text, len) != SIM_OK)
+    raiseSimError(sim);
+  free(text);
+  for (i = 0; simReadMem(sim, i, &data) == SIM_OK; i++)
+    printf("memory[%d]=%d\n", i, data);
+  /* the console writes to its file from another thread, so what is
+     printed here goes out first and the final state after it */
+  fflush(stdout);
+  if (consoleFd >= 0 && simDevices(sim, consoleFd) != SIM_OK)
+    raiseSimError(sim);
+  if (foldedPtr && simProfileOpen(sim, labels, labelsLen) != SIM_OK)
+    raiseSimError(sim);
+  free(labels);
 
-  instCount = run(&state);
+  if (gdbAddr)
+    runGdb(sim, gdbAddr);
+  else if (numCores)
+    runCores(sim, numCores, quantum);
+  else {
+    if (simRun(sim) != SIM_HALTED) {
+      simDevices(sim, -1);
+      raiseSimError(sim);
+    }
+    printf("machine halted\n");
+  }
+  simDevices(sim, -1);
+  if (foldedPtr) {
+    if (simProfileWrite(sim, foldedPtr) != SIM_OK)
+      raiseSimError(sim);
+    fclose(foldedPtr);
+  }
 
-  printf("total of %d instructions executed\n", instCount);
+  printf("total of %ld instructions executed\n", simExecuted(sim));
   printf("final state of machine:");
-  printState(&state);
+  printState(&sim->state);
+  simClose(sim);
 
   return(0);
 }
@@ -168,6 +304,27 @@ int main(int argc, char *argv[])
 //                      main end                         //
 ///////////////////////////////////////////////////////////
 
+// Whole file into a buffer, NULL when it cannot be read
+static char *readFile(const char *path, size_t *len)
+{
+  FILE *filePtr;
+  char *text;
+  long size;
+
+  filePtr = fopen(path, "r");
+  if (filePtr == NULL)
+    return NULL;
+  fseek(filePtr, 0, SEEK_END);
+  size = ftell(filePtr);
+  rewind(filePtr);
+  text = size < 0 ? NULL : (char *)malloc(size + 1);
+  if (text != NULL)
+    *len = fread(text, 1, size, filePtr);
+  fclose(filePtr);
+  return text;
+}
+#endif /* !LC2K_LIBRARY */
+
 // Register&Memory R/W
 static word_t __readReg(stateType *statePtr, word_t reg)
 {
@@ -183,18 +340,73 @@ static void __writeReg(stateType *statePtr, word_t reg, word_t data)
   statePtr->reg[reg] = data;
 }
 
-static word_t __readMem(stateType *statePtr, word_t addr)
+// `mode` is always a constant, so every instantiation keeps only its own
+// path: the fast one has no bounds compare at all (out-of-bound accesses
+// fault on the guard region instead), the device one is the fast one with
+// the device region checked, the core one goes through the core's store
+// buffer, the lane one reads one instance of a batch
+#define CHECKEDMEM 0
+#define FASTMEM    1
+#define COREMEM    2
+#define LANEMEM    3
+#define DEVMEM     4
+
+static word_t __sbRead(struct storeBufferStruct *, word_t, word_t);
+static void   __sbWrite(struct storeBufferStruct *, word_t, word_t);
+
+// Accesses that missed the memory: a device, or out of bound
+static __attribute__((noinline, cold)) word_t __devRead(stateType *statePtr, word_t addr)
 {
-  if(addr >= statePtr->numMemory)
+  int data;
+
+  if(statePtr->dev == NULL
+     || devRead(statePtr->dev, addr, statePtr->clockBase + *statePtr->clock, &data) < 0)
     raiseError(ER_OUTOFBOUNDMEM, addr);
-  return statePtr->mem[addr];
+  return data;
 }
 
-static void __writeMem(stateType *statePtr, word_t addr, word_t data)
+static __attribute__((noinline, cold)) void __devWrite(stateType *statePtr, word_t addr, word_t data)
 {
-  if(addr >= statePtr->numMemory)
+  if(statePtr->dev == NULL
+     || devWrite(statePtr->dev, addr, statePtr->clockBase + *statePtr->clock, data) < 0)
     raiseError(ER_OUTOFBOUNDMEM, addr);
-  statePtr->mem[addr] = data;
+}
+
+static __always_inline word_t __readMem(stateType *statePtr, word_t addr, const int mode)
+{
+  if(mode == DEVMEM && devAddr(addr))
+    return __devRead(statePtr, addr);
+  if(mode == FASTMEM || mode == DEVMEM)
+    return statePtr->flat[addr];
+  if(addr >= statePtr->numMemory)
+    return __devRead(statePtr, addr);
+  if(mode == COREMEM)
+    return __sbRead(statePtr->sb, addr, pageMemRead(&statePtr->mem, addr));
+  if(mode == LANEMEM)
+    return statePtr->flat[addr * statePtr->stride];
+  return pageMemRead(&statePtr->mem, addr);
+}
+
+static __always_inline void __writeMem(stateType *statePtr, word_t addr, word_t data, const int mode)
+{
+  if(mode == DEVMEM && devAddr(addr)) {
+    __devWrite(statePtr, addr, data);
+    return;
+  }
+  if(mode == FASTMEM || mode == DEVMEM) {
+    statePtr->flat[addr] = data;
+    return;
+  }
+  if(addr >= statePtr->numMemory) {
+    __devWrite(statePtr, addr, data);
+    return;
+  }
+  if(mode == COREMEM)
+    __sbWrite(statePtr->sb, addr, data);
+  else if(mode == LANEMEM)
+    statePtr->flat[addr * statePtr->stride] = data;
+  else if(pageMemWrite(&statePtr->mem, addr, data) < 0)
+    raiseError(ER_OUTOFMEMORY, addr);
 }
 
 // 5-stages pipeline
@@ -202,9 +414,13 @@ typedef struct {
   instruction inst;
 } fetchData;
 
-void fetch(stateType *statePtr, fetchData *out)
+static __always_inline void fetch(stateType *statePtr, fetchData *out, const int mode)
 {
-  out->inst.x32 = __readMem(statePtr, statePtr->pc);
+  /* instructions never come from a device: the fast modes fault on the
+     region, the others are stopped before __readMem would look there */
+  if(mode != FASTMEM && mode != DEVMEM && (word_t)statePtr->pc >= statePtr->numMemory)
+    raiseError(ER_OUTOFBOUNDMEM, statePtr->pc);
+  out->inst.x32 = __readMem(statePtr, statePtr->pc, mode == DEVMEM ? FASTMEM : mode);
   statePtr->pc++;
 }
 
@@ -216,46 +432,43 @@ typedef struct {
   word_t destReg;
 } decodeData;
 
-int decode(stateType *statePtr, fetchData *in, decodeData *out)
+static int decode(stateType *statePtr, fetchData *in, decodeData *out)
 {
-  int i, sz;
+  const struct isaEntry *e;
   instruction *ir;
   int opcode;
   enum instType format;
 
   ir = &in->inst;
-  opcode = ir->o.opcode;
-  
-  sz = sizeof(isa)/sizeof(isa[0]);
-  for(i = 0; i < sz; i++){
-    if(isa[i].opcode == opcode){
-      statePtr->cunit.opcode = opcode;
-      statePtr->cunit.format = format = isa[i].format;
-      switch(format){
-        case RTYPE:
-          out->rdataA = __readReg(statePtr, ir->r.regA);
-          out->rdataB = __readReg(statePtr, ir->r.regB);
-          out->destReg = ir->r.destReg;
-          break;
-        case ITYPE:
-          out->rdataA = __readReg(statePtr, ir->i.regA);
-          out->rdataB = __readReg(statePtr, ir->i.regB);
-          out->offset = signExtend(ir->i.offset);
-          out->destReg = ir->i.regB;
-          break;
-        case JTYPE:
-          __writeReg(statePtr, ir->j.regB, statePtr->pc);
-          out->rdataA = __readReg(statePtr, ir->j.regA);
-          break;
-        case OTYPE:
-          if(opcode == OP_HALT)
-            return -1;
-          break;
-      }
-      return 0;
-    }
+  opcode = isaOpcode(ir->x32, statePtr->isaExt);
+  e = isaDecode(opcode);
+  if(e == NULL)
+    raiseError(ER_UNRECOGNIZE, (int)(ir->x32 >> ISA_OPSHIFT));
+
+  statePtr->cunit.opcode = opcode;
+  statePtr->cunit.format = format = e->format;
+  switch(format){
+    case RTYPE:
+      out->rdataA = __readReg(statePtr, ir->r.regA);
+      out->rdataB = __readReg(statePtr, ir->r.regB);
+      out->destReg = ir->r.destReg;
+      break;
+    case ITYPE:
+      out->rdataA = __readReg(statePtr, ir->i.regA);
+      out->rdataB = __readReg(statePtr, ir->i.regB);
+      out->offset = signExtend(ir->i.offset);
+      out->destReg = ir->i.regB;
+      break;
+    case JTYPE:
+      __writeReg(statePtr, ir->j.regB, statePtr->pc);
+      out->rdataA = __readReg(statePtr, ir->j.regA);
+      break;
+    case OTYPE:
+      if(opcode == OP_HALT)
+        return -1;
+      break;
   }
-  raiseError(ER_UNRECOGNIZE, opcode);
+  return 0;
 }
 
 typedef struct {
@@ -265,7 +478,15 @@ typedef struct {
   word_t destReg;
 } executeData;
 
-void execute(stateType *statePtr, decodeData *in, executeData *out)
+// A jalr while profiling: pc is already past it
+static __attribute__((noinline)) void __profJalr(stateType *statePtr, word_t target)
+{
+  long now[PROF_WEIGHTS] = {statePtr->clockBase + *statePtr->clock, 0, 0};
+
+  profJalr(statePtr->prof, statePtr->pc - 1, target, now);
+}
+
+static void execute(stateType *statePtr, decodeData *in, executeData *out)
 {
   out->destReg = in->destReg;
   switch(statePtr->cunit.opcode){
@@ -275,10 +496,17 @@ void execute(stateType *statePtr, decodeData *in, executeData *out)
     case OP_NOR:
       out->data = ~(in->rdataA | in->rdataB);
       break;
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SLL:
+    case OP_SRL:
+      out->data = isaArithResult(statePtr->cunit.opcode, in->rdataA, in->rdataB);
+      break;
     case OP_LW:
       out->address = in->rdataA + in->offset;
       break;
     case OP_SW:
+    case OP_SWAP:
       out->address = in->rdataA + in->offset;
       out->data = in->rdataB;
       break;
@@ -287,6 +515,8 @@ void execute(stateType *statePtr, decodeData *in, executeData *out)
         statePtr->pc += in->offset;
       break;
     case OP_JALR:
+      if(statePtr->prof != NULL)
+        __profJalr(statePtr, in->rdataA);
       statePtr->pc = in->rdataA;
       break;
     default:
@@ -300,15 +530,19 @@ typedef struct {
   word_t destReg;
 } memoryData;
 
-void memory(stateType *statePtr, executeData *in, memoryData *out)
+static __always_inline void memory(stateType *statePtr, executeData *in, memoryData *out, const int mode)
 {
   out->destReg = in->destReg;
   switch(statePtr->cunit.opcode){
     case OP_LW:
-      out->data = __readMem(statePtr, in->address);
+      out->data = __readMem(statePtr, in->address, mode);
       break;
     case OP_SW:
-      __writeMem(statePtr, in->address, in->data);
+      __writeMem(statePtr, in->address, in->data, mode);
+      break;
+    case OP_SWAP:
+      out->data = __readMem(statePtr, in->address, mode);
+      __writeMem(statePtr, in->address, in->data, mode);
       break;
     default:
       out->data = in->data;
@@ -316,7 +550,7 @@ void memory(stateType *statePtr, executeData *in, memoryData *out)
   }
 }
 
-void writeback(stateType *statePtr, memoryData *in)
+static void writeback(stateType *statePtr, memoryData *in)
 {
   switch(statePtr->cunit.opcode){
     case OP_ADD:
@@ -325,7 +559,14 @@ void writeback(stateType *statePtr, memoryData *in)
     case OP_NOR:
       __writeReg(statePtr, in->destReg, in->data);
       break;
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SLL:
+    case OP_SRL:
+      __writeReg(statePtr, in->destReg, in->data);
+      break;
     case OP_LW:
+    case OP_SWAP:
       __writeReg(statePtr, in->destReg, in->data);
       break;
     default:
@@ -333,37 +574,1524 @@ void writeback(stateType *statePtr, memoryData *in)
   }
 }
 
-int run(stateType *statePtr)
+static __always_inline int __step(stateType *statePtr, const int mode)
+{
+  fetchData fd;
+  decodeData dd;
+  executeData ed;
+  memoryData md;
+
+  fetch(statePtr, &fd, mode);
+  /* a core defers swaps to the barrier, where they run one at a time */
+  if(mode == COREMEM && ((fd.inst.o.unused << 3) | fd.inst.o.opcode) == OP_SWAP) {
+    statePtr->pc--;
+    return 1;
+  }
+  if(decode(statePtr, &fd, &dd) < 0)
+    return -1;
+  execute(statePtr, &dd, &ed);
+  memory(statePtr, &ed, &md, mode);
+  writeback(statePtr, &md);
+  return 0;
+}
+
+static int step(stateType *statePtr)
+{
+  return __step(statePtr, CHECKEDMEM);
+}
+
+// Loop skipping
+//   A taken backward beq closes a loop from its target to itself. If the
+//   loop has only add, nor, lw, noop and beq, one pass through it is
+//   evaluated symbolically from the registers as they are now. Every
+//   register it writes must come out either as its own value plus a
+//   constant or as the same value on every pass, and every other beq must
+//   compare such a register with a constant and leave the loop. Then
+//   pass k sees each register at start + k * step, the first pass that
+//   takes an exit follows from a congruence mod 2^32, and all the passes
+//   before it are applied at once. Anything else is left to stepping, and
+//   a loop that could not be skipped is left alone for a while.
+#define LOOPMAXBODY 64   /* instructions */
+#define LOOPMINSKIP 2    /* passes worth skipping */
+#define LOOPMAXWAIT 1024
+#define LOOPNEVER   (1ull << 32)
+
+/* what a pass does to a register */
+#define LOOPFIXED   0    /* keeps it */
+#define LOOPSTEP    1    /* adds a constant to it */
+#define LOOPSET     2    /* writes it before reading it, the same every pass */
+
+typedef struct {
+  int ind;       /* reg's value at the start of the pass plus v, else just v */
+  int reg;       /* -1 when the value is not known */
+  word_t v;
+} loopValue;
+
+#define LOOPUNKNOWN ((loopValue){1, -1, 0})
+
+typedef struct {
+  int reg;       /* the pass leaves when reg is `at` there, */
+  word_t at;
+  int load;      /* or loads from reg + at, which must be in memory */
+} loopLimit;
+
+static word_t __loopRead(stateType *statePtr, word_t addr)
+{
+  return statePtr->flat ? (word_t)statePtr->flat[addr] : pageMemRead(&statePtr->mem, addr);
+}
+
+/* one pass over the loop at head, the registers that are not LOOPSTEP
+   taken as constants. 0 when the loop is not one that can be skipped,
+   -1 when a branch or an address depends on a value that is not known */
+static int __loopPass(stateType *statePtr, int head, int len, const int *kind,
+                      loopValue *val, loopLimit *limits, int *numLimits)
+{
+  loopValue a, b, t;
+  word_t w, addr;
+  int i, r, pc, target, known = 1;
+
+  for(r = 0; r < NUMREGS; r++)
+    val[r] = kind[r] != LOOPSTEP ? (loopValue){0, 0, statePtr->reg[r]} : (loopValue){1, r, 0};
+  *numLimits = 0;
+  for(i = 0; i < len; i++) {
+    pc = head + i;
+    w = __loopRead(statePtr, pc);
+    a = val[isaRegA(w)];
+    b = val[isaRegB(w)];
+    switch(isaOpcode(w, statePtr->isaExt)) {
+      case OP_ADD:
+        if(isaDest(w) == 0)
+          return 0;
+        if(a.reg < 0 || b.reg < 0 || (a.ind && b.ind))
+          val[isaDest(w)] = LOOPUNKNOWN;
+        else
+          val[isaDest(w)] = (loopValue){a.ind | b.ind, a.ind ? a.reg : b.reg, a.v + b.v};
+        break;
+      case OP_NOR:
+        if(isaDest(w) == 0)
+          return 0;
+        val[isaDest(w)] = a.ind || b.ind ? LOOPUNKNOWN : (loopValue){0, 0, ~(a.v | b.v)};
+        break;
+      case OP_LW:
+        addr = a.v + isaOffset(w);
+        if(isaRegB(w) == 0 || (!a.ind && addr >= (word_t)statePtr->numMemory))
+          return 0;
+        if(a.reg < 0)
+          known = 0;
+        else if(a.ind)
+          limits[(*numLimits)++] = (loopLimit){a.reg, addr, 1};
+        val[isaRegB(w)] = a.ind ? LOOPUNKNOWN : (loopValue){0, 0, __loopRead(statePtr, addr)};
+        break;
+      case OP_NOOP:
+        break;
+      case OP_BEQ:
+        target = pc + 1 + isaOffset(w);
+        if(a.reg < 0 || b.reg < 0) {
+          known = 0;
+        } else if(i == len - 1) {
+          /* the back edge, taken on every pass */
+          if(a.ind != b.ind || a.reg != b.reg || a.v != b.v)
+            known = 0;
+        } else if(target == pc + 1 || (a.ind == b.ind && a.reg == b.reg && a.v != b.v)) {
+          break;  /* never changes the way */
+        } else if(target >= head && target < head + len) {
+          return 0;
+        } else if(a.ind == b.ind) {
+          known = 0;
+        } else {
+          if(!a.ind) {
+            t = a;
+            a = b;
+            b = t;
+          }
+          limits[(*numLimits)++] = (loopLimit){a.reg, b.v - a.v, 0};
+        }
+        break;
+      default:
+        return 0;
+    }
+  }
+  return known ? 1 : -1;
+}
+
+/* the first k with x + k * s == at mod 2^32, LOOPNEVER if there is none */
+static unsigned long long __loopSolve(word_t x, word_t s, word_t at)
+{
+  word_t d = at - x, inv;
+  int z, i;
+
+  if(s == 0)
+    return d == 0 ? 0 : LOOPNEVER;
+  z = __builtin_ctz(s);
+  if(d & ((1u << z) - 1))
+    return LOOPNEVER;
+  s >>= z;
+  d >>= z;
+  /* Newton's iteration for the inverse of an odd number, 3 -> 48 bits */
+  for(inv = s, i = 0; i < 4; i++)
+    inv *= 2 - s * inv;
+  return (d * inv) & (word_t)(0xffffffffu >> z);
+}
+
+/* the first k with x + k * s out of [0, n) */
+static unsigned long long __loopInRange(word_t x, word_t s, word_t n)
+{
+  if(x >= n)
+    return 0;
+  if(s == 0)
+    return LOOPNEVER;
+  if((int)s > 0)
+    return (n - 1 - x) / s + 1;
+  return x / -s + 1;
+}
+
+static long __loopFailed(loopSeen *seen, int tail)
+{
+  if(seen->tail != tail) {
+    seen->tail = tail;
+    seen->backoff = 1;
+  }
+  seen->wait = seen->backoff;
+  if(seen->backoff < LOOPMAXWAIT)
+    seen->backoff *= 2;
+  return 0;
+}
+
+/* called with pc at the head of the loop closed by the beq at tail: skips
+   whole passes of it, at most budget instructions, and returns how many */
+static long __loopSkip(simHandle *sim, int tail, long budget)
+{
+  stateType *statePtr = &sim->state;
+  loopSeen *seen = &sim->loops[tail % LOOPCACHE];
+  loopValue val[NUMREGS];
+  loopLimit limits[LOOPMAXBODY];
+  unsigned long long k, passes;
+  int kind[NUMREGS], read[NUMREGS], head = statePtr->pc, len = tail - head + 1;
+  int numLimits, known, changed, i, r;
+  word_t w;
+
+  if(seen->tail == tail && seen->wait > 0) {
+    seen->wait--;
+    return 0;
+  }
+  if(head < 0 || len > LOOPMAXBODY || budget / len < LOOPMINSKIP)
+    return 0;
+
+  /* registers the loop never writes are fixed, the ones it reads before
+     writing step until they turn out to be fixed after all */
+  memset(read, 0, sizeof(read));
+  for(r = 0; r < NUMREGS; r++)
+    kind[r] = LOOPFIXED;
+  for(i = 0; i < len; i++) {
+    w = __loopRead(statePtr, head + i);
+    switch(isaOpcode(w, statePtr->isaExt)) {
+      case OP_ADD:
+      case OP_NOR:
+        read[isaRegA(w)] |= kind[isaRegA(w)] == LOOPFIXED;
+        read[isaRegB(w)] |= kind[isaRegB(w)] == LOOPFIXED;
+        kind[isaDest(w)] = read[isaDest(w)] ? LOOPSTEP : LOOPSET;
+        break;
+      case OP_LW:
+        read[isaRegA(w)] |= kind[isaRegA(w)] == LOOPFIXED;
+        kind[isaRegB(w)] = read[isaRegB(w)] ? LOOPSTEP : LOOPSET;
+        break;
+      case OP_BEQ:
+        read[isaRegA(w)] |= kind[isaRegA(w)] == LOOPFIXED;
+        read[isaRegB(w)] |= kind[isaRegB(w)] == LOOPFIXED;
+        break;
+    }
+  }
+  kind[0] = LOOPFIXED;
+
+  do {
+    known = __loopPass(statePtr, head, len, kind, val, limits, &numLimits);
+    if(known == 0)
+      return __loopFailed(seen, tail);
+    changed = 0;
+    for(r = 1; r < NUMREGS; r++) {
+      if(kind[r] == LOOPSTEP && !val[r].ind) {
+        if(val[r].v != (word_t)statePtr->reg[r])
+          return __loopFailed(seen, tail);
+        kind[r] = LOOPFIXED;
+        changed = 1;
+      }
+    }
+  } while(changed);
+  if(known < 0)
+    return __loopFailed(seen, tail);
+  for(r = 1; r < NUMREGS; r++) {
+    if(kind[r] == LOOPSTEP ? val[r].reg != r
+       : val[r].ind || (kind[r] == LOOPFIXED && val[r].v != (word_t)statePtr->reg[r]))
+      return __loopFailed(seen, tail);
+  }
+
+  /* every pass before the first that leaves or loads out of bound */
+  passes = budget / len;
+  for(i = 0; i < numLimits; i++) {
+    r = limits[i].reg;
+    if(limits[i].load)
+      k = __loopInRange(statePtr->reg[r] + limits[i].at, val[r].v, statePtr->numMemory);
+    else
+      k = __loopSolve(statePtr->reg[r], val[r].v, limits[i].at);
+    passes = k < passes ? k : passes;
+  }
+  seen->tail = tail;
+  seen->wait = 0;
+  seen->backoff = 1;
+  if(passes < LOOPMINSKIP)
+    return 0;
+  for(r = 1; r < NUMREGS; r++) {
+    if(kind[r] == LOOPSTEP)
+      statePtr->reg[r] = (int)((word_t)statePtr->reg[r] + (word_t)passes * val[r].v);
+    else if(kind[r] == LOOPSET)
+      statePtr->reg[r] = val[r].v;
+  }
+  return (long)passes * len;
+}
+
+// Library interface
+//   Every call that runs the machine first points simActive at its handle
+//   and sets the handle's trap, so an error raised anywhere below comes
+//   back here as SIM_ERROR instead of exiting.
+static __attribute__((noreturn)) void __simFail(int code, int data)
+{
+  simHandle *sim = simActive;
+
+  simActive = NULL;
+  sim->failed = 1;
+  sim->error = code;
+  sim->errorData = data;
+  longjmp(sim->trap, 1);
+}
+
+static int __simReject(simHandle *sim, int code, int data)
+{
+  sim->error = code;
+  sim->errorData = data;
+  return SIM_ERROR;
+}
+
+simHandle *simOpen(int memBits, int flags)
+{
+  simHandle *sim;
+
+  if(memBits < PM_MINBITS || memBits > PM_MAXBITS)
+    return NULL;
+  sim = (simHandle *)calloc(1, sizeof(simHandle));
+  if(sim == NULL)
+    return NULL;
+  if(pageMemInit(&sim->state.mem, memBits) < 0) {
+    free(sim);
+    return NULL;
+  }
+  sim->flags = flags;
+  sim->state.isaExt = flags & SIM_ISAEXT ? ISA_EXTARITH : 0;
+  return sim;
+}
+
+void simClose(simHandle *sim)
+{
+  if(sim == NULL)
+    return;
+  simDevices(sim, -1);
+  simProfileClose(sim);
+  pageMemFree(&sim->state.mem);
+  free(sim);
+}
+
+/* pages of the previous program are cleared rather than freed, so
+   loading short programs one after another does not allocate */
+static void __simReset(simHandle *sim)
+{
+  stateType *statePtr = &sim->state;
+  pageMem mem = statePtr->mem;
+  devices *dev = statePtr->dev;
+  callProf *prof = statePtr->prof;
+
+  pageMemClear(&mem);
+  memset(statePtr, 0, sizeof(*statePtr));
+  statePtr->mem = mem;
+  statePtr->dev = dev;
+  if(dev != NULL)
+    devReset(dev);
+  statePtr->prof = prof;
+  if(prof != NULL)
+    profRestart(prof);
+  statePtr->isaExt = sim->flags & SIM_ISAEXT ? ISA_EXTARITH : 0;
+  sim->halted = 0;
+  sim->failed = 0;
+  sim->executed = 0;
+  memset(sim->loops, 0, sizeof(sim->loops));
+}
+
+static int __simLoadWord(simHandle *sim, int data)
+{
+  stateType *statePtr = &sim->state;
+
+  if(statePtr->numMemory >= statePtr->mem.limit) {
+    sim->failed = 1;
+    return __simReject(sim, ER_OUTOFBOUNDMEM, statePtr->numMemory);
+  }
+  if(pageMemWrite(&statePtr->mem, statePtr->numMemory, data) < 0) {
+    sim->failed = 1;
+    return __simReject(sim, ER_OUTOFMEMORY, statePtr->numMemory);
+  }
+  statePtr->numMemory++;
+  return SIM_OK;
+}
+
+int simLoad(simHandle *sim, const int *words, int numWords)
+{
+  int i;
+
+  __simReset(sim);
+  for(i = 0; i < numWords; i++)
+    if(__simLoadWord(sim, words[i]) != SIM_OK)
+      return SIM_ERROR;
+  return SIM_OK;
+}
+
+/* one line of a machine-code file: a decimal word, read like sscanf's %d */
+static int __simParseWord(const char *p, const char *end, int *data)
+{
+  const char *digits;
+  unsigned int v = 0;
+  int neg = 0;
+
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f'))
+    p++;
+  if(p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+  for(digits = p; p < end && *p >= '0' && *p <= '9'; p++)
+    v = v * 10 + (*p - '0');
+  if(p == digits)
+    return -1;
+  *data = (int)(neg ? -v : v);
+  return 0;
+}
+
+int simLoadText(simHandle *sim, const char *text, size_t len)
+{
+  const char *p = text, *end = text + len, *eol;
+  int data;
+
+  __simReset(sim);
+  while(p < end) {
+    eol = (const char *)memchr(p, '\n', end - p);
+    if(eol == NULL)
+      eol = end;
+    if(__simParseWord(p, eol, &data) < 0) {
+      sim->failed = 1;
+      return __simReject(sim, ER_WRONGADDRESS, sim->state.numMemory);
+    }
+    if(__simLoadWord(sim, data) != SIM_OK)
+      return SIM_ERROR;
+    p = eol < end ? eol + 1 : end;
+  }
+  return SIM_OK;
+}
+
+int simStep(simHandle *sim, long n)
+{
+  long i, skipped;
+  int pc;
+
+  if(sim->failed)
+    return SIM_ERROR;
+  if(sim->halted)
+    return SIM_HALTED;
+  if(setjmp(sim->trap))
+    return SIM_ERROR;
+  simActive = sim;
+  sim->state.clock = &sim->executed;
+  sim->state.clockBase = 0;
+  for(i = 0; i < n; i++) {
+    sim->executed++;
+    if(sim->flags & SIM_TRACE)
+      printState(&sim->state);
+    pc = sim->state.pc;
+    if(step(&sim->state) < 0) {
+      sim->halted = 1;
+      break;
+    }
+    /* a trace shows every instruction, so only untraced runs skip */
+    if(sim->state.pc <= pc && !(sim->flags & (SIM_TRACE | SIM_STEPALL))) {
+      skipped = __loopSkip(sim, pc, n - i - 1);
+      i += skipped;
+      sim->executed += skipped;
+    }
+  }
+  simActive = NULL;
+  return sim->halted ? SIM_HALTED : SIM_OK;
+}
+
+// Fast mode: no bounds compares, memory is a flat guarded copy of the
+// image that is written back at halt
+static __always_inline void __simRunFlat(simHandle *sim, volatile long *n, const int mode)
+{
+  stateType *statePtr = &sim->state;
+  int pc, r, skip = !(sim->flags & SIM_STEPALL);
+
+  do {
+    (*n)++;
+    pc = statePtr->pc;
+    r = __step(statePtr, mode);
+    if(statePtr->pc <= pc && skip && r == 0)
+      *n += __loopSkip(sim, pc, LONG_MAX - sim->executed - *n);
+  } while(r == 0);
+}
+
+/* the first device access of a fast run faults like an out-of-bound one:
+   back out of that instruction and go on in DEVMEM. 0 for a real fault */
+static int __simDevFault(stateType *statePtr, const guardTrap *trap,
+                         volatile int *devs, volatile long *n)
+{
+  if(*devs || statePtr->dev == NULL || !devAddr(trap->addr)
+     || (word_t)trap->addr == (word_t)statePtr->pc)
+    return 0;
+  statePtr->pc--;
+  (*n)--;
+  *devs = 1;
+  return 1;
+}
+
+static int __simRunFast(simHandle *sim)
+{
+  stateType *statePtr = &sim->state;
+  guardMem flat;
+  guardTrap trap;
+  volatile long n = 0;
+  volatile int devs = 0, faulted = 0;
+
+  if(guardMemMap(&flat, statePtr->numMemory, 0) < 0)
+    return simStep(sim, LONG_MAX);
+  pageMemCopyOut(&statePtr->mem, flat.base, statePtr->numMemory);
+  statePtr->flat = flat.base;
+  statePtr->clock = &n;
+  statePtr->clockBase = sim->executed;
+
+  if(setjmp(sim->trap) == 0) {
+    simActive = sim;
+    guardMemArm(&trap);
+    if(sigsetjmp(trap.env, 1) != 0)
+      faulted = !__simDevFault(statePtr, &trap, &devs, &n);
+    if(faulted) {
+      simActive = NULL;
+      sim->failed = 1;
+      __simReject(sim, ER_OUTOFBOUNDMEM, (word_t)trap.addr);
+    } else {
+      /* programs that never touch a device keep the compare-free loop */
+      if(devs)
+        __simRunFlat(sim, &n, DEVMEM);
+      else
+        __simRunFlat(sim, &n, FASTMEM);
+      simActive = NULL;
+      sim->halted = 1;
+    }
+  }
+  guardMemDisarm();
+
+  sim->executed += n;
+  if(pageMemCopyIn(&statePtr->mem, flat.base, statePtr->numMemory) < 0 && !sim->failed) {
+    sim->failed = 1;
+    __simReject(sim, ER_OUTOFMEMORY, -1);
+  }
+  statePtr->flat = NULL;
+  guardMemUnmap(&flat);
+  return sim->failed ? SIM_ERROR : SIM_HALTED;
+}
+
+int simRun(simHandle *sim)
+{
+  if((sim->flags & (SIM_FAST | SIM_TRACE)) != SIM_FAST || sim->failed || sim->halted)
+    return simStep(sim, LONG_MAX);
+  return __simRunFast(sim);
+}
+
+int simDevices(simHandle *sim, int consoleFd)
+{
+  if(sim->state.dev != NULL) {
+    devClose(sim->state.dev);
+    sim->state.dev = NULL;
+  }
+  if(consoleFd < 0)
+    return SIM_OK;
+  if(devOpen(&sim->dev, consoleFd) < 0)
+    return __simReject(sim, ER_OPENFILE, consoleFd);
+  sim->state.dev = &sim->dev;
+  return SIM_OK;
+}
+
+int simProfileOpen(simHandle *sim, const char *labels, size_t len)
+{
+  simProfileClose(sim);
+  if(profOpen(&sim->prof, labels, len) < 0)
+    return __simReject(sim, ER_OPENFILE, 0);
+  /* counts start from what already ran of the program */
+  sim->prof.mark[PROF_INSTS] = sim->executed;
+  sim->state.prof = &sim->prof;
+  return SIM_OK;
+}
+
+int simProfileWrite(simHandle *sim, FILE *out)
+{
+  long now[PROF_WEIGHTS] = {sim->executed, 0, 0};
+
+  if(sim->state.prof == NULL)
+    return __simReject(sim, ER_OPENFILE, 0);
+  profCharge(&sim->prof, now);
+  if(profWrite(&sim->prof, out, PROF_INSTS) < 0 || ferror(out))
+    return __simReject(sim, ER_OPENFILE, fileno(out));
+  return SIM_OK;
+}
+
+void simProfileClose(simHandle *sim)
+{
+  if(sim->state.prof == NULL)
+    return;
+  profClose(sim->state.prof);
+  sim->state.prof = NULL;
+}
+
+long simExecuted(const simHandle *sim)
+{
+  return sim->executed;
+}
+
+int simGetPc(const simHandle *sim)
+{
+  return sim->state.pc;
+}
+
+void simSetPc(simHandle *sim, int pc)
+{
+  sim->state.pc = pc;
+}
+
+int simGetReg(const simHandle *sim, int reg)
+{
+  return reg >= 0 && reg < NUMREGS ? sim->state.reg[reg] : 0;
+}
+
+int simSetReg(simHandle *sim, int reg, int data)
+{
+  if(reg < 0 || reg >= NUMREGS)
+    return __simReject(sim, ER_OUTOFBOUNDREG, reg);
+  if(reg == 0)
+    return __simReject(sim, ER_WRITEREG0, sim->state.pc);
+  sim->state.reg[reg] = data;
+  return SIM_OK;
+}
+
+int simNumMemory(const simHandle *sim)
+{
+  return sim->state.numMemory;
+}
+
+int simReadMem(simHandle *sim, int addr, int *data)
+{
+  if((word_t)addr >= sim->state.numMemory)
+    return __simReject(sim, ER_OUTOFBOUNDMEM, addr);
+  *data = pageMemRead(&sim->state.mem, addr);
+  return SIM_OK;
+}
+
+int simWriteMem(simHandle *sim, int addr, int data)
+{
+  if((word_t)addr >= sim->state.numMemory)
+    return __simReject(sim, ER_OUTOFBOUNDMEM, addr);
+  if(pageMemWrite(&sim->state.mem, addr, data) < 0)
+    return __simReject(sim, ER_OUTOFMEMORY, addr);
+  return SIM_OK;
+}
+
+int simError(const simHandle *sim, int *data)
+{
+  if(data != NULL)
+    *data = sim->errorData;
+  return sim->error;
+}
+
+const char *simErrorMsg(int code)
+{
+  if(code < 0 || code >= (int)(sizeof(errorMsg) / sizeof(errorMsg[0])) || errorMsg[code] == NULL)
+    return "unknown error";
+  return errorMsg[code];
+}
+
+// Batch mode
+//   One image runs as many instances that differ only in what is written
+//   into them before the run. Instances go in groups of `lanes` with their
+//   memory and registers interleaved by lane, word a of lane l at
+//   mem[a * lanes + l], so one instruction is a loop over the lanes of a
+//   group that the compiler turns into AVX-512 or AVX2 code; which one is
+//   picked at open. The lanes at the lowest pc of a group run together and
+//   the rest wait for them, so lanes that went different ways at a branch
+//   meet again where the paths join. An instruction word that differs
+//   between the lanes, and whatever the lane loops leave out (jalr, writes
+//   to reg 0, out-of-bound accesses, extension opcodes), runs through the
+//   scalar engine one lane at a time.
+#define BATCH_MAXLANES 16
+#define BATCH_RUNNING  0
+#define BATCH_HALTED   1
+#define BATCH_FAILED   2
+
+struct simBatchStruct {
+  int lanes;
+  int numInstances;
+  int numGroups;
+  int numMemory;
+  int isaExt;
+  int *mem;         /* numGroups blocks of numMemory * lanes words */
+  int *reg;         /* numGroups blocks of NUMREGS * lanes */
+  int *pc;          /* per lane, the padding lanes of the last group too */
+  int *status;      /* BATCH_* */
+  long *executed;
+  int *error;       /* ER_* and its data, for failed lanes */
+  int *errorData;
+  void (*runGroup)(simBatch *, int, long);
+  simHandle scalar; /* steps one lane at a time */
+};
+
+/* one instruction of lane l of group g through the scalar engine, the
+   group's arrays are passed in as the lane loops see them */
+static void __batchScalar(simBatch *b, int g, int l, int *mem, int *reg, int *pc,
+                          int *status, int *left)
+{
+  simHandle *sim = &b->scalar;
+  stateType *statePtr = &sim->state;
+  int lanes = b->lanes, r;
+
+  statePtr->pc = pc[l];
+  for(r = 0; r < NUMREGS; r++)
+    statePtr->reg[r] = reg[r * lanes + l];
+  statePtr->flat = mem + l;
+  left[l]--;
+  if(setjmp(sim->trap) == 0) {
+    simActive = sim;
+    if(__step(statePtr, LANEMEM) < 0)
+      status[l] = BATCH_HALTED;
+    simActive = NULL;
+  } else {
+    status[l] = BATCH_FAILED;
+    b->error[g * lanes + l] = sim->error;
+    b->errorData[g * lanes + l] = sim->errorData;
+  }
+  pc[l] = statePtr->pc;
+  for(r = 0; r < NUMREGS; r++)
+    reg[r * lanes + l] = statePtr->reg[r];
+}
+
+// `lanes` is a constant in every instantiation, so the lane loops below
+// have a fixed trip count and vectorize to masked vector instructions
+static __always_inline void __batchGroup(simBatch *b, int g, long maxSteps, const int lanes)
+{
+  int start[BATCH_MAXLANES], left[BATCH_MAXLANES]; /* instructions this call may still run */
+  int *__restrict mem = b->mem + (size_t)g * b->numMemory * lanes;
+  int *__restrict reg = b->reg + g * NUMREGS * lanes;
+  int *__restrict pc = b->pc + g * lanes;
+  int *__restrict status = b->status + g * lanes;
+  long *executed = b->executed + g * lanes;
+  word_t numMemory = b->numMemory;
+  int act[BATCH_MAXLANES], at[BATCH_MAXLANES], val[BATCH_MAXLANES], *ra, *rb, *rd;
+  int l, minPc, instr, opcode, offset, bad;
+
+  for(l = 0; l < lanes; l++)
+    left[l] = start[l] = maxSteps - executed[l] < INT_MAX ? maxSteps - executed[l] : INT_MAX;
+  while(1) {
+    /* lanes that are done wait at INT_MAX */
+    minPc = INT_MAX;
+    for(l = 0; l < lanes; l++)
+      at[l] = status[l] == BATCH_RUNNING && left[l] > 0 ? pc[l] : INT_MAX;
+    for(l = 0; l < lanes; l++)
+      minPc = at[l] < minPc ? at[l] : minPc;
+    if(minPc == INT_MAX)
+      break;
+    for(l = 0; l < lanes; l++)
+      act[l] = at[l] == minPc;
+    if((word_t)minPc >= numMemory)
+      goto scalar;
+
+    /* one decode for the group, if every lane has the same word there */
+    for(l = 0; !act[l]; l++)
+      ;
+    instr = mem[(size_t)minPc * lanes + l];
+    bad = 0;
+    for(l = 0; l < lanes; l++)
+      bad |= act[l] & (mem[(size_t)minPc * lanes + l] != instr);
+    if(bad)
+      goto scalar;
+    opcode = isaOpcode(instr, b->isaExt);
+    ra = reg + isaRegA(instr) * lanes;
+    rb = reg + isaRegB(instr) * lanes;
+    rd = reg + isaDest(instr) * lanes;
+    offset = isaOffset(instr);
+
+    /* results go through val[] so no lane loop reads a row it writes */
+    switch(opcode) {
+      case OP_ADD:
+      case OP_NOR:
+        if(rd == reg)
+          goto scalar;
+        for(l = 0; l < lanes; l++)
+          val[l] = opcode == OP_ADD ? (int)((word_t)ra[l] + rb[l]) : ~(ra[l] | rb[l]);
+        for(l = 0; l < lanes; l++)
+          if(act[l])
+            rd[l] = val[l];
+        break;
+      case OP_LW:
+      case OP_SW:
+        if(opcode == OP_LW && rb == reg)
+          goto scalar;
+        bad = 0;
+        for(l = 0; l < lanes; l++) {
+          val[l] = (int)((word_t)ra[l] + offset);
+          bad |= act[l] & ((word_t)val[l] >= numMemory);
+        }
+        if(bad)
+          goto scalar;
+        if(opcode == OP_LW) {
+          for(l = 0; l < lanes; l++)
+            val[l] = mem[(size_t)(act[l] ? val[l] : 0) * lanes + l];
+          for(l = 0; l < lanes; l++)
+            if(act[l])
+              rb[l] = val[l];
+        } else {
+          for(l = 0; l < lanes; l++)
+            if(act[l])
+              mem[(size_t)val[l] * lanes + l] = rb[l];
+        }
+        break;
+      case OP_BEQ:
+        for(l = 0; l < lanes; l++)
+          pc[l] += act[l] && ra[l] == rb[l] ? offset : 0;
+        break;
+      case OP_HALT:
+        for(l = 0; l < lanes; l++)
+          if(act[l])
+            status[l] = BATCH_HALTED;
+        break;
+      case OP_NOOP:
+        break;
+      default:
+        goto scalar;
+    }
+    for(l = 0; l < lanes; l++) {
+      pc[l] += act[l];
+      left[l] -= act[l];
+    }
+    continue;
+
+scalar:
+    for(l = 0; l < lanes; l++)
+      if(act[l])
+        __batchScalar(b, g, l, mem, reg, pc, status, left);
+  }
+  for(l = 0; l < lanes; l++)
+    executed[l] += start[l] - left[l];
+}
+
+static __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq")))
+void __batchGroupAvx512(simBatch *b, int g, long maxSteps)
+{
+  __batchGroup(b, g, maxSteps, 16);
+}
+
+static __attribute__((target("avx2")))
+void __batchGroupAvx2(simBatch *b, int g, long maxSteps)
+{
+  __batchGroup(b, g, maxSteps, 8);
+}
+
+static void __batchGroupGeneric(simBatch *b, int g, long maxSteps)
+{
+  __batchGroup(b, g, maxSteps, 8);
+}
+
+simBatch *simBatchOpen(const int *words, int numWords, int numInstances, int flags)
+{
+  simBatch *b;
+  size_t bytes;
+  int g, a, l;
+
+  if(numWords < 0 || numInstances < 1)
+    return NULL;
+  b = (simBatch *)calloc(1, sizeof(simBatch));
+  if(b == NULL)
+    return NULL;
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+     && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) {
+    b->lanes = 16;
+    b->runGroup = __batchGroupAvx512;
+  } else {
+    b->lanes = 8;
+    b->runGroup = __builtin_cpu_supports("avx2") ? __batchGroupAvx2 : __batchGroupGeneric;
+  }
+  b->numInstances = numInstances;
+  b->numGroups = (numInstances + b->lanes - 1) / b->lanes;
+  b->numMemory = numWords;
+  b->isaExt = flags & SIM_ISAEXT ? ISA_EXTARITH : 0;
+
+  /* 64-byte aligned rows, aligned_alloc wants a multiple of that */
+  bytes = ((size_t)b->numGroups * numWords * b->lanes * sizeof(int) + 63) / 64 * 64;
+  b->mem = (int *)aligned_alloc(64, bytes ? bytes : 64);
+  b->reg = (int *)aligned_alloc(64, (size_t)b->numGroups * NUMREGS * b->lanes * sizeof(int));
+  b->pc = (int *)calloc((size_t)b->numGroups * b->lanes, sizeof(int));
+  b->status = (int *)calloc((size_t)b->numGroups * b->lanes, sizeof(int));
+  b->executed = (long *)calloc((size_t)b->numGroups * b->lanes, sizeof(long));
+  b->error = (int *)calloc((size_t)b->numGroups * b->lanes, sizeof(int));
+  b->errorData = (int *)calloc((size_t)b->numGroups * b->lanes, sizeof(int));
+  if(b->mem == NULL || b->reg == NULL || b->pc == NULL || b->status == NULL
+     || b->executed == NULL || b->error == NULL || b->errorData == NULL) {
+    simBatchClose(b);
+    return NULL;
+  }
+  for(g = 0; g < b->numGroups; g++)
+    for(a = 0; a < numWords; a++)
+      for(l = 0; l < b->lanes; l++)
+        b->mem[((size_t)g * numWords + a) * b->lanes + l] = words[a];
+  memset(b->reg, 0, (size_t)b->numGroups * NUMREGS * b->lanes * sizeof(int));
+  /* the padding lanes of the last group never run */
+  for(l = numInstances; l < b->numGroups * b->lanes; l++)
+    b->status[l] = BATCH_HALTED;
+
+  b->scalar.state.numMemory = numWords;
+  b->scalar.state.isaExt = b->isaExt;
+  b->scalar.state.stride = b->lanes;
+  return b;
+}
+
+void simBatchClose(simBatch *b)
+{
+  if(b == NULL)
+    return;
+  free(b->mem);
+  free(b->reg);
+  free(b->pc);
+  free(b->status);
+  free(b->executed);
+  free(b->error);
+  free(b->errorData);
+  free(b);
+}
+
+int simBatchLanes(const simBatch *b)
+{
+  return b->lanes;
+}
+
+int simBatchRun(simBatch *b, long maxSteps)
+{
+  int g, l, i, more, running = 0;
+
+  /* a group call runs each lane for at most INT_MAX instructions */
+  for(g = 0; g < b->numGroups; g++) {
+    do {
+      b->runGroup(b, g, maxSteps);
+      for(l = 0, more = 0, i = g * b->lanes; l < b->lanes; l++, i++)
+        more |= b->status[i] == BATCH_RUNNING && b->executed[i] < maxSteps;
+    } while(more);
+  }
+  for(i = 0; i < b->numInstances; i++)
+    running += b->status[i] == BATCH_RUNNING;
+  return running;
+}
+
+/* index of instance i's word at addr, -1 when either is out of range */
+static long __batchWord(const simBatch *b, int i, int addr)
+{
+  if(i < 0 || i >= b->numInstances || addr < 0 || addr >= b->numMemory)
+    return -1;
+  return ((long)(i / b->lanes) * b->numMemory + addr) * b->lanes + i % b->lanes;
+}
+
+int simBatchReadMem(const simBatch *b, int i, int addr, int *data)
+{
+  long w = __batchWord(b, i, addr);
+
+  if(w < 0)
+    return SIM_ERROR;
+  *data = b->mem[w];
+  return SIM_OK;
+}
+
+int simBatchWriteMem(simBatch *b, int i, int addr, int data)
+{
+  long w = __batchWord(b, i, addr);
+
+  if(w < 0)
+    return SIM_ERROR;
+  b->mem[w] = data;
+  return SIM_OK;
+}
+
+int simBatchGetReg(const simBatch *b, int i, int reg)
+{
+  if(i < 0 || i >= b->numInstances || reg < 0 || reg >= NUMREGS)
+    return 0;
+  return b->reg[((i / b->lanes) * NUMREGS + reg) * b->lanes + i % b->lanes];
+}
+
+int simBatchSetReg(simBatch *b, int i, int reg, int data)
+{
+  if(i < 0 || i >= b->numInstances || reg <= 0 || reg >= NUMREGS)
+    return SIM_ERROR;
+  b->reg[((i / b->lanes) * NUMREGS + reg) * b->lanes + i % b->lanes] = data;
+  return SIM_OK;
+}
+
+int simBatchGetPc(const simBatch *b, int i)
+{
+  return i >= 0 && i < b->numInstances ? b->pc[i] : 0;
+}
+
+long simBatchExecuted(const simBatch *b, int i)
+{
+  return i >= 0 && i < b->numInstances ? b->executed[i] : 0;
+}
+
+int simBatchStatus(const simBatch *b, int i, int *error, int *data)
+{
+  if(i < 0 || i >= b->numInstances)
+    return SIM_ERROR;
+  if(b->status[i] != BATCH_FAILED)
+    return b->status[i] == BATCH_HALTED ? SIM_HALTED : SIM_OK;
+  if(error != NULL)
+    *error = b->error[i];
+  if(data != NULL)
+    *data = b->errorData[i];
+  return SIM_ERROR;
+}
+
+// Multi-core mode
+//   Cores share one data memory. Each core runs a quantum against memory
+//   as it was when the quantum started plus its own buffered stores, then
+//   all cores meet at a barrier where the store buffers are committed in
+//   core order and deferred swaps execute one core at a time. The result
+//   depends on the quantum size only, never on host thread scheduling.
+//   Every core starts at the same pc with the same registers, except that
+//   reg[COREREG] holds the core's index so programs can split the work.
+typedef struct storeBufferStruct {
+  word_t *addr;   /* open addressing table on addr */
+  word_t *data;
+  char   *used;
+  int    *order;  /* used slots in first-store order */
+  int    count;
+  int    mask;
+} storeBuffer;
+
+static int __sbSlot(storeBuffer *sb, word_t addr)
+{
+  int h = (addr * 2654435761u) & sb->mask;
+
+  while(sb->used[h] && sb->addr[h] != addr)
+    h = (h + 1) & sb->mask;
+  return h;
+}
+
+static word_t __sbRead(storeBuffer *sb, word_t addr, word_t memData)
+{
+  int h;
+
+  if(sb->count == 0)
+    return memData;
+  h = __sbSlot(sb, addr);
+  return sb->used[h] ? sb->data[h] : memData;
+}
+
+static void __sbWrite(storeBuffer *sb, word_t addr, word_t data)
+{
+  int h = __sbSlot(sb, addr);
+
+  if(!sb->used[h]) {
+    sb->used[h] = 1;
+    sb->addr[h] = addr;
+    sb->order[sb->count++] = h;
+  }
+  sb->data[h] = data;
+}
+
+#ifndef LC2K_LIBRARY
+typedef struct coreStruct {
+  stateType state;
+  storeBuffer sb;
+  pthread_t thread;
+  long instCount;
+  int halted;
+  int swapPending;
+  struct systemStruct *sys;
+} coreType;
+
+typedef struct systemStruct {
+  coreType core[MAXCORES];
+  int numCores;
+  int quantum;
+  int running;
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+} systemType;
+
+static void *__coreMain(void *arg)
 {
-  int instCount = 0;
-  fetchData fd = {0,};
-  decodeData dd = {0,};
-  executeData ed = {0,};
-  memoryData md = {0,};
+  coreType *core = (coreType *)arg;
+  systemType *sys = core->sys;
+  int i, r;
 
   while(1) {
-    instCount++;
-    printState(statePtr);
-    fetch(statePtr, &fd);
-    if(decode(statePtr, &fd, &dd) < 0)
+    pthread_barrier_wait(&sys->start);
+    if(!sys->running)
       break;
-    execute(statePtr, &dd, &ed);
-    memory(statePtr, &ed, &md);
-    writeback(statePtr, &md);
+    for(i = 0; i < sys->quantum && !core->halted && !core->swapPending; i++) {
+      r = __step(&core->state, COREMEM);
+      if(r > 0) {
+        core->swapPending = 1;
+        break;
+      }
+      core->instCount++;
+      core->halted = r < 0;
+    }
+    pthread_barrier_wait(&sys->done);
   }
-  printf("machine halted\n");
+  return NULL;
+}
+
+/* serial part of the barrier, runs while every core thread is parked */
+static int __commitCores(systemType *sys, pageMem *shared)
+{
+  coreType *core;
+  int i, j, live = 0;
+
+  for(i = 0; i < sys->numCores; i++) {
+    core = &sys->core[i];
+    for(j = 0; j < core->sb.count; j++) {
+      if(pageMemWrite(shared, core->sb.addr[core->sb.order[j]],
+                      core->sb.data[core->sb.order[j]]) < 0)
+        raiseError(ER_OUTOFMEMORY, core->sb.addr[core->sb.order[j]]);
+      core->sb.used[core->sb.order[j]] = 0;
+    }
+    core->sb.count = 0;
+  }
+  for(i = 0; i < sys->numCores; i++) {
+    core = &sys->core[i];
+    if(core->swapPending) {
+      __step(&core->state, CHECKEDMEM);
+      core->instCount++;
+      core->swapPending = 0;
+    }
+    live += !core->halted;
+  }
+  return live;
+}
 
+static long runCores(simHandle *sim, int numCores, int quantum)
+{
+  stateType *statePtr = &sim->state;
+  systemType *sys;
+  coreType *core;
+  long instCount = 0;
+  int i, j, size;
+
+  sys = (systemType *)calloc(1, sizeof(systemType));
+  sys->numCores = numCores;
+  sys->quantum = quantum;
+  sys->running = 1;
+  pthread_barrier_init(&sys->start, NULL, numCores + 1);
+  pthread_barrier_init(&sys->done, NULL, numCores + 1);
+  for(size = 2; size < 2 * quantum; size <<= 1)
+    ;
+  for(i = 0; i < numCores; i++) {
+    core = &sys->core[i];
+    core->sys = sys;
+    core->state = *statePtr; /* same image and pc, the page tables are shared */
+    core->state.reg[COREREG] = i;
+    core->state.isaExt |= ISA_EXTSWAP; /* -x still decides the arithmetic */
+    core->state.dev = NULL;
+    core->state.prof = NULL;
+    core->state.sb = &core->sb;
+    core->sb.addr = (word_t *)malloc(size * sizeof(word_t));
+    core->sb.data = (word_t *)malloc(size * sizeof(word_t));
+    core->sb.used = (char *)calloc(size, 1);
+    core->sb.order = (int *)malloc(size * sizeof(int));
+    core->sb.mask = size - 1;
+    pthread_create(&core->thread, NULL, __coreMain, core);
+  }
+
+  do {
+    pthread_barrier_wait(&sys->start);
+    pthread_barrier_wait(&sys->done);
+  } while(__commitCores(sys, &statePtr->mem) > 0);
+  sys->running = 0;
+  pthread_barrier_wait(&sys->start);
+
+  printf("machine halted\n");
+  for(i = 0; i < numCores; i++) {
+    core = &sys->core[i];
+    pthread_join(core->thread, NULL);
+    instCount += core->instCount;
+    printf("core %d: %ld instructions executed, pc %d, registers", i, core->instCount, core->state.pc);
+    for(j = 0; j < NUMREGS; j++)
+      printf(" %d", core->state.reg[j]);
+    printf("\n");
+    free(core->sb.addr);
+    free(core->sb.data);
+    free(core->sb.used);
+    free(core->sb.order);
+  }
+  /* the final state shown is core 0's */
+  statePtr->pc = sys->core[0].state.pc;
+  memcpy(statePtr->reg, sys->core[0].state.reg, sizeof(statePtr->reg));
+  pthread_barrier_destroy(&sys->start);
+  pthread_barrier_destroy(&sys->done);
+  free(sys);
+  sim->executed = instCount;
+  sim->halted = 1;
   return instCount;
 }
 
+// GDB remote serial protocol stub
+//   Registers are exposed as reg[0..7] followed by pc, memory is exposed
+//   byte-addressed (word address * 4), all as 32-bit little-endian words.
+#define GDB_BUFSIZE   4096
+#define GDB_POLLSTEPS 4096 /* instructions between checks for a client ^C */
+
+typedef struct {
+  int fd;
+  int noAck;
+  unsigned char *bkpt; /* one flag per memory word */
+  char buf[GDB_BUFSIZE];
+  int head, tail;
+} gdbStub;
+
+static int __gdbAccept(const char *addr)
+{
+  int lfd, fd, one = 1;
+  char *end;
+  long port = strtol(addr, &end, 10);
+
+  if (*addr != '\0' && *end == '\0') {
+    struct sockaddr_in in = {0,};
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0)
+      raiseErrorMsg(ER_GDBSOCKET, addr);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(lfd, (struct sockaddr *)&in, sizeof(in)) < 0)
+      raiseErrorMsg(ER_GDBSOCKET, addr);
+  } else {
+    struct sockaddr_un un = {0,};
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, addr, sizeof(un.sun_path)-1);
+    unlink(un.sun_path);
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&un, sizeof(un)) < 0)
+      raiseErrorMsg(ER_GDBSOCKET, addr);
+  }
+  if (listen(lfd, 1) < 0)
+    raiseErrorMsg(ER_GDBSOCKET, addr);
+  fprintf(stderr, "gdb: waiting for connection on %s\n", addr);
+  fd = accept(lfd, NULL, NULL);
+  if (fd < 0)
+    raiseErrorMsg(ER_GDBSOCKET, addr);
+  close(lfd);
+  if (*end != '\0' || *addr == '\0')
+    unlink(addr);
+  else
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+static int __gdbGetc(gdbStub *stub)
+{
+  if (stub->head == stub->tail) {
+    stub->head = 0;
+    stub->tail = recv(stub->fd, stub->buf, GDB_BUFSIZE, 0);
+    if (stub->tail <= 0) {
+      stub->tail = 0;
+      return -1;
+    }
+  }
+  return (unsigned char)stub->buf[stub->head++];
+}
+
+static int __gdbHex(int c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* receive one packet body into pkt, returns its length or -1 on disconnect */
+static int __gdbRecvPacket(gdbStub *stub, char *pkt)
+{
+  int c, len, sum, check;
+
+  while (1) {
+    do {
+      if ((c = __gdbGetc(stub)) < 0)
+        return -1;
+    } while (c != '$');
+    for (len = 0, sum = 0; (c = __gdbGetc(stub)) != '#'; len++) {
+      if (c < 0)
+        return -1;
+      if (len < GDB_BUFSIZE - 1)
+        pkt[len] = c;
+      sum += c;
+    }
+    pkt[len < GDB_BUFSIZE - 1 ? len : GDB_BUFSIZE - 1] = '\0';
+    check = __gdbHex(__gdbGetc(stub)) << 4;
+    check |= __gdbHex(__gdbGetc(stub));
+    if (stub->noAck)
+      return len;
+    if (check == (sum & 0xff)) {
+      send(stub->fd, "+", 1, 0);
+      return len;
+    }
+    send(stub->fd, "-", 1, 0);
+  }
+}
+
+static void __gdbSendPacket(gdbStub *stub, const char *data)
+{
+  char out[GDB_BUFSIZE + 4];
+  int i, len, sum = 0;
+
+  for (i = 0; data[i] != '\0'; i++)
+    sum += (unsigned char)data[i];
+  len = snprintf(out, sizeof(out), "$%s#%02x", data, sum & 0xff);
+  do {
+    send(stub->fd, out, len, 0);
+  } while (!stub->noAck && __gdbGetc(stub) == '-');
+}
+
+/* non-blocking check for a ^C sent while the target is running */
+static int __gdbInterrupted(gdbStub *stub)
+{
+  struct pollfd pfd = {stub->fd, POLLIN, 0};
+
+  if (stub->head == stub->tail && poll(&pfd, 1, 0) <= 0)
+    return 0;
+  return __gdbGetc(stub) == 0x03;
+}
+
+static char *__gdbPutWord(char *out, word_t w)
+{
+  int i;
+  for (i = 0; i < 4; i++, w >>= 8)
+    out += sprintf(out, "%02x", w & 0xff);
+  return out;
+}
+
+static word_t __gdbGetWord(const char *in)
+{
+  word_t w = 0;
+  int i;
+  for (i = 3; i >= 0; i--)
+    w = (w << 8) | (__gdbHex(in[2*i]) << 4) | __gdbHex(in[2*i+1]);
+  return w;
+}
+
+/* byte-granular access to the word memory, -1 when out of bound */
+static int __gdbMemByte(stateType *statePtr, word_t addr, int data)
+{
+  word_t word = addr >> 2, shift = (addr & 3) * 8;
+  word_t w;
+
+  if (word >= statePtr->numMemory)
+    return -1;
+  w = pageMemRead(&statePtr->mem, word);
+  if (data >= 0) {
+    w = (w & ~((word_t)0xff << shift)) | ((word_t)data << shift);
+    if (pageMemWrite(&statePtr->mem, word, w) < 0)
+      return -1;
+  }
+  return (w >> shift) & 0xff;
+}
+
+/* s and c: the stop reply. A fault the program raises comes back
+   through the handle's trap like in simStep() and stops it with SIGSEGV
+   at the faulting instruction, so the session stays open for the client
+   to look at what went wrong */
+static const char *__gdbResume(simHandle *sim, gdbStub *stub, int single)
+{
+  stateType *statePtr = &sim->state;
+  volatile int interrupted = 0, pc = statePtr->pc;
+
+  if (sim->failed)
+    return "S0b";
+  if (setjmp(sim->trap)) {
+    statePtr->pc = pc;
+    return "S0b";
+  }
+  simActive = sim;
+  do {
+    sim->executed++;
+    printState(statePtr);
+    pc = statePtr->pc;
+    if (step(statePtr) < 0) {
+      sim->halted = 1;
+      break;
+    }
+    if (sim->executed % GDB_POLLSTEPS == 0)
+      interrupted = __gdbInterrupted(stub);
+  } while (!single && !interrupted
+           && !((word_t)statePtr->pc < statePtr->numMemory && stub->bkpt[statePtr->pc]));
+  simActive = NULL;
+  return sim->halted ? "W00" : interrupted ? "S02" : "S05";
+}
+
+static int runGdb(simHandle *sim, const char *addr)
+{
+  stateType *statePtr = &sim->state;
+  gdbStub stub = {0,};
+  char pkt[GDB_BUFSIZE], reply[GDB_BUFSIZE], *p;
+  unsigned long a, len, i, regno;
+  int c;
+
+  stub.fd = __gdbAccept(addr);
+  stub.bkpt = calloc(statePtr->numMemory, 1);
+
+  while (!sim->halted && __gdbRecvPacket(&stub, pkt) >= 0) {
+    reply[0] = '\0';
+    switch (pkt[0]) {
+      case '?':
+        strcpy(reply, sim->failed ? "S0b" : "S05");
+        break;
+      case 'g':
+        for (p = reply, i = 0; i < NUMREGS; i++)
+          p = __gdbPutWord(p, statePtr->reg[i]);
+        __gdbPutWord(p, statePtr->pc * 4);
+        break;
+      case 'G':
+        for (i = 1; i < NUMREGS && strlen(pkt+1) >= 8*(i+1); i++)
+          statePtr->reg[i] = __gdbGetWord(pkt + 1 + 8*i);
+        if (strlen(pkt+1) >= 8*(NUMREGS+1))
+          statePtr->pc = __gdbGetWord(pkt + 1 + 8*NUMREGS) / 4;
+        strcpy(reply, "OK");
+        break;
+      case 'p':
+        /* unsigned, so "p-2" or "pffffffff" is out of range rather than reg[-2] */
+        regno = strtoul(pkt+1, NULL, 16);
+        if (regno < NUMREGS)
+          __gdbPutWord(reply, statePtr->reg[regno]);
+        else if (regno == NUMREGS)
+          __gdbPutWord(reply, statePtr->pc * 4);
+        else
+          strcpy(reply, "E01");
+        break;
+      case 'P':
+        regno = strtoul(pkt+1, &p, 16);
+        if (*p != '=' || strlen(p+1) < 8 || regno > NUMREGS) {
+          strcpy(reply, "E01");
+          break;
+        }
+        if (regno == NUMREGS)
+          statePtr->pc = __gdbGetWord(p+1) / 4;
+        else if (regno != 0)
+          statePtr->reg[regno] = __gdbGetWord(p+1);
+        strcpy(reply, "OK");
+        break;
+      case 'm':
+        a = strtoul(pkt+1, &p, 16);
+        len = strtoul(p+1, NULL, 16);
+        if (len > GDB_BUFSIZE/2 - 1)
+          len = GDB_BUFSIZE/2 - 1;
+        for (i = 0; i < len; i++) {
+          if ((c = __gdbMemByte(statePtr, a + i, -1)) < 0)
+            break;
+          sprintf(reply + 2*i, "%02x", c);
+        }
+        if (i == 0 && len != 0)
+          strcpy(reply, "E01");
+        break;
+      case 'M':
+        a = strtoul(pkt+1, &p, 16);
+        len = strtoul(p+1, &p, 16);
+        for (i = 0, p++; i < len && p[2*i] && p[2*i+1]; i++) {
+          c = (__gdbHex(p[2*i]) << 4) | __gdbHex(p[2*i+1]);
+          if (__gdbMemByte(statePtr, a + i, c) < 0)
+            break;
+        }
+        strcpy(reply, i == len ? "OK" : "E01");
+        break;
+      case 'Z':
+      case 'z':
+        /* only software breakpoints, tracked per word instead of patched */
+        if (pkt[1] != '0')
+          break;
+        a = strtoul(pkt+3, NULL, 16) / 4;
+        if (a >= statePtr->numMemory) {
+          strcpy(reply, "E01");
+          break;
+        }
+        stub.bkpt[a] = pkt[0] == 'Z';
+        strcpy(reply, "OK");
+        break;
+      case 's':
+      case 'c':
+        if (pkt[1] != '\0')
+          statePtr->pc = strtoul(pkt+1, NULL, 16) / 4;
+        strcpy(reply, __gdbResume(sim, &stub, pkt[0] == 's'));
+        break;
+      case 'k':
+        close(stub.fd);
+        exit(0);
+      case 'D':
+        strcpy(reply, "OK");
+        __gdbSendPacket(&stub, reply);
+        goto detach;
+      case 'H':
+      case 'T':
+        strcpy(reply, "OK");
+        break;
+      case 'q':
+        if (!strncmp(pkt, "qSupported", 10))
+          sprintf(reply, "PacketSize=%x;QStartNoAckMode+", GDB_BUFSIZE);
+        else if (!strcmp(pkt, "qAttached"))
+          strcpy(reply, "1");
+        else if (!strcmp(pkt, "qC"))
+          strcpy(reply, "QC1");
+        else if (!strcmp(pkt, "qfThreadInfo"))
+          strcpy(reply, "m1");
+        else if (!strcmp(pkt, "qsThreadInfo"))
+          strcpy(reply, "l");
+        break;
+      case 'Q':
+        if (!strcmp(pkt, "QStartNoAckMode")) {
+          __gdbSendPacket(&stub, "OK");
+          stub.noAck = 1;
+          continue;
+        }
+        break;
+      default:
+        break;
+    }
+    __gdbSendPacket(&stub, reply);
+  }
+
+detach:
+  close(stub.fd);
+  free(stub.bkpt);
+  /* the client went away before the program finished: run it out, or
+     report the fault it stopped at */
+  if (!sim->halted && simRun(sim) != SIM_HALTED)
+    raiseSimError(sim);
+  printf("machine halted\n");
+  return sim->executed;
+}
+#endif /* !LC2K_LIBRARY */
+
 // Print state helper
-void printState(stateType *statePtr)
+static void printState(stateType *statePtr)
 {
   int i;
   printf("\n@@@\nstate:\n");
   printf("\tpc %d\n", statePtr->pc); printf("\tmemory:\n");
   for (i=0; i<statePtr->numMemory; i++) {
-    printf("\t\tmem[ %d ] %d\n", i, statePtr->mem[i]);
+    printf("\t\tmem[ %d ] %d\n", i, pageMemRead(&statePtr->mem, i));
   }
   printf("\tregisters:\n");
   for (i=0; i<NUMREGS; i++) {
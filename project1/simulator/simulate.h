@@ -0,0 +1,116 @@
+/* LC-2K Instruction-level simulator: library interface */
+#ifndef LC2K_SIMULATE_H
+#define LC2K_SIMULATE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * simulate.c built with -DLC2K_LIBRARY (make lib: build/libsimulate.a)
+ * leaves out main() and the modes only the command line has, the gdb stub
+ * and multi-core runs. Everything a program does lives in its handle, so
+ * handles on different threads never interfere, and a handle can be
+ * reloaded for the next program instead of being reopened.
+ *
+ * No call exits or prints: errors come back as SIM_ERROR, after which
+ * simError() tells which one and every run call fails until the next
+ * load. Only SIM_TRACE prints, the state before every instruction like
+ * the command line does. SIM_FAST runs simRun() on a guarded flat copy of
+ * the memory; the guard regions are shared by the whole process, so use
+ * it from one thread at a time (it falls back to checked runs when no
+ * region is free).
+ *
+ * Untraced runs skip over counting loops they can work out in closed
+ * form: the registers and the instruction count come out as if every
+ * pass had executed, only faster. SIM_STEPALL turns that off.
+ */
+typedef struct simStruct simHandle;
+
+/* simOpen() flags */
+#define SIM_FAST    0x1 /* simRun() without bounds compares */
+#define SIM_ISAEXT  0x2 /* run mul, div, sll and srl */
+#define SIM_TRACE   0x4 /* print the state before every instruction */
+#define SIM_STEPALL 0x8 /* step through loops the runs would skip */
+
+/* results of the load and run calls */
+#define SIM_OK      0
+#define SIM_HALTED  1
+#define SIM_ERROR (-1)
+
+/* NULL when memBits is out of range or memory runs out */
+simHandle *simOpen(int memBits, int flags);
+void simClose(simHandle *);
+
+/* a new program: pc, registers and counters back to 0 */
+int simLoad(simHandle *, const int *words, int numWords);
+int simLoadText(simHandle *, const char *text, size_t len); /* machine-code file contents */
+
+/* SIM_OK after n instructions, SIM_HALTED once the halt has executed */
+int simStep(simHandle *, long n);
+int simRun(simHandle *);
+long simExecuted(const simHandle *); /* instructions, the halt included */
+
+int simGetPc(const simHandle *);
+void simSetPc(simHandle *, int pc);
+int simGetReg(const simHandle *, int reg);
+int simSetReg(simHandle *, int reg, int data);
+int simNumMemory(const simHandle *);
+int simReadMem(simHandle *, int addr, int *data);
+int simWriteMem(simHandle *, int addr, int data);
+
+/* code of the last error, its address or register in *data */
+int simError(const simHandle *, int *data);
+const char *simErrorMsg(int code);
+
+/*
+ * Memory-mapped devices in the top 16 words of the address space, past
+ * any memory (the map is in common/devices.h): a console that writes to
+ * consoleFd and a timer counting executed instructions. A writer thread
+ * drains the console, so its output may lag the run; it is all written
+ * by simDevices(sim, -1), which detaches the devices, or simClose().
+ * Multi-core and batch runs have no devices.
+ */
+int simDevices(simHandle *, int consoleFd);
+
+/*
+ * Call-graph profile of what runs from here on: a shadow call stack
+ * follows the jalr calls and returns (see common/callprof.h) and every
+ * stack is charged the instructions run in it, with nothing added per
+ * instruction. labels is the contents of an `assemble -L` label map to
+ * name the routines with, NULL to name them by address. A load starts
+ * the stack over at the program's start and keeps the counts.
+ * simProfileWrite() writes them as folded stacks, the input of flame
+ * graph tools. Multi-core and batch runs are not profiled.
+ */
+int simProfileOpen(simHandle *, const char *labels, size_t len);
+int simProfileWrite(simHandle *, FILE *out);
+void simProfileClose(simHandle *);
+
+/*
+ * Batch mode: one image as many instances at once, each with its own
+ * memory and registers, run side by side in the SIMD lanes of the host
+ * (16 with AVX-512, 8 otherwise). Instances are numbered from 0; write
+ * each one's inputs, run, then read the results. Memory is the loaded
+ * words only, as in the scalar simulator.
+ */
+typedef struct simBatchStruct simBatch;
+
+simBatch *simBatchOpen(const int *words, int numWords, int numInstances, int flags); /* SIM_ISAEXT */
+void simBatchClose(simBatch *);
+int simBatchLanes(const simBatch *);
+
+/* runs every instance until it halts, fails or has executed maxSteps
+   instructions in all; returns how many are still running */
+int simBatchRun(simBatch *, long maxSteps);
+
+int simBatchReadMem(const simBatch *, int instance, int addr, int *data);
+int simBatchWriteMem(simBatch *, int instance, int addr, int data);
+int simBatchGetReg(const simBatch *, int instance, int reg);
+int simBatchSetReg(simBatch *, int instance, int reg, int data);
+int simBatchGetPc(const simBatch *, int instance);
+long simBatchExecuted(const simBatch *, int instance);
+
+/* SIM_OK while running, SIM_HALTED, or SIM_ERROR with the error's code and data */
+int simBatchStatus(const simBatch *, int instance, int *error, int *data);
+
+#endif
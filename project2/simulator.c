@@ -2,25 +2,41 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <limits.h>
+#include "../common/pagemem.h"
+#include "../common/guardmem.h"
+#include "../common/isa.h" /* jalr is not implemented for this project, unless asked for */
+#include "../common/devices.h"
+#include "../common/callprof.h"
+#include "simulator.h"
+#include "../project1/simulator/simulate.h" /* the functional model co-simulation runs against */
 
 #define MAXLINELENGTH 1000
-#define NUMMEMORY 65536 /* maximum number of data words in memory */
+#define MEMBITS 16 /* default address bits: 65536 data words in memory */
 #define NUMREGS 8 /* number of machine registers */
-
-#define ADD 0
-#define NOR 1
-#define LW 2
-#define SW 3
-#define BEQ 4
-#define JALR 5 /* JALR will not implemented for this project */
-#define HALT 6
-#define NOOP 7
+#define MAXWIDTH 8 /* widest issue supported */
+#define OOO_MAXSIZE 256 /* largest ROB/RS/LSQ in the out-of-order model */
+#define MULCYCLES 3 /* default EX cycles of mul and div */
+#define DIVCYCLES 10
+#define TL_QUEUE 32 /* instructions in IFID, IDEX and EXMEM, a power of 2 */
+#define TL_ROWS 32  /* trace viewer threads the instructions take turns on */
 
 #define NOOPINSTRUCTION 0x1c00000
 
+/* out-of-order model: reservation station classes */
+#define OOO_ALU 0
+#define OOO_LD  1
+#define OOO_ST  2
+#define OOO_BR  3
+#define OOO_CLASSES 4
+
 typedef struct IFIDStruct {
 	int instr;
 	int pcPlus1;
+	int valid; /* 0 for bubbles and squashed slots */
 } IFIDType;
 
 typedef struct IDEXStruct {
@@ -29,18 +45,25 @@ typedef struct IDEXStruct {
 	int readRegA;
 	int readRegB;
 	int offset;
+	int valid;
 } IDEXType;
 
 typedef struct EXMEMStruct {
 	int instr;
+	int pcPlus1;
 	int branchTarget;
 	int aluResult;
 	int readRegB;
+	int valid;
 } EXMEMType;
 
 typedef struct MEMWBStruct {
 	int instr;
 	int writeData;
+	int valid;
+	int pcPlus1;   /* the rest is only read by co-simulation: */
+	int aluResult; /* where the instruction came from and */
+	int readRegB;  /* what a sw stored */
 } MEMWBType;
 
 typedef struct WBENDStruct {
@@ -50,18 +73,79 @@ typedef struct WBENDStruct {
 
 typedef struct stateStruct {
 	int pc;
-	int instrMem[NUMMEMORY];
-	int dataMem[NUMMEMORY];
+	pageMem instrMem; /* pages are shared between state and newState, */
+	pageMem dataMem;  /* only the MEM stage writes to them */
+	int *instrFlat;   /* guarded flat copies of the memories */
+	int *dataFlat;    /* while running in fast mode */
+	unsigned char *dataDirty; /* and the pages of dataFlat stored to */
 	int reg[NUMREGS];
 	int numMemory;
-	IFIDType IFID;
-	IDEXType IDEX;
-	EXMEMType EXMEM;
-	MEMWBType MEMWB;
-	WBENDType WBEND;
+	IFIDType IFID[MAXWIDTH]; /* one slot per issue lane, */
+	IDEXType IDEX[MAXWIDTH]; /* only `width` of them are used */
+	EXMEMType EXMEM[MAXWIDTH];
+	MEMWBType MEMWB[MAXWIDTH];
+	WBENDType WBEND[MAXWIDTH];
 	int cycles; /* number of cycles run so far */
+	int width;    /* instructions issued per cycle */
+	int memPorts; /* loads/stores per bundle */
+	int retired;  /* instructions that completed writeback */
+	int retiredNoops;
+	int isaExt;   /* run mul, div, sll and srl */
+	int jalr;     /* run jalr instead of passing it on as a noop */
+	int mulCycles, divCycles;
+	int exLeft;   /* cycles the bundle in IDEX still stays in EX */
+	int stalls;   /* cycles decode held back an instruction */
+	devices *dev; /* memory-mapped devices, NULL when there are none */
+	callProf *prof; /* call-graph profile, NULL when off */
+	struct timelineStruct *tl; /* per-instruction timeline, NULL when off */
 } stateType;
 
+/* the latches an instruction enters, in order */
+#define TL_IFID  0
+#define TL_IDEX  1
+#define TL_EXMEM 2
+#define TL_MEMWB 3
+
+typedef struct tlRecordStruct {
+	long seq;      /* in fetch order from 0 */
+	int pc;
+	int instr;
+	long entered[4]; /* cycle it entered each latch, -1 before */
+} tlRecord;
+
+typedef struct timelineStruct {
+	FILE *text;    /* compact lines, NULL for none */
+	FILE *json;    /* trace events, NULL for none */
+	long first, last; /* cycles whose fetches are written */
+	long seq;      /* instructions fetched so far */
+	long events;   /* trace events written */
+	tlRecord queue[TL_QUEUE]; /* fetched and not in MEMWB yet, oldest first */
+	unsigned head, tail;
+} timeline;
+
+struct pipeStruct {
+	stateType state;
+	int flags;
+	int halted;
+	int failed;    /* a run raised an error, cleared by the next load */
+	int error;     /* ER_* and its data, of the last call that failed */
+	int errorData;
+	jmp_buf trap;  /* raiseError lands here while a library call runs */
+	devices dev;   /* state.dev points here while they are attached */
+	callProf prof; /* state.prof points here while profiling */
+	timeline tl;   /* state.tl points here while recording */
+};
+
+/* handle of the library call running on this thread, NULL outside of one */
+static __thread pipeHandle *pipeActive;
+
+typedef struct oooConfigStruct {
+	int robSize;
+	int rsSize;   /* reservation stations per class */
+	int lsqSize;
+	int latency[OOO_CLASSES];
+} oooConfig;
+
 ////
 
 // Sign Extend
@@ -75,17 +159,29 @@ typedef struct stateStruct {
 #define ER_OPENFILE       1
 #define ER_WRONGADDRESS   2
 #define ER_OUTOFBOUNDMEM  3
+#define ER_OUTOFBOUNDREG  4
+#define ER_WRITEREG0      5
+#define ER_OUTOFMEMORY    6
+#define ER_UNRECOGNIZE    7
 
-char* errorMsg[] = {
-  [ER_WRONGUSAGE]     "usage: simulate <machine-code file>",
+static char* errorMsg[] = {
+  [ER_WRONGUSAGE]     "usage: simulate [-c | -f] [-m address-bits] [-w width [-p memory-ports]] [-o rob,rs,lsq [-l alu,ld,st,br]] [-x [-e mul,div]] [-j] [-d console-file] [-F folded-file [-W insts|cycles|stalls] [-L label-map]] [-T timeline-file] [-J trace-file] [-R first,last] <machine-code file>",
   [ER_OPENFILE]       "error in opening file",
   [ER_WRONGADDRESS]   "error in reading address",
   [ER_OUTOFBOUNDMEM]  "memory address out of bound",
+  [ER_OUTOFBOUNDREG]  "register number out of bound",
+  [ER_WRITEREG0]      "illegal write to register 0",
+  [ER_OUTOFMEMORY]    "out of memory for the page of address",
+  [ER_UNRECOGNIZE]    "unrecognized opcode",
 };
 
+static __attribute__((noreturn)) void __pipeFail(int, int);
+
 #ifdef _DEBUG
 #define raiseError(code, data)                          \
   do {                                                  \
+    if (pipeActive)                                     \
+      __pipeFail(code, data);                           \
     fprintf(stderr, "[ERROR] [%s:%d] %s -> %d\n",       \
             __FILE__, __LINE__, errorMsg[code], data);  \
     exit(1);                                            \
@@ -93,6 +189,8 @@ char* errorMsg[] = {
 #else
 #define raiseError(code, data)              \
   do {                                      \
+    if (pipeActive)                         \
+      __pipeFail(code, data);               \
     fprintf(stderr, "[ERROR] %s -> %d\n",   \
             (errorMsg[code]), (data));      \
     exit(1);                                \
@@ -104,15 +202,27 @@ char* errorMsg[] = {
             (errorMsg[code]), (msg));       \
     exit(1);                                \
   } while(0);
+/* reports the error a library call returned */
+#define raisePipeError(sim)                 \
+  do {                                      \
+    int __code, __data;                     \
+    __code = pipeError((sim), &__data);     \
+    raiseError(__code, __data);             \
+  } while(0)
 
 // Function declarations
-void run(stateType*);
-void printState(stateType*);
-int field0(int);
-int field1(int);
-int field2(int);
-int opcode(int);
-void printInstruction(int);
+static void printState(stateType*);
+static int field0(int);
+static int field1(int);
+static int field2(int);
+static int opcode(int);
+static void printInstruction(int);
+static int issueCount(const stateType*);
+#ifndef LC2K_LIBRARY
+static void runCosim(stateType*);
+static void runOoO(stateType*, const oooConfig*);
+static void __printHalt(const stateType*);
+static char *readFile(const char *, size_t *);
 
 ///////////////////////////////////////////////////////////
 //                      main start                       //
@@ -120,35 +230,184 @@ void printInstruction(int);
 
 int main(int argc, char *argv[])
 {
-  char line[MAXLINELENGTH] = {0,};
-  FILE *filePtr;
-  int instCount;
-  stateType state;
+  pipeHandle *sim;
+  char *text;
+  size_t len;
   int mem;
+  int memBits = MEMBITS;
+  int width = 1, memPorts = 1;
+  int fast = 0;
+  int cosim = 0;
+  int ooo = 0;
+  oooConfig oooCfg = {16, 4, 8, {1, 2, 1, 1}};
+  const char *console = NULL;
+  const char *folded = NULL, *labelMap = NULL;
+  const char *weights[PROF_WEIGHTS] = {"insts", "cycles", "stalls"};
+  char *labels = NULL;
+  size_t labelsLen = 0;
+  const char *timelineFile = NULL, *traceFile = NULL;
+  FILE *foldedPtr = NULL, *timelinePtr = NULL, *tracePtr = NULL;
+  long first = 0, last = LONG_MAX;
+  int ext = 0, jalr = 0, mulCycles = MULCYCLES, divCycles = DIVCYCLES;
+  int weight = PIPE_PROF_CYCLES, weighted = 0;
+  int opt, i, consoleFd = -1;
 
-  if (argc != 2)
+  while ((opt = getopt(argc, argv, "cd:e:F:fJ:jL:l:m:o:p:R:T:W:w:x")) != -1) {
+    switch (opt) {
+      case 'x':
+        ext = PIPE_ISAEXT;
+        break;
+      case 'e':
+        if (sscanf(optarg, "%d,%d", &mulCycles, &divCycles) != 2
+            || mulCycles < 1 || divCycles < 1)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'j':
+        jalr = PIPE_JALR;
+        break;
+      case 'd':
+        console = optarg;
+        break;
+      case 'F':
+        folded = optarg;
+        break;
+      case 'W':
+        for (weight = 0; weight < PROF_WEIGHTS && strcmp(optarg, weights[weight]); weight++)
+          ;
+        if (weight == PROF_WEIGHTS)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        weighted = 1;
+        break;
+      case 'L':
+        labelMap = optarg;
+        break;
+      case 'T':
+        timelineFile = optarg;
+        break;
+      case 'J':
+        traceFile = optarg;
+        break;
+      case 'R':
+        if (sscanf(optarg, "%ld,%ld", &first, &last) != 2 || first < 0 || first > last)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'o':
+        ooo = 1;
+        if (sscanf(optarg, "%d,%d,%d", &oooCfg.robSize, &oooCfg.rsSize, &oooCfg.lsqSize) != 3
+            || oooCfg.robSize < 1 || oooCfg.robSize > OOO_MAXSIZE
+            || oooCfg.rsSize < 1 || oooCfg.rsSize > OOO_MAXSIZE
+            || oooCfg.lsqSize < 1 || oooCfg.lsqSize > OOO_MAXSIZE)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'l':
+        if (sscanf(optarg, "%d,%d,%d,%d", oooCfg.latency+OOO_ALU, oooCfg.latency+OOO_LD,
+                   oooCfg.latency+OOO_ST, oooCfg.latency+OOO_BR) != 4
+            || oooCfg.latency[OOO_ALU] < 1 || oooCfg.latency[OOO_LD] < 1
+            || oooCfg.latency[OOO_ST] < 1 || oooCfg.latency[OOO_BR] < 1)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'c':
+        cosim = 1;
+        break;
+      case 'f':
+        fast = 1;
+        break;
+      case 'w':
+        width = atoi(optarg);
+        if (width < 1 || width > MAXWIDTH)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'p':
+        memPorts = atoi(optarg);
+        if (memPorts < 1)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'm':
+        memBits = atoi(optarg);
+        if (memBits < PM_MINBITS || memBits > PM_MAXBITS - 1)
+          raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+        break;
+      default:
+        raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
+    }
+  }
+  /* co-simulation and the out-of-order model have no devices and are
+     not profiled, the out-of-order model has no extension or jalr either */
+  if (argc - optind != 1 || (cosim && (fast || ooo)) || (console && (cosim || ooo))
+      || ((ext || jalr) && ooo) || ((folded || timelineFile || traceFile) && (cosim || ooo))
+      || ((weighted || labelMap) && !folded))
     raiseErrorMsg(ER_WRONGUSAGE, argv[0]);
 
-  filePtr = fopen(argv[1], "r");
-  if (filePtr == NULL)
-    raiseErrorMsg(ER_OPENFILE, argv[1]);
-
-  /* read in the entire machine-code file into memory */
-  for (state.numMemory = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL; state.numMemory++) {
-    if (sscanf(line, "%d", &mem) != 1)
-      raiseError(ER_WRONGADDRESS, state.numMemory);
-    state.instrMem[state.numMemory] = mem;
-    state.dataMem[state.numMemory] = mem;
-    printf("memory[%d]=%d\n", state.numMemory, mem);
+  text = readFile(argv[optind], &len);
+  if (text == NULL)
+    raiseErrorMsg(ER_OPENFILE, argv[optind]);
+  if (console) {
+    consoleFd = strcmp(console, "-") == 0 ? STDOUT_FILENO
+      : open(console, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (consoleFd < 0)
+      raiseErrorMsg(ER_OPENFILE, console);
   }
-  printf("%d memory words\n", state.numMemory);
+  if (labelMap && (labels = readFile(labelMap, &labelsLen)) == NULL)
+    raiseErrorMsg(ER_OPENFILE, labelMap);
+  if (folded && (foldedPtr = fopen(folded, "w")) == NULL)
+    raiseErrorMsg(ER_OPENFILE, folded);
+  if (timelineFile && (timelinePtr = fopen(timelineFile, "w")) == NULL)
+    raiseErrorMsg(ER_OPENFILE, timelineFile);
+  if (traceFile && (tracePtr = fopen(traceFile, "w")) == NULL)
+    raiseErrorMsg(ER_OPENFILE, traceFile);
+  sim = pipeOpen(memBits, width, memPorts, (fast ? PIPE_FAST : PIPE_TRACE) | ext | jalr);
+  if (sim == NULL)
+    raiseErrorMsg(ER_OPENFILE, "out of memory");
+  pipeExecCycles(sim, mulCycles, divCycles);
+
+  /* the entire machine-code file goes into both memories */
+  if (pipeLoadText(sim, text, len) != PIPE_OK)
+    raisePipeError(sim);
+  free(text);
+  for (i = 0; i < pipeNumMemory(sim) && pipeReadMem(sim, i, &mem) == PIPE_OK; i++)
+    printf("memory[%d]=%d\n", i, mem);
+  printf("%d memory words\n", pipeNumMemory(sim));
   printf("\tinstruction memory:\n");
-  for(int i = 0; i < state.numMemory; i++){
+  for (i = 0; i < pipeNumMemory(sim); i++) {
     printf("\t\tinstrMem[ %d ] ", i);
-    printInstruction(state.instrMem[i]);
+    printInstruction(pageMemRead(&sim->state.instrMem, i));
   }
 
-  run(&state);
+  /* these two run on a copy of the loaded state and exit */
+  if (ooo)
+    runOoO(&sim->state, &oooCfg);
+  if (cosim)
+    runCosim(&sim->state);
+
+  /* the console writes to its file from another thread, so what is
+     printed here goes out first and the final state after it */
+  fflush(stdout);
+  if (consoleFd >= 0 && pipeDevices(sim, consoleFd) != PIPE_OK)
+    raisePipeError(sim);
+  if (foldedPtr && pipeProfileOpen(sim, labels, labelsLen) != PIPE_OK)
+    raisePipeError(sim);
+  free(labels);
+  if ((timelinePtr || tracePtr) && pipeTimelineOpen(sim, timelinePtr, tracePtr, first, last) != PIPE_OK)
+    raisePipeError(sim);
+  if (pipeRun(sim) != PIPE_HALTED) {
+    pipeDevices(sim, -1);
+    raisePipeError(sim);
+  }
+  pipeDevices(sim, -1);
+  pipeTimelineClose(sim);
+  if (timelinePtr)
+    fclose(timelinePtr);
+  if (tracePtr)
+    fclose(tracePtr);
+  if (foldedPtr) {
+    if (pipeProfileWrite(sim, foldedPtr, weight) != PIPE_OK)
+      raisePipeError(sim);
+    fclose(foldedPtr);
+  }
+  if (fast)
+    printState(&sim->state);
+  __printHalt(&sim->state);
+  pipeClose(sim);
 
   return(0);
 }
@@ -156,271 +415,1720 @@ int main(int argc, char *argv[])
 //                      main end                         //
 ///////////////////////////////////////////////////////////
 
+// Whole file into a buffer, NULL when it cannot be read
+static char *readFile(const char *path, size_t *len)
+{
+  FILE *filePtr;
+  char *text;
+  long size;
+
+  filePtr = fopen(path, "r");
+  if (filePtr == NULL)
+    return NULL;
+  fseek(filePtr, 0, SEEK_END);
+  size = ftell(filePtr);
+  rewind(filePtr);
+  text = size < 0 ? NULL : (char *)malloc(size + 1);
+  if (text != NULL)
+    *len = fread(text, 1, size, filePtr);
+  fclose(filePtr);
+  return text;
+}
+#endif /* !LC2K_LIBRARY */
+
 // Initialize State
-void __initState(stateType *statePtr, const stateType *prototype)
+//   Empty pipeline at pc 0, registers and counters cleared, on the
+//   memories and configuration statePtr already has
+static void __resetState(stateType *statePtr)
 {
-  statePtr->pc = 0;
-  memcpy(statePtr->instrMem, prototype->instrMem, sizeof(int)*NUMMEMORY);
-  memcpy(statePtr->dataMem, prototype->dataMem, sizeof(int)*NUMMEMORY);
+  stateType empty = {0,};
+  int i;
+
+  empty.instrMem = statePtr->instrMem;
+  empty.dataMem = statePtr->dataMem;
+  empty.numMemory = statePtr->numMemory;
+  empty.width = statePtr->width;
+  empty.memPorts = statePtr->memPorts;
+  empty.isaExt = statePtr->isaExt;
+  empty.jalr = statePtr->jalr;
+  empty.mulCycles = statePtr->mulCycles;
+  empty.divCycles = statePtr->divCycles;
+  empty.dev = statePtr->dev;
+  empty.prof = statePtr->prof;
+  empty.tl = statePtr->tl;
+  *statePtr = empty;
+  for(i = 0; i < MAXWIDTH; i++){
+    statePtr->IFID[i].instr = NOOPINSTRUCTION;
+    statePtr->IDEX[i].instr = NOOPINSTRUCTION;
+    statePtr->EXMEM[i].instr = NOOPINSTRUCTION;
+    statePtr->WBEND[i].instr = NOOPINSTRUCTION;
+  }
+}
+
+#ifndef LC2K_LIBRARY
+static void __initState(stateType *statePtr, const stateType *prototype)
+{
+  if(pageMemClone(&statePtr->instrMem, &prototype->instrMem) < 0
+     || pageMemClone(&statePtr->dataMem, &prototype->dataMem) < 0)
+    raiseError(ER_OUTOFMEMORY, -1);
   statePtr->numMemory = prototype->numMemory;
-  memset(statePtr->reg, 0, sizeof(int)*NUMREGS);
-  statePtr->IFID.instr = NOOPINSTRUCTION;
-  statePtr->IDEX.instr = NOOPINSTRUCTION;
-  statePtr->EXMEM.instr = NOOPINSTRUCTION;
-  statePtr->WBEND.instr = NOOPINSTRUCTION;
+  statePtr->width = prototype->width;
+  statePtr->memPorts = prototype->memPorts;
+  statePtr->isaExt = prototype->isaExt;
+  statePtr->jalr = prototype->jalr;
+  statePtr->mulCycles = prototype->mulCycles;
+  statePtr->divCycles = prototype->divCycles;
+  __resetState(statePtr);
+}
+#endif
+
+// Issue logic
+//   Register written by instr, or 0 when it writes none (reg 0 never
+//   carries a dependency since it always reads as 0). isaWrites() and
+//   isaReads() drop the extensions statePtr does not run; jalr only
+//   writes when statePtr runs it, otherwise it does nothing
+static int __destReg(const stateType *statePtr, int instr)
+{
+  int writes = isaWrites(instr, statePtr->isaExt);
+
+  if(opcode(instr) == OP_JALR && !statePtr->jalr)
+    return 0;
+  return writes ? __builtin_ctz(writes) : 0;
+}
+
+static int __readsReg(const stateType *statePtr, int instr, int reg)
+{
+  return isaReads(instr, statePtr->isaExt) >> reg & 1;
+}
+
+/*
+ * Number of leading IFID slots decode issues this cycle. The single-issue
+ * pipeline issues every cycle and leaves hazards to the program; wider
+ * pipelines interlock: a bundle ends before an instruction that reads a
+ * register still in flight (older bundles in IDEX/EXMEM/MEMWB or earlier
+ * slots of its own bundle), before a memory op beyond the memory ports,
+ * and around a halt, which always issues alone.
+ */
+static int issueCount(const stateType *statePtr)
+{
+  int width = statePtr->width;
+  int i, j, instr, dest, mem = 0;
+
+  /* nothing moves up behind a mul or div that is still in EX */
+  if(statePtr->exLeft > 0)
+    return 0;
+  if(width == 1)
+    return 1;
+  for(i = 0; i < width; i++){
+    if(!statePtr->IFID[i].valid)
+      return width;
+    instr = statePtr->IFID[i].instr;
+    if(opcode(instr) == OP_HALT)
+      return i == 0 ? 1 : i;
+    if((opcode(instr) == OP_LW || opcode(instr) == OP_SW) && ++mem > statePtr->memPorts)
+      return i;
+    for(j = 0; j < width; j++){
+      if((statePtr->IDEX[j].valid && (dest = __destReg(statePtr, statePtr->IDEX[j].instr))
+            && __readsReg(statePtr, instr, dest))
+         || (statePtr->EXMEM[j].valid && (dest = __destReg(statePtr, statePtr->EXMEM[j].instr))
+            && __readsReg(statePtr, instr, dest))
+         || (statePtr->MEMWB[j].valid && (dest = __destReg(statePtr, statePtr->MEMWB[j].instr))
+            && __readsReg(statePtr, instr, dest))
+         || (j < i && (dest = __destReg(statePtr, statePtr->IFID[j].instr))
+            && __readsReg(statePtr, instr, dest)))
+        return i;
+    }
+  }
+  return width;
 }
 
 // 5-stages Pipeline
-void fetch(stateType *newStatePtr, const stateType *statePtr)
+//   Every latch holds `width` slots, slot 0 being the oldest instruction.
+//   `fast` is always a constant: the fast instantiation drops the bounds
+//   compares and lets out-of-bound accesses fault on the guard region,
+//   the device one is the fast one with the device region checked
+#define CHECKEDMEM 0
+#define FASTMEM    1
+#define DEVMEM     2
+
+static __always_inline void fetch(stateType *newStatePtr, const stateType *statePtr, const int fast)
+{
+  int issued = issueCount(statePtr);
+  int i, n = 0;
+
+  /* slots decode could not issue stay in IFID, fetch fills up behind them */
+  for(i = issued; i < statePtr->width; i++)
+    newStatePtr->IFID[n++] = statePtr->IFID[i];
+  newStatePtr->pc = statePtr->pc;
+  for(; n < statePtr->width; n++){
+    if(!fast && (newStatePtr->pc < 0 || newStatePtr->pc >= statePtr->instrMem.limit))
+      raiseError(ER_OUTOFBOUNDMEM, newStatePtr->pc);
+    newStatePtr->IFID[n].instr = fast ? statePtr->instrFlat[newStatePtr->pc] :
+      pageMemRead(&newStatePtr->instrMem, newStatePtr->pc);
+    newStatePtr->IFID[n].pcPlus1 = newStatePtr->pc + 1;
+    newStatePtr->IFID[n].valid = 1;
+    newStatePtr->pc++;
+  }
+}
+
+/* cycles instr spends in EX: mul and div take several */
+static int __exCycles(const stateType *statePtr, int instr)
 {
-  if(statePtr->pc < 0 || statePtr->pc >= NUMMEMORY)
-    raiseError(ER_OUTOFBOUNDMEM, statePtr->pc);
-  newStatePtr->IFID.instr = statePtr->instrMem[statePtr->pc];
-  newStatePtr->IFID.pcPlus1 = statePtr->pc + 1;
-  newStatePtr->pc = statePtr->pc + 1;
+  if(!statePtr->isaExt)
+    return 1;
+  if(opcode(instr) == OP_MUL)
+    return statePtr->mulCycles;
+  if(opcode(instr) == OP_DIV)
+    return statePtr->divCycles;
+  return 1;
 }
 
-void decode(stateType *newStatePtr, const stateType *statePtr)
+static void decode(stateType *newStatePtr, const stateType *statePtr)
 {
-  int instr = statePtr->IFID.instr;
-  int regA = field0(instr);
-  int regB = field1(instr);
+  int issued = issueCount(statePtr);
+  int i, instr, regA, regB, cycles;
 
-  newStatePtr->IDEX.pcPlus1 = statePtr->IFID.pcPlus1;
-  newStatePtr->IDEX.instr = instr;
-  newStatePtr->IDEX.readRegA = regA == 0 ?
-    0 : statePtr->reg[field0(instr)];
-  newStatePtr->IDEX.readRegB = regB == 0 ?
-    0 : statePtr->reg[field1(instr)];
-  newStatePtr->IDEX.offset = convertNum(field2(instr));
+  if(issued < statePtr->width && statePtr->IFID[issued].valid)
+    newStatePtr->stalls++;
+  /* IDEX is held while its bundle is still in EX */
+  if(statePtr->exLeft > 0)
+    return;
+  newStatePtr->exLeft = 0;
+  for(i = 0; i < statePtr->width; i++){
+    if(i >= issued){
+      newStatePtr->IDEX[i].instr = NOOPINSTRUCTION;
+      newStatePtr->IDEX[i].valid = 0;
+      continue;
+    }
+    instr = statePtr->IFID[i].instr;
+    regA = field0(instr);
+    regB = field1(instr);
+
+    newStatePtr->IDEX[i].pcPlus1 = statePtr->IFID[i].pcPlus1;
+    newStatePtr->IDEX[i].instr = instr;
+    newStatePtr->IDEX[i].valid = statePtr->IFID[i].valid;
+    newStatePtr->IDEX[i].readRegA = regA == 0 ?
+      0 : statePtr->reg[field0(instr)];
+    newStatePtr->IDEX[i].readRegB = regB == 0 ?
+      0 : statePtr->reg[field1(instr)];
+    newStatePtr->IDEX[i].offset = convertNum(field2(instr));
+    cycles = __exCycles(statePtr, instr);
+    if(cycles - 1 > newStatePtr->exLeft)
+      newStatePtr->exLeft = cycles - 1;
+  }
 }
 
-void execute(stateType *newStatePtr, const stateType *statePtr)
+static void execute(stateType *newStatePtr, const stateType *statePtr)
 {
-  int instr = statePtr->IDEX.instr;
+  const IDEXType *in;
+  EXMEMType *out;
+  int i;
 
-  newStatePtr->EXMEM.instr = instr;
-  newStatePtr->EXMEM.branchTarget = \
-    statePtr->IDEX.pcPlus1 + statePtr->IDEX.offset;
-  newStatePtr->EXMEM.readRegB = statePtr->IDEX.readRegB;
+  /* a multi-cycle bundle: bubbles go on to MEM until its last cycle */
+  if(statePtr->exLeft > 0){
+    for(i = 0; i < statePtr->width; i++){
+      newStatePtr->EXMEM[i].instr = NOOPINSTRUCTION;
+      newStatePtr->EXMEM[i].valid = 0;
+    }
+    newStatePtr->exLeft = statePtr->exLeft - 1;
+    return;
+  }
+  for(i = 0; i < statePtr->width; i++){
+    in = &statePtr->IDEX[i];
+    out = &newStatePtr->EXMEM[i];
 
-  switch(opcode(instr)){
-    case ADD:
-      newStatePtr->EXMEM.aluResult = \
-        statePtr->IDEX.readRegA + statePtr->IDEX.readRegB;
-      break;
-    case NOR:
-      newStatePtr->EXMEM.aluResult = \
-        ~(statePtr->IDEX.readRegA | statePtr->IDEX.readRegB);
-      break;
-    case LW:
-    case SW:
-      newStatePtr->EXMEM.aluResult = \
-        statePtr->IDEX.readRegA + statePtr->IDEX.offset;
-      break;
-    case BEQ:
-      newStatePtr->EXMEM.aluResult = \
-        statePtr->IDEX.readRegA - statePtr->IDEX.readRegB;
-      break;
-    default:
-      break;
+    out->instr = in->instr;
+    out->valid = in->valid;
+    out->pcPlus1 = in->pcPlus1;
+    out->branchTarget = in->pcPlus1 + in->offset;
+    out->readRegB = in->readRegB;
+
+    /* unsigned arithmetic wraps at 32 bits, signed overflow would be undefined */
+    switch(opcode(in->instr)){
+      case OP_ADD:
+        out->aluResult = (int)((unsigned)in->readRegA + in->readRegB);
+        break;
+      case OP_NOR:
+        out->aluResult = ~(in->readRegA | in->readRegB);
+        break;
+      case OP_LW:
+      case OP_SW:
+        out->aluResult = (int)((unsigned)in->readRegA + in->offset);
+        break;
+      case OP_BEQ:
+        out->aluResult = (int)((unsigned)in->readRegA - in->readRegB);
+        break;
+      case OP_JALR:
+        /* without -j jalr is a noop and leaves aluResult as it was */
+        if(statePtr->jalr)
+          out->aluResult = in->readRegA;
+        break;
+      case OP_MUL:
+      case OP_DIV:
+      case OP_SLL:
+      case OP_SRL:
+        if(statePtr->isaExt)
+          out->aluResult = isaArithResult(opcode(in->instr), in->readRegA, in->readRegB);
+        break;
+      default:
+        break;
+    }
   }
 }
 
-void memory(stateType *newStatePtr, const stateType *statePtr)
+/* a taken beq or a jalr in slot i of MEM: everything younger is squashed,
+   the rest of its own bundle included, and fetch goes on at target */
+static void __redirect(stateType *newStatePtr, const stateType *statePtr, int i, int target)
 {
-  int instr = statePtr->EXMEM.instr;
-  int aluResult = statePtr->EXMEM.aluResult;
+  int j;
 
-  newStatePtr->MEMWB.instr = instr;
+  newStatePtr->pc = target;
+  newStatePtr->exLeft = 0;
+  for(j = 0; j < statePtr->width; j++){
+    newStatePtr->IFID[j].instr = NOOPINSTRUCTION;
+    newStatePtr->IDEX[j].instr = NOOPINSTRUCTION;
+    newStatePtr->EXMEM[j].instr = NOOPINSTRUCTION;
+    newStatePtr->IFID[j].valid = 0;
+    newStatePtr->IDEX[j].valid = 0;
+    newStatePtr->EXMEM[j].valid = 0;
+  }
+  for(j = i + 1; j < statePtr->width; j++){
+    newStatePtr->MEMWB[j].instr = NOOPINSTRUCTION;
+    newStatePtr->MEMWB[j].valid = 0;
+  }
+}
 
-  switch(opcode(instr)){
-    case ADD:
-    case NOR:
-      newStatePtr->MEMWB.writeData = aluResult;
-      break;
-    case LW:
-      if(aluResult < 0 || aluResult >= NUMMEMORY)
-        raiseError(ER_OUTOFBOUNDMEM, aluResult);
-      newStatePtr->MEMWB.writeData = statePtr->dataMem[aluResult];
-      break;
-    case SW:
-      if(aluResult < 0 || aluResult >= NUMMEMORY)
-        raiseError(ER_OUTOFBOUNDMEM, aluResult);
-      newStatePtr->dataMem[aluResult] = statePtr->EXMEM.readRegB;
-      break;
-    case BEQ:
-      if(statePtr->EXMEM.aluResult == 0){
-        newStatePtr->pc = statePtr->EXMEM.branchTarget;
-        newStatePtr->IFID.instr = NOOPINSTRUCTION;
-        newStatePtr->IDEX.instr = NOOPINSTRUCTION;
-        newStatePtr->EXMEM.instr = NOOPINSTRUCTION;
-      }
-    default:
-      break;
+// Data accesses that missed the memory: a device, or out of bound
+static __attribute__((noinline, cold)) int __devRead(const stateType *statePtr, int addr, long now)
+{
+  int data;
+
+  if(statePtr->dev == NULL || devRead(statePtr->dev, addr, now, &data) < 0)
+    raiseError(ER_OUTOFBOUNDMEM, addr);
+  return data;
+}
+
+static __attribute__((noinline, cold)) void __devWrite(const stateType *statePtr, int addr, long now, int data)
+{
+  if(statePtr->dev == NULL || devWrite(statePtr->dev, addr, now, data) < 0)
+    raiseError(ER_OUTOFBOUNDMEM, addr);
+}
+
+static __always_inline void memory(stateType *newStatePtr, const stateType *statePtr, const int fast)
+{
+  const EXMEMType *in;
+  MEMWBType *out;
+  int i, aluResult;
+
+  for(i = 0; i < statePtr->width; i++){
+    in = &statePtr->EXMEM[i];
+    out = &newStatePtr->MEMWB[i];
+    aluResult = in->aluResult;
+
+    out->instr = in->instr;
+    out->valid = in->valid;
+    out->pcPlus1 = in->pcPlus1;
+    out->aluResult = aluResult;
+    out->readRegB = in->readRegB;
+
+    switch(opcode(in->instr)){
+      case OP_ADD:
+      case OP_NOR:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_SLL:
+      case OP_SRL:
+        out->writeData = aluResult;
+        break;
+      case OP_LW:
+        if(fast == DEVMEM && devAddr(aluResult)) {
+          out->writeData = __devRead(statePtr, aluResult, newStatePtr->cycles);
+          break;
+        }
+        if(fast) {
+          out->writeData = statePtr->dataFlat[aluResult];
+          break;
+        }
+        if(aluResult < 0 || aluResult >= statePtr->dataMem.limit) {
+          out->writeData = __devRead(statePtr, aluResult, newStatePtr->cycles);
+          break;
+        }
+        out->writeData = pageMemRead(&newStatePtr->dataMem, aluResult);
+        break;
+      case OP_SW:
+        if(fast == DEVMEM && devAddr(aluResult)) {
+          __devWrite(statePtr, aluResult, newStatePtr->cycles, in->readRegB);
+          break;
+        }
+        if(fast) {
+          statePtr->dataFlat[aluResult] = in->readRegB;
+          /* masked: nothing orders it after the store that faults */
+          statePtr->dataDirty[((unsigned)aluResult & (statePtr->dataMem.limit - 1)) >> PM_PAGEBITS] = 1;
+          break;
+        }
+        if(aluResult < 0 || aluResult >= statePtr->dataMem.limit) {
+          __devWrite(statePtr, aluResult, newStatePtr->cycles, in->readRegB);
+          break;
+        }
+        if(pageMemWrite(&newStatePtr->dataMem, aluResult, in->readRegB) < 0)
+          raiseError(ER_OUTOFMEMORY, aluResult);
+        break;
+      case OP_BEQ:
+        if(aluResult != 0)
+          break;
+        __redirect(newStatePtr, statePtr, i, in->branchTarget);
+        return;
+      case OP_JALR:
+        if(!statePtr->jalr)
+          break;
+        out->writeData = in->pcPlus1;
+        __redirect(newStatePtr, statePtr, i, aluResult);
+        return;
+      default:
+        break;
+    }
   }
 }
 
-void writeback(stateType *newStatePtr, const stateType *statePtr)
+/* a jalr retiring while profiling, with the counters as of this cycle */
+static __attribute__((noinline)) void __profRetire(const stateType *newStatePtr, const MEMWBType *in)
 {
-  int instr = statePtr->MEMWB.instr;
-  int writeData = statePtr->MEMWB.writeData;
-  int destReg;
+  long now[PROF_WEIGHTS] = {newStatePtr->retired, newStatePtr->cycles, newStatePtr->stalls};
 
-  newStatePtr->WBEND.instr = instr;
-  newStatePtr->WBEND.writeData = writeData;
+  profJalr(newStatePtr->prof, in->pcPlus1 - 1, in->aluResult, now);
+}
 
-  switch(opcode(instr)){
-    case ADD:
-    case NOR:
-      destReg = (instr & 0x7);
-      newStatePtr->reg[destReg] = writeData;
-      break;
-    case LW:
-      destReg = field1(instr);
-      newStatePtr->reg[destReg] = writeData;
-      break;
-    default:
-      break;
+static void writeback(stateType *newStatePtr, const stateType *statePtr)
+{
+  int i, instr, writeData, destReg;
+
+  for(i = 0; i < statePtr->width; i++){
+    instr = statePtr->MEMWB[i].instr;
+    writeData = statePtr->MEMWB[i].writeData;
+
+    newStatePtr->WBEND[i].instr = instr;
+    newStatePtr->WBEND[i].writeData = writeData;
+    if(statePtr->MEMWB[i].valid){
+      /* fetch runs ahead into data, so words are only refused once they retire */
+      if(isaDecode(isaOpcode(instr, statePtr->isaExt)) == NULL)
+        raiseError(ER_UNRECOGNIZE, (int)((unsigned)instr >> ISA_OPSHIFT));
+      newStatePtr->retired++;
+      newStatePtr->retiredNoops += opcode(instr) == OP_NOOP;
+    }
+
+    switch(opcode(instr)){
+      case OP_ADD:
+      case OP_NOR:
+        destReg = (instr & 0x7);
+        newStatePtr->reg[destReg] = writeData;
+        break;
+      case OP_LW:
+        destReg = field1(instr);
+        newStatePtr->reg[destReg] = writeData;
+        break;
+      case OP_MUL:
+      case OP_DIV:
+      case OP_SLL:
+      case OP_SRL:
+        if(statePtr->isaExt)
+          newStatePtr->reg[instr & 0x7] = writeData;
+        break;
+      case OP_JALR:
+        if(!statePtr->jalr)
+          break;
+        newStatePtr->reg[field1(instr)] = writeData;
+        if(statePtr->prof != NULL)
+          __profRetire(newStatePtr, &statePtr->MEMWB[i]);
+        break;
+      default:
+        break;
+    }
   }
 }
 
-// Main Run Method
-void run(stateType *prototype)
+static int __halted(const stateType *statePtr)
 {
-  stateType state = {0,};
-  stateType newState = {0,};
+  int i;
 
-  __initState(&state, prototype);
+  for(i = 0; i < statePtr->width; i++)
+    if(opcode(statePtr->MEMWB[i].instr) == OP_HALT)
+      return 1;
+  return 0;
+}
 
-  while (1) {
-    printState(&state);
+// Timeline
+//   Instructions move through the latches in fetch order and a redirect
+//   drops the youngest of them, so the ones in IFID, IDEX and EXMEM are
+//   a queue: after a cycle the valid slots of EXMEM, IDEX and IFID are
+//   its entries from the head in that order, the ones that moved into
+//   MEMWB leave at the head, and what IFID has beyond the queue was
+//   fetched this cycle. When the three latches come out empty with the
+//   queue not, a redirect flushed the rest of it. Only the latches' valid
+//   bits are counted, nothing is added to them, and an instruction is
+//   written as soon as its last stage is known: entering MEMWB, flushed,
+//   or still in flight when the timeline is closed.
+static const char *tlStages[] = {"IF", "ID", "EX", "MEM", "WB"};
 
-	/* check for halt */
-	if (opcode(state.MEMWB.instr) == HALT) {
-		printf("machine halted\n");
-		printf("total of %d cycles executed\n", state.cycles);
-		exit(0);
-	}
+/* one instruction out of the queue: flushed in that cycle, or -1; stages
+   starting after cycle `end` are not written */
+static void __tlWrite(timeline *tl, const tlRecord *r, long flushed, long end)
+{
+  const struct isaEntry *e = isaDecode(opcode(r->instr));
+  long start[5], next;
+  int k, n;
+
+  if(r->entered[TL_IFID] < tl->first || r->entered[TL_IFID] > tl->last)
+    return;
+  /* each stage starts the cycle after the instruction entered the latch before it */
+  start[0] = r->entered[TL_IFID];
+  for(k = 1; k < 5; k++)
+    start[k] = r->entered[k - 1] < 0 || r->entered[k - 1] + 1 > end ? -1 : r->entered[k - 1] + 1;
+  for(n = 1; n < 5 && start[n] >= 0; n++)
+    ;
+
+  if(tl->text != NULL){
+    fprintf(tl->text, "%d %d %ld", r->pc, r->instr, start[0]);
+    for(k = 1; k < 5; k++){
+      if(k < n)
+        fprintf(tl->text, " %ld", start[k] - start[0]);
+      else
+        fputs(" -", tl->text);
+    }
+    if(flushed >= 0)
+      fprintf(tl->text, " flush %ld", flushed - start[0]);
+    fputc('\n', tl->text);
+  }
+
+  if(tl->json != NULL){
+    for(k = 0; k < n; k++){
+      next = k + 1 < n ? start[k + 1] : k == 4 ? start[k] + 1 : flushed >= 0 ? flushed + 1 : end + 1;
+      fprintf(tl->json, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%ld,"
+              "\"ts\":%ld,\"dur\":%ld,\"args\":{\"seq\":%ld,\"pc\":%d,\"insn\":\"%s %d %d %d\"}}",
+              tl->events++ ? "," : "", tlStages[k], e != NULL ? e->name : "data", r->seq % TL_ROWS,
+              start[k], next - start[k], r->seq, r->pc, e != NULL ? e->name : "data",
+              field0(r->instr), field1(r->instr), field2(r->instr));
+    }
+    if(flushed >= 0)
+      fprintf(tl->json, ",\n{\"name\":\"flush\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%ld,\"ts\":%ld}",
+              r->seq % TL_ROWS, flushed);
+  }
+}
+
+/* after every cycle: statePtr before it, newStatePtr after */
+static __attribute__((noinline)) void __tlCycle(timeline *tl, const stateType *statePtr,
+                                                const stateType *newStatePtr)
+{
+  long c = newStatePtr->cycles;
+  tlRecord *r;
+  int i, k, mw = 0, ex = 0, id = 0, ifd = 0, fresh;
+
+  for(i = 0; i < statePtr->width; i++){
+    mw += newStatePtr->MEMWB[i].valid;
+    ex += newStatePtr->EXMEM[i].valid;
+    id += newStatePtr->IDEX[i].valid;
+    ifd += newStatePtr->IFID[i].valid;
+  }
+  for(k = 0; k < mw; k++){
+    r = &tl->queue[tl->head++ % TL_QUEUE];
+    r->entered[TL_MEMWB] = c;
+    __tlWrite(tl, r, -1, c + 1);
+  }
+  if(ex + id + ifd == 0){
+    while(tl->head != tl->tail)
+      __tlWrite(tl, &tl->queue[tl->head++ % TL_QUEUE], c, c);
+    return;
+  }
+
+  for(k = 0; k < ex; k++)
+    tl->queue[(tl->head + k) % TL_QUEUE].entered[TL_EXMEM] = c;
+  /* IDEX only moves when decode ran, not behind a multi-cycle EX */
+  if(statePtr->exLeft == 0)
+    for(; k < ex + id; k++)
+      tl->queue[(tl->head + k) % TL_QUEUE].entered[TL_IDEX] = c;
+  /* IFID holds on to what decode could not issue, in its first slots */
+  fresh = ex + id + ifd - (int)(tl->tail - tl->head);
+  for(i = 0, k = ifd - fresh; i < statePtr->width; i++){
+    if(!newStatePtr->IFID[i].valid || k-- > 0)
+      continue;
+    r = &tl->queue[tl->tail++ % TL_QUEUE];
+    r->seq = tl->seq++;
+    r->pc = newStatePtr->IFID[i].pcPlus1 - 1;
+    r->instr = newStatePtr->IFID[i].instr;
+    r->entered[TL_IFID] = c;
+    r->entered[TL_IDEX] = r->entered[TL_EXMEM] = r->entered[TL_MEMWB] = -1;
+  }
+}
+
+// Library interface
+//   Every call that runs the machine first points pipeActive at its handle
+//   and sets the handle's trap, so an error raised anywhere below comes
+//   back here as PIPE_ERROR instead of exiting.
+static __attribute__((noreturn)) void __pipeFail(int code, int data)
+{
+  pipeHandle *sim = pipeActive;
+
+  pipeActive = NULL;
+  sim->failed = 1;
+  sim->error = code;
+  sim->errorData = data;
+  longjmp(sim->trap, 1);
+}
+
+static int __pipeReject(pipeHandle *sim, int code, int data)
+{
+  sim->error = code;
+  sim->errorData = data;
+  return PIPE_ERROR;
+}
+
+pipeHandle *pipeOpen(int memBits, int width, int memPorts, int flags)
+{
+  pipeHandle *sim;
+
+  if(memBits < PM_MINBITS || memBits > PM_MAXBITS - 1
+     || width < 1 || width > MAXWIDTH || memPorts < 1)
+    return NULL;
+  sim = (pipeHandle *)calloc(1, sizeof(pipeHandle));
+  if(sim == NULL)
+    return NULL;
+  if(pageMemInit(&sim->state.instrMem, memBits) < 0
+     || pageMemInit(&sim->state.dataMem, memBits) < 0) {
+    pageMemFree(&sim->state.instrMem);
+    free(sim);
+    return NULL;
+  }
+  sim->flags = flags;
+  sim->state.width = width;
+  sim->state.memPorts = memPorts;
+  sim->state.isaExt = flags & PIPE_ISAEXT ? ISA_EXTARITH : 0;
+  sim->state.jalr = (flags & PIPE_JALR) != 0;
+  sim->state.mulCycles = MULCYCLES;
+  sim->state.divCycles = DIVCYCLES;
+  __resetState(&sim->state);
+  return sim;
+}
+
+void pipeClose(pipeHandle *sim)
+{
+  if(sim == NULL)
+    return;
+  pipeDevices(sim, -1);
+  pipeProfileClose(sim);
+  pipeTimelineClose(sim);
+  pageMemFree(&sim->state.instrMem);
+  pageMemFree(&sim->state.dataMem);
+  free(sim);
+}
+
+/* pages of the previous program are cleared rather than freed, so
+   loading short programs one after another does not allocate */
+static void __pipeReset(pipeHandle *sim)
+{
+  stateType *statePtr = &sim->state;
+
+  pageMemClear(&statePtr->instrMem);
+  pageMemClear(&statePtr->dataMem);
+  statePtr->numMemory = 0;
+  __resetState(statePtr);
+  if(statePtr->dev != NULL)
+    devReset(statePtr->dev);
+  if(statePtr->prof != NULL)
+    profRestart(statePtr->prof);
+  if(statePtr->tl != NULL)
+    statePtr->tl->head = statePtr->tl->tail = statePtr->tl->seq = 0;
+  sim->halted = 0;
+  sim->failed = 0;
+}
+
+static int __pipeLoadWord(pipeHandle *sim, int data)
+{
+  stateType *statePtr = &sim->state;
+
+  if(statePtr->numMemory >= statePtr->instrMem.limit) {
+    sim->failed = 1;
+    return __pipeReject(sim, ER_OUTOFBOUNDMEM, statePtr->numMemory);
+  }
+  if(pageMemWrite(&statePtr->instrMem, statePtr->numMemory, data) < 0
+     || pageMemWrite(&statePtr->dataMem, statePtr->numMemory, data) < 0) {
+    sim->failed = 1;
+    return __pipeReject(sim, ER_OUTOFMEMORY, statePtr->numMemory);
+  }
+  statePtr->numMemory++;
+  return PIPE_OK;
+}
+
+int pipeLoad(pipeHandle *sim, const int *words, int numWords)
+{
+  int i;
+
+  __pipeReset(sim);
+  for(i = 0; i < numWords; i++)
+    if(__pipeLoadWord(sim, words[i]) != PIPE_OK)
+      return PIPE_ERROR;
+  return PIPE_OK;
+}
+
+/* one line of a machine-code file: a decimal word, read like sscanf's %d */
+static int __pipeParseWord(const char *p, const char *end, int *data)
+{
+  const char *digits;
+  unsigned int v = 0;
+  int neg = 0;
+
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f'))
+    p++;
+  if(p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+  for(digits = p; p < end && *p >= '0' && *p <= '9'; p++)
+    v = v * 10 + (*p - '0');
+  if(p == digits)
+    return -1;
+  *data = (int)(neg ? -v : v);
+  return 0;
+}
+
+int pipeLoadText(pipeHandle *sim, const char *text, size_t len)
+{
+  const char *p = text, *end = text + len, *eol;
+  int data;
+
+  __pipeReset(sim);
+  while(p < end) {
+    eol = (const char *)memchr(p, '\n', end - p);
+    if(eol == NULL)
+      eol = end;
+    if(__pipeParseWord(p, eol, &data) < 0) {
+      sim->failed = 1;
+      return __pipeReject(sim, ER_WRONGADDRESS, sim->state.numMemory);
+    }
+    if(__pipeLoadWord(sim, data) != PIPE_OK)
+      return PIPE_ERROR;
+    p = eol < end ? eol + 1 : end;
+  }
+  return PIPE_OK;
+}
 
-	newState = state;
+int pipeStep(pipeHandle *sim, long n)
+{
+  stateType *statePtr = &sim->state;
+  stateType newState;
+  long i;
+
+  if(sim->failed)
+    return PIPE_ERROR;
+  if(sim->halted)
+    return PIPE_HALTED;
+  if(setjmp(sim->trap))
+    return PIPE_ERROR;
+  pipeActive = sim;
+  for(i = 0; i < n && !sim->halted; i++) {
+    if(sim->flags & PIPE_TRACE)
+      printState(statePtr);
+
+	newState = *statePtr;
 	newState.cycles++;
 
 	/* --------------------- IF stage --------------------- */
-    fetch(&newState, &state);
+    fetch(&newState, statePtr, CHECKEDMEM);
 
 	/* --------------------- ID stage --------------------- */
-    decode(&newState, &state);
+    decode(&newState, statePtr);
 
 	/* --------------------- EX stage --------------------- */
-    execute(&newState, &state);
+    execute(&newState, statePtr);
 
 	/* --------------------- MEM stage --------------------- */
-    memory(&newState, &state);
+    memory(&newState, statePtr, CHECKEDMEM);
 
 	/* --------------------- WB stage --------------------- */
-    writeback(&newState, &state);
+    writeback(&newState, statePtr);
+
+    if(statePtr->tl != NULL)
+      __tlCycle(statePtr->tl, statePtr, &newState);
 
-	state = newState; /* this is the last statement before end of the loop.
+	*statePtr = newState; /* this is the last statement before end of the loop.
 			It marks the end of the cycle and updates the
 			current state with the values calculated in this
 			cycle */
+
+    /* the halted state is the last one a trace shows */
+    sim->halted = __halted(statePtr);
+    if(sim->halted && (sim->flags & PIPE_TRACE))
+      printState(statePtr);
+  }
+  pipeActive = NULL;
+  return sim->halted ? PIPE_HALTED : PIPE_OK;
+}
+
+// Fast mode: no bounds compares, both memories are flat guarded copies and
+// the pages of the data memory it stored to are written back at halt
+static __always_inline void __pipeRunFlat(stateType *statePtr, const int fast)
+{
+  stateType newState;
+
+  while(!__halted(statePtr)) {
+    newState = *statePtr;
+    newState.cycles++;
+    fetch(&newState, statePtr, fast);
+    decode(&newState, statePtr);
+    execute(&newState, statePtr);
+    memory(&newState, statePtr, fast);
+    writeback(&newState, statePtr);
+    if(statePtr->tl != NULL)
+      __tlCycle(statePtr->tl, statePtr, &newState);
+    *statePtr = newState;
+  }
+}
+
+/* the first device access of a fast run faults like an out-of-bound one;
+   the cycle it faulted in is not committed yet, so it just runs again in
+   DEVMEM (stores before it in the bundle store the same words again).
+   0 for a real fault */
+static int __pipeDevFault(const stateType *statePtr, const guardTrap *trap,
+                          const guardMem *dataFlat, volatile int *devs)
+{
+  if(*devs || statePtr->dev == NULL || trap->gm != dataFlat || !devAddr(trap->addr))
+    return 0;
+  *devs = 1;
+  return 1;
+}
+
+static int __pipeRunFast(pipeHandle *sim)
+{
+  stateType *statePtr = &sim->state;
+  guardMem instrFlat, dataFlat;
+  guardTrap trap;
+  unsigned long page;
+  volatile int devs = 0, faulted = 0;
+
+  statePtr->dataDirty = (unsigned char *)calloc(statePtr->dataMem.limit >> PM_PAGEBITS, 1);
+  if(statePtr->dataDirty == NULL)
+    return pipeStep(sim, LONG_MAX);
+  if(guardMemMap(&instrFlat, statePtr->instrMem.limit, 1) < 0) {
+    free(statePtr->dataDirty);
+    statePtr->dataDirty = NULL;
+    return pipeStep(sim, LONG_MAX);
+  }
+  if(guardMemMap(&dataFlat, statePtr->dataMem.limit, 1) < 0) {
+    guardMemUnmap(&instrFlat);
+    free(statePtr->dataDirty);
+    statePtr->dataDirty = NULL;
+    return pipeStep(sim, LONG_MAX);
+  }
+  pageMemCopyOut(&statePtr->instrMem, instrFlat.base, statePtr->instrMem.limit);
+  pageMemCopyOut(&statePtr->dataMem, dataFlat.base, statePtr->dataMem.limit);
+  guardMemReadOnly(&instrFlat);
+  statePtr->instrFlat = instrFlat.base;
+  statePtr->dataFlat = dataFlat.base;
+
+  if(setjmp(sim->trap) == 0) {
+    pipeActive = sim;
+    guardMemArm(&trap);
+    if(sigsetjmp(trap.env, 1) != 0)
+      faulted = !__pipeDevFault(statePtr, &trap, &dataFlat, &devs);
+    if(faulted) {
+      pipeActive = NULL;
+      sim->failed = 1;
+      __pipeReject(sim, ER_OUTOFBOUNDMEM, (int)trap.addr);
+    } else {
+      /* programs that never touch a device keep the compare-free loop */
+      if(devs)
+        __pipeRunFlat(statePtr, DEVMEM);
+      else
+        __pipeRunFlat(statePtr, FASTMEM);
+      pipeActive = NULL;
+      sim->halted = 1;
+    }
+  }
+  guardMemDisarm();
+
+  /* every page it stored to, anywhere below the limit like a checked run;
+     all of them are allocated first so running out copies back none */
+  for(page = 0; page < statePtr->dataMem.limit >> PM_PAGEBITS; page++) {
+    if(statePtr->dataDirty[page]
+       && pageMemReservePage(&statePtr->dataMem, dataFlat.base, page << PM_PAGEBITS, PM_PAGEWORDS) < 0)
+      break;
+  }
+  if(page < statePtr->dataMem.limit >> PM_PAGEBITS) {
+    if(!sim->failed) {
+      sim->failed = 1;
+      __pipeReject(sim, ER_OUTOFMEMORY, (int)(page << PM_PAGEBITS));
+    }
+  } else {
+    for(page = 0; page < statePtr->dataMem.limit >> PM_PAGEBITS; page++)
+      if(statePtr->dataDirty[page])
+        pageMemCopyInPage(&statePtr->dataMem, dataFlat.base, page << PM_PAGEBITS, PM_PAGEWORDS);
+  }
+  free(statePtr->dataDirty);
+  statePtr->instrFlat = NULL;
+  statePtr->dataFlat = NULL;
+  statePtr->dataDirty = NULL;
+  guardMemUnmap(&instrFlat);
+  guardMemUnmap(&dataFlat);
+  return sim->failed ? PIPE_ERROR : PIPE_HALTED;
+}
+
+int pipeRun(pipeHandle *sim)
+{
+  if((sim->flags & (PIPE_FAST | PIPE_TRACE)) != PIPE_FAST || sim->failed || sim->halted)
+    return pipeStep(sim, LONG_MAX);
+  return __pipeRunFast(sim);
+}
+
+int pipeDevices(pipeHandle *sim, int consoleFd)
+{
+  if(sim->state.dev != NULL) {
+    devClose(sim->state.dev);
+    sim->state.dev = NULL;
+  }
+  if(consoleFd < 0)
+    return PIPE_OK;
+  if(devOpen(&sim->dev, consoleFd) < 0)
+    return __pipeReject(sim, ER_OPENFILE, consoleFd);
+  sim->state.dev = &sim->dev;
+  return PIPE_OK;
+}
+
+int pipeExecCycles(pipeHandle *sim, int mulCycles, int divCycles)
+{
+  if(mulCycles < 1 || divCycles < 1)
+    return __pipeReject(sim, ER_WRONGUSAGE, mulCycles < 1 ? mulCycles : divCycles);
+  sim->state.mulCycles = mulCycles;
+  sim->state.divCycles = divCycles;
+  return PIPE_OK;
+}
+
+int pipeProfileOpen(pipeHandle *sim, const char *labels, size_t len)
+{
+  stateType *statePtr = &sim->state;
+
+  pipeProfileClose(sim);
+  if(profOpen(&sim->prof, labels, len) < 0)
+    return __pipeReject(sim, ER_OPENFILE, 0);
+  /* counts start from what already ran of the program */
+  sim->prof.mark[PROF_INSTS] = statePtr->retired;
+  sim->prof.mark[PROF_CYCLES] = statePtr->cycles;
+  sim->prof.mark[PROF_STALLS] = statePtr->stalls;
+  statePtr->prof = &sim->prof;
+  return PIPE_OK;
+}
+
+int pipeProfileWrite(pipeHandle *sim, FILE *out, int weight)
+{
+  const stateType *statePtr = &sim->state;
+  long now[PROF_WEIGHTS] = {statePtr->retired, statePtr->cycles, statePtr->stalls};
+
+  if(statePtr->prof == NULL || weight < 0 || weight >= PROF_WEIGHTS)
+    return __pipeReject(sim, ER_WRONGUSAGE, weight);
+  profCharge(statePtr->prof, now);
+  if(profWrite(statePtr->prof, out, weight) < 0 || ferror(out))
+    return __pipeReject(sim, ER_OPENFILE, fileno(out));
+  return PIPE_OK;
+}
+
+void pipeProfileClose(pipeHandle *sim)
+{
+  if(sim->state.prof == NULL)
+    return;
+  profClose(sim->state.prof);
+  sim->state.prof = NULL;
+}
+
+int pipeTimelineOpen(pipeHandle *sim, FILE *text, FILE *json, long first, long last)
+{
+  timeline *tl = &sim->tl;
+
+  if(first > last)
+    return __pipeReject(sim, ER_WRONGUSAGE, (int)first);
+  pipeTimelineClose(sim);
+  memset(tl, 0, sizeof(*tl));
+  tl->text = text;
+  tl->json = json;
+  tl->first = first;
+  tl->last = last;
+  if(text != NULL)
+    fputs("# pc instruction IF ID EX MEM WB [flush]: the cycle IF began in, the later stages"
+          " and the flush in cycles after it, - for stages never reached\n", text);
+  if(json != NULL)
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", json);
+  sim->state.tl = tl;
+  return PIPE_OK;
+}
+
+void pipeTimelineClose(pipeHandle *sim)
+{
+  timeline *tl = sim->state.tl;
+
+  if(tl == NULL)
+    return;
+  while(tl->head != tl->tail)
+    __tlWrite(tl, &tl->queue[tl->head++ % TL_QUEUE], -1, sim->state.cycles);
+  if(tl->json != NULL)
+    fputs("\n]}\n", tl->json);
+  sim->state.tl = NULL;
+}
+
+long pipeCycles(const pipeHandle *sim)
+{
+  return sim->state.cycles;
+}
+
+long pipeStalls(const pipeHandle *sim)
+{
+  return sim->state.stalls;
+}
+
+long pipeRetired(const pipeHandle *sim, long *noops)
+{
+  if(noops != NULL)
+    *noops = sim->state.retiredNoops;
+  return sim->state.retired;
+}
+
+int pipeGetPc(const pipeHandle *sim)
+{
+  return sim->state.pc;
+}
+
+int pipeGetReg(const pipeHandle *sim, int reg)
+{
+  return reg >= 0 && reg < NUMREGS ? sim->state.reg[reg] : 0;
+}
+
+int pipeSetReg(pipeHandle *sim, int reg, int data)
+{
+  if(reg < 0 || reg >= NUMREGS)
+    return __pipeReject(sim, ER_OUTOFBOUNDREG, reg);
+  if(reg == 0)
+    return __pipeReject(sim, ER_WRITEREG0, sim->state.pc);
+  sim->state.reg[reg] = data;
+  return PIPE_OK;
+}
+
+int pipeNumMemory(const pipeHandle *sim)
+{
+  return sim->state.numMemory;
+}
+
+int pipeReadMem(pipeHandle *sim, int addr, int *data)
+{
+  if(addr < 0 || addr >= sim->state.dataMem.limit)
+    return __pipeReject(sim, ER_OUTOFBOUNDMEM, addr);
+  *data = pageMemRead(&sim->state.dataMem, addr);
+  return PIPE_OK;
+}
+
+int pipeWriteMem(pipeHandle *sim, int addr, int data)
+{
+  if(addr < 0 || addr >= sim->state.dataMem.limit)
+    return __pipeReject(sim, ER_OUTOFBOUNDMEM, addr);
+  if(pageMemWrite(&sim->state.dataMem, addr, data) < 0)
+    return __pipeReject(sim, ER_OUTOFMEMORY, addr);
+  return PIPE_OK;
+}
+
+int pipeError(const pipeHandle *sim, int *data)
+{
+  if(data != NULL)
+    *data = sim->errorData;
+  return sim->error;
+}
+
+const char *pipeErrorMsg(int code)
+{
+  if(code < 0 || code >= (int)(sizeof(errorMsg) / sizeof(errorMsg[0])) || errorMsg[code] == NULL)
+    return "unknown error";
+  return errorMsg[code];
+}
+
+#ifndef LC2K_LIBRARY
+static void __printHalt(const stateType *statePtr)
+{
+  printf("machine halted\n");
+  printf("total of %d cycles executed\n", statePtr->cycles);
+  if(statePtr->width > 1)
+    printf("total of %d instructions retired (%d noops), IPC %.3f, IPC without noops %.3f\n",
+           statePtr->retired, statePtr->retiredNoops,
+           (double)statePtr->retired / statePtr->cycles,
+           (double)(statePtr->retired - statePtr->retiredNoops) / statePtr->cycles);
+}
+
+// Co-simulation
+//   project1's simulator, through its library (build/libsimulate.a), steps
+//   once for every instruction that leaves writeback, in program order,
+//   and both have to agree on its pc, the instruction word, the register
+//   it writes and the word it stores; the register files are compared
+//   once the whole bundle is written back. The first disagreement, or the
+//   first error the functional simulator raises (a write to r0 included),
+//   stops the run with both states printed. Nothing is printed per cycle,
+//   so this runs at checked-mode speed.
+static long cosimMatched;
+
+typedef struct cosimCommitStruct {
+  int pc;
+  int instr;
+  int destReg;          /* register written, 0 for none */
+  int destData;
+  int memAddr;          /* word stored, -1 for none */
+  int memData;
+} cosimCommit;
+
+static const char *__cosimName(int instr)
+{
+  const struct isaEntry *e = isaDecode(opcode(instr));
+
+  return e != NULL && e->opcode <= ISA_MAXBASEOP ? e->name : "data";
+}
+
+/* one simStep(), with what it changed read back from the handle */
+static int __cosimStep(simHandle *ref, cosimCommit *c)
+{
+  int status, writes;
+
+  c->pc = simGetPc(ref);
+  c->instr = 0;
+  c->destReg = c->destData = 0;
+  c->memAddr = -1;
+  c->memData = 0;
+  simReadMem(ref, c->pc, &c->instr);
+  if (opcode(c->instr) == OP_SW)
+    c->memAddr = (int)((unsigned)simGetReg(ref, isaRegA(c->instr)) + isaOffset(c->instr));
+  status = simStep(ref, 1);
+  if (status == SIM_ERROR)
+    return status;
+  writes = isaWrites(c->instr, ISA_EXTALL);
+  if (writes) {
+    c->destReg = __builtin_ctz(writes);
+    c->destData = simGetReg(ref, c->destReg);
+  }
+  if (c->memAddr >= 0)
+    simReadMem(ref, c->memAddr, &c->memData);
+  return status;
+}
+
+static void __cosimDiverged(const stateType *statePtr, simHandle *ref, const char *what)
+{
+  int i, data;
+
+  printf("co-simulation diverged after %ld matching instructions:\n\t%s\n",
+         cosimMatched, what);
+  printf("pipeline state:");
+  printState((stateType *)statePtr);
+  printf("functional model state:\n");
+  printf("\tpc %d\n", simGetPc(ref));
+  printf("\tmemory:\n");
+  for (i = 0; i < statePtr->numMemory; i++) {
+    data = 0;
+    simReadMem(ref, i, &data);
+    printf("\t\tmem[ %d ] %d\n", i, data);
+  }
+  printf("\tregisters:\n");
+  for (i = 0; i < NUMREGS; i++)
+    printf("\t\treg[ %d ] %d\n", i, simGetReg(ref, i));
+  exit(1);
+}
+
+/* checks one retiring MEMWB slot against the next step of the reference */
+static void __cosimRetire(const stateType *statePtr, simHandle *ref, const MEMWBType *in)
+{
+  char what[MAXLINELENGTH];
+  cosimCommit c;
+  int pc = in->pcPlus1 - 1;
+  int status, dest, code, data, storeAddr = -1;
+
+  status = __cosimStep(ref, &c);
+  if (status == SIM_ERROR) {
+    code = simError(ref, &data);
+    snprintf(what, sizeof(what), "pipeline retired %s at pc %d, functional model fails at pc %d: %s (%d)",
+             __cosimName(in->instr), pc, c.pc, simErrorMsg(code), data);
+    __cosimDiverged(statePtr, ref, what);
+  }
+  if (pc != c.pc || in->instr != c.instr) {
+    snprintf(what, sizeof(what), "pipeline retired %s (%d) at pc %d, functional model %s (%d) at pc %d",
+             __cosimName(in->instr), in->instr, pc, __cosimName(c.instr), c.instr, c.pc);
+    __cosimDiverged(statePtr, ref, what);
+  }
+  if ((status == SIM_HALTED) != (opcode(in->instr) == OP_HALT)) {
+    snprintf(what, sizeof(what), "%s at pc %d: the functional model %s", __cosimName(in->instr), pc,
+             status == SIM_HALTED ? "halts" : "does not halt");
+    __cosimDiverged(statePtr, ref, what);
+  }
+
+  dest = __destReg(statePtr, in->instr);
+  if (dest != c.destReg || (dest != 0 && in->writeData != c.destData)) {
+    snprintf(what, sizeof(what), "%s at pc %d writes reg[ %d ] %d, functional model reg[ %d ] %d",
+             __cosimName(in->instr), pc, dest, dest ? in->writeData : 0,
+             c.destReg, c.destReg ? c.destData : 0);
+    __cosimDiverged(statePtr, ref, what);
+  }
+  if (opcode(in->instr) == OP_SW)
+    storeAddr = in->aluResult;
+  if (storeAddr != c.memAddr || (storeAddr >= 0 && in->readRegB != c.memData)) {
+    snprintf(what, sizeof(what), "%s at pc %d stores mem[ %d ] %d, functional model mem[ %d ] %d",
+             __cosimName(in->instr), pc, storeAddr, storeAddr >= 0 ? in->readRegB : 0,
+             c.memAddr, c.memAddr >= 0 ? c.memData : 0);
+    __cosimDiverged(statePtr, ref, what);
+  }
+  cosimMatched++;
+}
+
+static void runCosim(stateType *prototype)
+{
+  stateType state = {0,};
+  stateType newState = {0,};
+  simHandle *ref;
+  char what[MAXLINELENGTH];
+  int *words;
+  int i;
+
+  __initState(&state, prototype);
+  /* the same address space, every instruction stepped, and the loaded words */
+  ref = simOpen(__builtin_ctzl(prototype->instrMem.limit),
+                SIM_STEPALL | (prototype->isaExt & ISA_EXTARITH ? SIM_ISAEXT : 0));
+  words = (int *)malloc((prototype->numMemory + 1) * sizeof(int));
+  if (ref == NULL || words == NULL)
+    raiseErrorMsg(ER_OPENFILE, "out of memory for the functional model");
+  for (i = 0; i < prototype->numMemory; i++)
+    words[i] = pageMemRead(&prototype->instrMem, i);
+  if (simLoad(ref, words, prototype->numMemory) != SIM_OK)
+    raiseErrorMsg(ER_OPENFILE, "out of memory for the functional model");
+  free(words);
+
+  while (1) {
+    /* the halt always sits alone in its bundle: it retires here */
+    if (__halted(&state)) {
+      for (i = 0; opcode(state.MEMWB[i].instr) != OP_HALT; i++)
+        ;
+      __cosimRetire(&state, ref, &state.MEMWB[i]);
+      break;
+    }
+    newState = state;
+    newState.cycles++;
+    fetch(&newState, &state, CHECKEDMEM);
+    decode(&newState, &state);
+    execute(&newState, &state);
+    memory(&newState, &state, CHECKEDMEM);
+    writeback(&newState, &state);
+    for (i = 0; i < state.width; i++)
+      if (state.MEMWB[i].valid)
+        __cosimRetire(&newState, ref, &state.MEMWB[i]);
+    for (i = 1; i < NUMREGS; i++) {
+      if (newState.reg[i] != simGetReg(ref, i)) {
+        snprintf(what, sizeof(what), "reg[ %d ] is %d, functional model has %d",
+                 i, newState.reg[i], simGetReg(ref, i));
+        __cosimDiverged(&newState, ref, what);
+      }
+    }
+    state = newState;
+  }
+
+  printState(&state);
+  __printHalt(&state);
+  printf("co-simulation matched the functional model on all %ld instructions\n", cosimMatched);
+  simClose(ref);
+  exit(0);
+}
+
+// Out-of-order Model
+//   Tomasulo-style core: sources are renamed through a register alias table
+//   onto reorder buffer tags, reservation stations wait per class, loads and
+//   stores go through a load-store queue and everything commits in order.
+//   Branches are predicted not taken like in the in-order pipeline and a
+//   misprediction is repaired when the branch commits, so wrong-path work
+//   never reaches the registers or the data memory.
+static const char *oooClassName[OOO_CLASSES] = {"ALU", "LD", "ST", "BR"};
+
+typedef struct robStruct {
+	int instr;
+	int pc;
+	int cls;   /* OOO_*, -1 when nothing executes */
+	int dest;  /* architectural register written, 0 for none */
+	int value; /* result, or data for stores */
+	int addr;  /* load/store address */
+	int done;
+	int taken; /* beq resolved taken: redirect at commit */
+	int fault; /* out-of-bound access, raised only if it commits */
+} robEntry;
+
+typedef struct rsStruct {
+	int busy;
+	int rob;
+	int vj, vk; /* operand values */
+	int qj, qk; /* producing ROB tags, -1 once the value is there */
+	int offset;
+	int finish; /* cycle the result is broadcast, 0 while waiting */
+} rsEntry;
+
+typedef struct oooStateStruct {
+	oooConfig cfg;
+	int width;
+	int cycles;
+	int retired;
+	int pc;
+	int fetchStopped;
+	int fetchQ[2*MAXWIDTH];
+	int fetchPc[2*MAXWIDTH];
+	int fetchCount;
+	robEntry rob[OOO_MAXSIZE];
+	int robHead, robCount;
+	rsEntry rs[OOO_CLASSES][OOO_MAXSIZE];
+	int lsq[OOO_MAXSIZE]; /* ROB tags of loads and stores in program order */
+	int lsqHead, lsqCount;
+	int rat[NUMREGS];     /* ROB tag of the youngest writer, -1 when the reg file has it */
+	long hist[OOO_CLASSES+2][OOO_MAXSIZE+1];
+} oooStateType;
+
+#define OOO_HIST_ROB (OOO_CLASSES)
+#define OOO_HIST_LSQ (OOO_CLASSES+1)
+
+static int __oooClass(int instr)
+{
+  switch(opcode(instr)){
+    case OP_ADD:
+    case OP_NOR:
+      return OOO_ALU;
+    case OP_LW:
+      return OOO_LD;
+    case OP_SW:
+      return OOO_ST;
+    case OP_BEQ:
+      return OOO_BR;
+    default:
+      return -1; /* noop, halt, and jalr/data which this pipeline ignores */
+  }
+}
+
+/* age of ROB tag `tag`, 0 for the head */
+static int __oooAge(const oooStateType *o, int tag)
+{
+  return (tag - o->robHead + o->cfg.robSize) % o->cfg.robSize;
+}
+
+static void __oooOperand(const oooStateType *o, const stateType *arch, int reg, int *v, int *q)
+{
+  int tag = o->rat[reg];
+
+  *q = -1;
+  if(reg == 0)
+    *v = 0;
+  else if(tag < 0)
+    *v = arch->reg[reg];
+  else if(o->rob[tag].done)
+    *v = o->rob[tag].value;
+  else
+    *q = tag;
+}
+
+static void __oooFlush(oooStateType *o, int pc)
+{
+  int c, i;
+
+  o->robCount = 0;
+  o->lsqCount = 0;
+  o->fetchCount = 0;
+  o->fetchStopped = 0;
+  o->pc = pc;
+  for(c = 0; c < OOO_CLASSES; c++)
+    for(i = 0; i < o->cfg.rsSize; i++)
+      o->rs[c][i].busy = 0;
+  for(i = 0; i < NUMREGS; i++)
+    o->rat[i] = -1;
+}
+
+/* returns 1 once the halt commits */
+static int __oooCommit(oooStateType *o, stateType *arch)
+{
+  robEntry *e;
+  int n, tag;
+
+  for(n = 0; n < o->width && o->robCount > 0; n++){
+    tag = o->robHead;
+    e = &o->rob[tag];
+    if(!e->done)
+      break;
+    if(e->fault)
+      raiseError(ER_OUTOFBOUNDMEM, e->addr);
+    if(isaDecode(isaOpcode(e->instr, arch->isaExt)) == NULL)
+      raiseError(ER_UNRECOGNIZE, (int)((unsigned)e->instr >> ISA_OPSHIFT));
+    if(opcode(e->instr) == OP_HALT)
+      return 1;
+    o->retired++;
+    if(e->cls == OOO_ST && pageMemWrite(&arch->dataMem, e->addr, e->value) < 0)
+      raiseError(ER_OUTOFMEMORY, e->addr);
+    if(e->dest != 0){
+      arch->reg[e->dest] = e->value;
+      if(o->rat[e->dest] == tag)
+        o->rat[e->dest] = -1;
+    }
+    if(e->cls == OOO_LD || e->cls == OOO_ST){
+      o->lsqHead = (o->lsqHead + 1) % o->cfg.lsqSize;
+      o->lsqCount--;
+    }
+    o->robHead = (o->robHead + 1) % o->cfg.robSize;
+    o->robCount--;
+    if(e->cls == OOO_BR && e->taken){
+      __oooFlush(o, e->pc + 1 + convertNum(field2(e->instr)));
+      break;
+    }
+  }
+  return 0;
+}
+
+static void __oooComplete(oooStateType *o)
+{
+  rsEntry *r, *w;
+  robEntry *e;
+  int c, i, k, c2;
+
+  for(c = 0; c < OOO_CLASSES; c++){
+    for(i = 0; i < o->cfg.rsSize; i++){
+      r = &o->rs[c][i];
+      if(!r->busy || r->finish == 0 || r->finish > o->cycles)
+        continue;
+      e = &o->rob[r->rob];
+      e->done = 1;
+      r->busy = 0;
+      if(e->dest == 0)
+        continue;
+      /* common data bus: wake up everything waiting on this tag */
+      for(c2 = 0; c2 < OOO_CLASSES; c2++){
+        for(k = 0; k < o->cfg.rsSize; k++){
+          w = &o->rs[c2][k];
+          if(!w->busy)
+            continue;
+          if(w->qj == r->rob){
+            w->vj = e->value;
+            w->qj = -1;
+          }
+          if(w->qk == r->rob){
+            w->vk = e->value;
+            w->qk = -1;
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+ * A load may go once every older store has its address; the youngest
+ * older store to the same address forwards its data. Returns 0 when the
+ * load has to wait.
+ */
+static int __oooLoad(oooStateType *o, stateType *arch, int tag, int addr)
+{
+  robEntry *e = &o->rob[tag], *s;
+  int i, fwd = -1;
+
+  for(i = 0; i < o->lsqCount; i++){
+    s = &o->rob[o->lsq[(o->lsqHead + i) % o->cfg.lsqSize]];
+    if(s == e)
+      break;
+    if(s->cls != OOO_ST)
+      continue;
+    if(!s->done)
+      return 0;
+    if(s->addr == addr)
+      fwd = s - o->rob;
+  }
+  e->addr = addr;
+  if(fwd >= 0)
+    e->value = o->rob[fwd].value;
+  else if(addr < 0 || addr >= arch->dataMem.limit)
+    e->fault = 1;
+  else
+    e->value = pageMemRead(&arch->dataMem, addr);
+  return 1;
+}
+
+static void __oooIssue(oooStateType *o, stateType *arch)
+{
+  rsEntry *r, *pick;
+  robEntry *e;
+  int c, i;
+
+  for(c = 0; c < OOO_CLASSES; c++){
+    /* oldest ready entry of each class starts executing */
+    pick = NULL;
+    for(i = 0; i < o->cfg.rsSize; i++){
+      r = &o->rs[c][i];
+      if(!r->busy || r->finish != 0 || r->qj >= 0 || r->qk >= 0)
+        continue;
+      if(pick == NULL || __oooAge(o, r->rob) < __oooAge(o, pick->rob))
+        pick = r;
+    }
+    if(pick == NULL)
+      continue;
+    e = &o->rob[pick->rob];
+    switch(opcode(e->instr)){
+      case OP_ADD:
+        e->value = (int)((unsigned)pick->vj + pick->vk);
+        break;
+      case OP_NOR:
+        e->value = ~(pick->vj | pick->vk);
+        break;
+      case OP_LW:
+        if(!__oooLoad(o, arch, pick->rob, (int)((unsigned)pick->vj + pick->offset)))
+          continue;
+        break;
+      case OP_SW:
+        e->addr = (int)((unsigned)pick->vj + pick->offset);
+        e->value = pick->vk;
+        e->fault = e->addr < 0 || e->addr >= arch->dataMem.limit;
+        break;
+      case OP_BEQ:
+        e->taken = pick->vj == pick->vk;
+        break;
+    }
+    pick->finish = o->cycles + o->cfg.latency[c];
+  }
+}
+
+static void __oooDispatch(oooStateType *o, stateType *arch)
+{
+  robEntry *e;
+  rsEntry *r = NULL;
+  int n, i, tag, instr, cls;
+
+  for(n = 0; n < o->width && o->fetchCount > 0; n++){
+    instr = o->fetchQ[0];
+    cls = o->fetchPc[0] < 0 ? -1 : __oooClass(instr);
+    if(o->robCount == o->cfg.robSize)
+      break;
+    if((cls == OOO_LD || cls == OOO_ST) && o->lsqCount == o->cfg.lsqSize)
+      break;
+    if(cls >= 0){
+      for(i = 0; i < o->cfg.rsSize && o->rs[cls][i].busy; i++)
+        ;
+      if(i == o->cfg.rsSize)
+        break;
+      r = &o->rs[cls][i];
+    }
+
+    tag = (o->robHead + o->robCount++) % o->cfg.robSize;
+    e = &o->rob[tag];
+    memset(e, 0, sizeof(*e));
+    e->instr = instr;
+    e->pc = o->fetchPc[0];
+    e->cls = cls;
+    e->dest = __destReg(arch, instr);
+    if(e->pc < 0){
+      /* fetch ran off the instruction memory */
+      e->pc = -e->pc - 1;
+      e->addr = e->pc;
+      e->fault = 1;
+      e->dest = 0;
+    }
+    if(cls < 0){
+      e->done = 1;
+    } else {
+      r->busy = 1;
+      r->rob = tag;
+      r->finish = 0;
+      r->offset = convertNum(field2(instr));
+      __oooOperand(o, arch, field0(instr), &r->vj, &r->qj);
+      r->vk = 0;
+      r->qk = -1;
+      if(cls != OOO_LD)
+        __oooOperand(o, arch, field1(instr), &r->vk, &r->qk);
+    }
+    if(cls == OOO_LD || cls == OOO_ST)
+      o->lsq[(o->lsqHead + o->lsqCount++) % o->cfg.lsqSize] = tag;
+    if(e->dest != 0)
+      o->rat[e->dest] = tag;
+
+    o->fetchCount--;
+    memmove(o->fetchQ, o->fetchQ + 1, o->fetchCount * sizeof(int));
+    memmove(o->fetchPc, o->fetchPc + 1, o->fetchCount * sizeof(int));
   }
 }
 
+static void __oooFetch(oooStateType *o, stateType *arch)
+{
+  int n;
+
+  for(n = 0; n < o->width && !o->fetchStopped && o->fetchCount < 2*o->width; n++){
+    if(o->pc < 0 || o->pc >= arch->instrMem.limit){
+      /* tagged with a negative pc, faults only if it ever commits */
+      o->fetchQ[o->fetchCount] = NOOPINSTRUCTION;
+      o->fetchPc[o->fetchCount++] = -o->pc - 1;
+      o->fetchStopped = 1;
+      break;
+    }
+    o->fetchQ[o->fetchCount] = pageMemRead(&arch->instrMem, o->pc);
+    o->fetchPc[o->fetchCount] = o->pc;
+    o->fetchStopped = opcode(o->fetchQ[o->fetchCount++]) == OP_HALT;
+    o->pc++;
+  }
+}
+
+static void __oooSample(oooStateType *o)
+{
+  int c, i, n;
+
+  for(c = 0; c < OOO_CLASSES; c++){
+    for(i = 0, n = 0; i < o->cfg.rsSize; i++)
+      n += o->rs[c][i].busy;
+    o->hist[c][n]++;
+  }
+  o->hist[OOO_HIST_ROB][o->robCount]++;
+  o->hist[OOO_HIST_LSQ][o->lsqCount]++;
+}
+
+static void __oooPrintHist(const oooStateType *o, const char *name, int h, int size)
+{
+  long sum = 0;
+  int i;
+
+  for(i = 0; i <= size; i++)
+    sum += o->hist[h][i] * i;
+  printf("\t%s occupancy (size %d, avg %.2f):", name, size, (double)sum / o->cycles);
+  for(i = 0; i <= size; i++)
+    if(o->hist[h][i])
+      printf(" %d:%ld", i, o->hist[h][i]);
+  printf("\n");
+}
+
+static void runOoO(stateType *prototype, const oooConfig *cfg)
+{
+  stateType arch = {0,};
+  oooStateType *o;
+  int c;
+
+  __initState(&arch, prototype);
+  o = (oooStateType *)calloc(1, sizeof(oooStateType));
+  o->cfg = *cfg;
+  o->width = prototype->width;
+  __oooFlush(o, 0);
+
+  /* stages run back to front so nothing flows through two of them in a cycle */
+  while(1){
+    o->cycles++;
+    if(__oooCommit(o, &arch))
+      break;
+    __oooComplete(o);
+    __oooIssue(o, &arch);
+    __oooDispatch(o, &arch);
+    __oooFetch(o, &arch);
+    __oooSample(o);
+  }
+
+  arch.cycles = o->cycles;
+  printf("\n@@@\nfinal state\n");
+  printf("\tdata memory:\n");
+  for(c = 0; c < arch.numMemory; c++)
+    printf("\t\tdataMem[ %d ] %d\n", c, pageMemRead(&arch.dataMem, c));
+  printf("\tregisters:\n");
+  for(c = 0; c < NUMREGS; c++)
+    printf("\t\treg[ %d ] %d\n", c, arch.reg[c]);
+  printf("machine halted\n");
+  printf("total of %d cycles executed\n", o->cycles);
+  printf("total of %d instructions retired, IPC %.3f\n",
+         o->retired, (double)o->retired / o->cycles);
+  __oooPrintHist(o, "ROB", OOO_HIST_ROB, o->cfg.robSize);
+  for(c = 0; c < OOO_CLASSES; c++)
+    __oooPrintHist(o, oooClassName[c], c, o->cfg.rsSize);
+  __oooPrintHist(o, "LSQ", OOO_HIST_LSQ, o->cfg.lsqSize);
+  free(o);
+  exit(0);
+}
+
+#endif /* !LC2K_LIBRARY */
+
 // Print state helper
-void
+static void
+__printLatchName(const char *name, int slot, int width)
+{
+    if (width == 1)
+	printf("\t%s:\n", name);
+    else
+	printf("\t%s[ %d ]:\n", name, slot);
+}
+
+static void
 printState(stateType *statePtr)
 {
-    int i;
+    int i, s;
     printf("\n@@@\nstate before cycle %d starts\n", statePtr->cycles);
     printf("\tpc %d\n", statePtr->pc);
 
     printf("\tdata memory:\n");
 	for (i=0; i<statePtr->numMemory; i++) {
-	    printf("\t\tdataMem[ %d ] %d\n", i, statePtr->dataMem[i]);
+	    printf("\t\tdataMem[ %d ] %d\n", i, pageMemRead(&statePtr->dataMem, i));
 	}
     printf("\tregisters:\n");
 	for (i=0; i<NUMREGS; i++) {
 	    printf("\t\treg[ %d ] %d\n", i, statePtr->reg[i]);
 	}
-    printf("\tIFID:\n");
+    for (s=0; s<statePtr->width; s++) {
+    __printLatchName("IFID", s, statePtr->width);
 	printf("\t\tinstruction ");
-	printInstruction(statePtr->IFID.instr);
-	printf("\t\tpcPlus1 %d\n", statePtr->IFID.pcPlus1);
-    printf("\tIDEX:\n");
+	printInstruction(statePtr->IFID[s].instr);
+	printf("\t\tpcPlus1 %d\n", statePtr->IFID[s].pcPlus1);
+    }
+    for (s=0; s<statePtr->width; s++) {
+    __printLatchName("IDEX", s, statePtr->width);
 	printf("\t\tinstruction ");
-	printInstruction(statePtr->IDEX.instr);
-	printf("\t\tpcPlus1 %d\n", statePtr->IDEX.pcPlus1);
-	printf("\t\treadRegA %d\n", statePtr->IDEX.readRegA);
-	printf("\t\treadRegB %d\n", statePtr->IDEX.readRegB);
-	printf("\t\toffset %d\n", statePtr->IDEX.offset);
-    printf("\tEXMEM:\n");
+	printInstruction(statePtr->IDEX[s].instr);
+	printf("\t\tpcPlus1 %d\n", statePtr->IDEX[s].pcPlus1);
+	printf("\t\treadRegA %d\n", statePtr->IDEX[s].readRegA);
+	printf("\t\treadRegB %d\n", statePtr->IDEX[s].readRegB);
+	printf("\t\toffset %d\n", statePtr->IDEX[s].offset);
+    }
+    for (s=0; s<statePtr->width; s++) {
+    __printLatchName("EXMEM", s, statePtr->width);
 	printf("\t\tinstruction ");
-	printInstruction(statePtr->EXMEM.instr);
-	printf("\t\tbranchTarget %d\n", statePtr->EXMEM.branchTarget);
-	printf("\t\taluResult %d\n", statePtr->EXMEM.aluResult);
-	printf("\t\treadRegB %d\n", statePtr->EXMEM.readRegB);
-    printf("\tMEMWB:\n");
+	printInstruction(statePtr->EXMEM[s].instr);
+	printf("\t\tbranchTarget %d\n", statePtr->EXMEM[s].branchTarget);
+	printf("\t\taluResult %d\n", statePtr->EXMEM[s].aluResult);
+	printf("\t\treadRegB %d\n", statePtr->EXMEM[s].readRegB);
+    }
+    for (s=0; s<statePtr->width; s++) {
+    __printLatchName("MEMWB", s, statePtr->width);
 	printf("\t\tinstruction ");
-	printInstruction(statePtr->MEMWB.instr);
-	printf("\t\twriteData %d\n", statePtr->MEMWB.writeData);
-    printf("\tWBEND:\n");
+	printInstruction(statePtr->MEMWB[s].instr);
+	printf("\t\twriteData %d\n", statePtr->MEMWB[s].writeData);
+    }
+    for (s=0; s<statePtr->width; s++) {
+    __printLatchName("WBEND", s, statePtr->width);
 	printf("\t\tinstruction ");
-	printInstruction(statePtr->WBEND.instr);
-	printf("\t\twriteData %d\n", statePtr->WBEND.writeData);
+	printInstruction(statePtr->WBEND[s].instr);
+	printf("\t\twriteData %d\n", statePtr->WBEND[s].writeData);
+    }
 }
 
-int
+static int
 field0(int instruction)
 {
 	return( (instruction>>19) & 0x7);
 }
 
-int
+static int
 field1(int instruction)
 {
 	return( (instruction>>16) & 0x7);
 }
 
-int
+static int
 field2(int instruction)
 {
 	return(instruction & 0xFFFF);
 }
 
-int
+static int
 opcode(int instruction)
 {
 	return(instruction>>22);
 }
 
-void
+static void
 printInstruction(int instr)
 {
-	
-	char opcodeString[10];
-	
-	if (opcode(instr) == ADD) {
-		strcpy(opcodeString, "add");
-	} else if (opcode(instr) == NOR) {
-		strcpy(opcodeString, "nor");
-	} else if (opcode(instr) == LW) {
-		strcpy(opcodeString, "lw");
-	} else if (opcode(instr) == SW) {
-		strcpy(opcodeString, "sw");
-	} else if (opcode(instr) == BEQ) {
-		strcpy(opcodeString, "beq");
-	} else if (opcode(instr) == JALR) {
-		strcpy(opcodeString, "jalr");
-	} else if (opcode(instr) == HALT) {
-		strcpy(opcodeString, "halt");
-	} else if (opcode(instr) == NOOP) {
-		strcpy(opcodeString, "noop");
-	} else {
-		strcpy(opcodeString, "data");
-    }
-    printf("%s %d %d %d\n", opcodeString, field0(instr), field1(instr),
-		field2(instr));
+	const struct isaEntry *e = isaDecode(opcode(instr));
+
+	/* the pipeline runs the base ISA and the arithmetic extension; anything else is data */
+	printf("%s %d %d %d\n",
+		e != NULL && (e->opcode <= ISA_MAXBASEOP || isaArith(e->opcode)) ? e->name : "data",
+		field0(instr), field1(instr), field2(instr));
 }
 
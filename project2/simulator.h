@@ -0,0 +1,103 @@
+/* LC-2K pipeline simulator: library interface */
+#ifndef LC2K_PIPELINE_H
+#define LC2K_PIPELINE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * simulator.c built with -DLC2K_LIBRARY (make lib: build/libpipeline.a)
+ * is the in-order pipeline without main(), co-simulation and the
+ * out-of-order model. Like the functional simulator's library, all state
+ * lives in the handle, nothing exits, and nothing is printed unless
+ * PIPE_TRACE asks for the state before every cycle. Errors come back as
+ * PIPE_ERROR, pipeError() tells which one, and runs keep failing until
+ * the next load. PIPE_FAST runs pipeRun() on guarded flat copies of the
+ * memories, from one thread at a time; the pages of the data memory it
+ * stored to are copied back when it halts.
+ */
+typedef struct pipeStruct pipeHandle;
+
+/* pipeOpen() flags */
+#define PIPE_FAST   0x1 /* pipeRun() without bounds compares */
+#define PIPE_TRACE  0x2 /* print the state before every cycle */
+#define PIPE_ISAEXT 0x4 /* run mul, div, sll and srl */
+#define PIPE_JALR   0x8 /* run jalr, resolved in MEM like a taken beq */
+
+/* results of the load and run calls */
+#define PIPE_OK      0
+#define PIPE_HALTED  1
+#define PIPE_ERROR (-1)
+
+/* NULL for an unsupported width or memory size, or out of memory */
+pipeHandle *pipeOpen(int memBits, int width, int memPorts, int flags);
+void pipeClose(pipeHandle *);
+
+/* a new program in both memories, the pipeline empty and the counters 0 */
+int pipeLoad(pipeHandle *, const int *words, int numWords);
+int pipeLoadText(pipeHandle *, const char *text, size_t len); /* machine-code file contents */
+
+/* PIPE_OK after n cycles, PIPE_HALTED once the halt reached MEMWB */
+int pipeStep(pipeHandle *, long n);
+int pipeRun(pipeHandle *);
+long pipeCycles(const pipeHandle *);
+long pipeStalls(const pipeHandle *); /* cycles decode held back an instruction */
+
+/* cycles mul and div spend in EX (3 and 10 unless set), holding the
+   stages behind them; sll and srl take one like the base ISA */
+int pipeExecCycles(pipeHandle *, int mulCycles, int divCycles);
+long pipeRetired(const pipeHandle *, long *noops);
+
+/* registers and data memory; a register write is seen from the next decode on */
+int pipeGetPc(const pipeHandle *);
+int pipeGetReg(const pipeHandle *, int reg);
+int pipeSetReg(pipeHandle *, int reg, int data);
+int pipeNumMemory(const pipeHandle *);
+int pipeReadMem(pipeHandle *, int addr, int *data);
+int pipeWriteMem(pipeHandle *, int addr, int data);
+
+/* code of the last error, its address or register in *data */
+int pipeError(const pipeHandle *, int *data);
+const char *pipeErrorMsg(int code);
+
+/*
+ * The memory-mapped console and timer of common/devices.h, in the top 16
+ * words of the data address space; the timer counts cycles. Output is
+ * drained by a writer thread and all written by pipeDevices(sim, -1),
+ * which detaches the devices, or pipeClose().
+ */
+int pipeDevices(pipeHandle *, int consoleFd);
+
+/*
+ * Call-graph profile, as simProfileOpen() in the functional simulator
+ * (common/callprof.h), that follows the jalr instructions as they retire
+ * and charges each stack its instructions, cycles and stall cycles; a
+ * cycle counts for the stack of the instructions retiring in it. Calls
+ * only run with PIPE_JALR, the project's pipeline passes jalr on as a
+ * noop. pipeProfileWrite() writes the folded stacks of one weight.
+ */
+#define PIPE_PROF_INSTS  0
+#define PIPE_PROF_CYCLES 1
+#define PIPE_PROF_STALLS 2
+
+int pipeProfileOpen(pipeHandle *, const char *labels, size_t len);
+int pipeProfileWrite(pipeHandle *, FILE *out, int weight);
+void pipeProfileClose(pipeHandle *);
+
+/*
+ * Timeline of every instruction fetched from here on: the cycle each of
+ * its stages began in, and the cycle it was flushed in if it was. text
+ * gets one line per instruction in fetch order,
+ *   pc instruction IF ID EX MEM WB [flush N]
+ * with IF absolute and the rest in cycles after it; json gets the same as
+ * Chrome trace events (chrome://tracing, Perfetto), one slice per stage
+ * with a cycle shown as a microsecond. Either may be NULL. Only the
+ * instructions fetched in cycles first to last are written, which keeps
+ * the trace of a long run small enough for a viewer. pipeTimelineClose()
+ * writes the ones still in flight and ends the JSON; the files are left
+ * open. Recording counts latch slots once a cycle and adds nothing when off.
+ */
+int pipeTimelineOpen(pipeHandle *, FILE *text, FILE *json, long first, long last);
+void pipeTimelineClose(pipeHandle *);
+
+#endif
@@ -0,0 +1,224 @@
+/* LC-2K static analyzer: control flow graph plus per-block dependency and hazard report */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../common/isa.h"
+#include "../../common/cfg.h"
+
+/*
+ * The project2 pipeline has no forwarding: registers are read in ID and
+ * written in WB, so a result can be used HAZARDWINDOW instructions later
+ * at the earliest. A closer reader gets the old value in the single-issue
+ * pipeline and stalls in the interlocked wide one. A taken beq squashes
+ * the three instructions behind it, so only fall-through edges carry a
+ * hazard from one block into the next.
+ */
+#define HAZARDWINDOW 4
+#define NUMREGS      8
+
+// Globals ///////////////////////////////////////////
+static struct cfg prog;
+static int numHazards, numStalls;
+
+// Errors ///////////////////////////////////////////
+#define ER_NONE         0
+#define ER_WRONGUSAGE   1
+#define ER_OPENFILE     2
+#define ER_MCFORMAT     3
+
+char* errorMsg[] = {
+  [ER_NONE]         "",
+  [ER_WRONGUSAGE]   "usage: analyze [-g] [-x] <machine-code-file>",
+  [ER_OPENFILE]     "error in opening file",
+  [ER_MCFORMAT]     "not a machine-code file",
+};
+
+// Functions ///////////////////////////////////////////
+void    reportBlock(int);
+void    printGraph();
+void    raiseError(int, const char*);
+
+///////////////////////////////////////////////////////////
+//                      main start                       //
+///////////////////////////////////////////////////////////
+int main(int argc, char *argv[]){
+  FILE *inFilePtr;
+  int *words, size, ext = 0, graph = 0, opt, b, pc, code = 0, edges = 0;
+
+  while((opt = getopt(argc, argv, "gx")) != -1){
+    switch(opt){
+      case 'g':
+        graph = 1;
+        break;
+      case 'x':
+        ext = ISA_EXTALL;
+        break;
+      default:
+        raiseError(ER_WRONGUSAGE, argv[0]);
+    }
+  }
+  if(argc - optind != 1){
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+
+  inFilePtr = fopen(argv[optind], "r");
+  if(inFilePtr == NULL){
+    raiseError(ER_OPENFILE, argv[optind]);
+  }
+  words = cfgLoadImage(inFilePtr, &size);
+  fclose(inFilePtr);
+  if(words == NULL){
+    raiseError(ER_MCFORMAT, argv[optind]);
+  }
+  cfgBuild(&prog, words, size, ext);
+
+  if(graph){
+    printGraph();
+  } else {
+    for(b = 0; b < prog.numBlocks; b++)
+      reportBlock(b);
+    for(pc = 0; pc < size; pc++)
+      code += prog.isCode[pc];
+    for(b = 0; b < prog.numBlocks; b++)
+      edges += (prog.blocks[b].fall != CFG_NONE) + (prog.blocks[b].taken != CFG_NONE);
+    printf("image: %d words, %d code, %d data\n", size, code, size - code);
+    printf("cfg: %d blocks, %d edges, %d indirect jumps, %d paths leaving the image\n",
+           prog.numBlocks, edges, prog.numIndirect, prog.numWild);
+    printf("hazards: %d, %d stall cycles when interlocked\n", numHazards, numStalls);
+  }
+
+  cfgFree(&prog);
+  free(words);
+  exit(0);
+}
+///////////////////////////////////////////////////////////
+//                      main end                         //
+///////////////////////////////////////////////////////////
+
+
+// Definitions ///////////////////////////////////////////
+void __printRegs(const char *title, int mask){
+  int r;
+
+  printf("  %-10s", title);
+  if(mask == 0)
+    printf(" -");
+  for(r = 1; r < NUMREGS; r++){
+    if(mask & (1 << r))
+      printf(" r%d", r);
+  }
+  printf("\n");
+}
+void __printEdge(const char *kind, int to){
+  if(to != CFG_NONE)
+    printf(", %s B%d", kind, to);
+}
+
+/* registers written in the last HAZARDWINDOW-1 words of block b, by distance from its end */
+void __tailWrites(int b, int tail[HAZARDWINDOW]){
+  const struct cfgBlock *blk = &prog.blocks[b];
+  int d;
+
+  for(d = 1; d < HAZARDWINDOW; d++){
+    tail[d] = blk->end - d >= blk->begin ?
+                isaWrites(prog.words[blk->end - d], prog.ext) : 0;
+  }
+}
+
+void reportBlock(int b){
+  const struct cfgBlock *blk = &prog.blocks[b];
+  int lastWrite[NUMREGS], depth[NUMREGS], tail[HAZARDWINDOW];
+  int liveIn = 0, defs = 0, chain = 0;
+  int pc, r, d, reads, writes, dist, n, deepest;
+  unsigned w;
+
+  printf("B%d [%d..%d] %d instructions, %d preds", b, blk->begin, blk->end - 1,
+         blk->end - blk->begin, blk->numPreds);
+  if(blk->fall == CFG_NONE && blk->taken == CFG_NONE)
+    printf(", exit");
+  __printEdge("falls to", blk->fall);
+  __printEdge("branches to", blk->taken);
+  printf("\n");
+
+  for(r = 0; r < NUMREGS; r++)
+    lastWrite[r] = -1, depth[r] = 0;
+  if(blk->fallPred != CFG_NONE)
+    __tailWrites(blk->fallPred, tail);
+  else
+    memset(tail, 0, sizeof(tail));
+
+  for(pc = blk->begin; pc < blk->end; pc++){
+    w = prog.words[pc];
+    reads = isaReads(w, prog.ext);
+    writes = isaWrites(w, prog.ext);
+    liveIn |= reads & ~defs;
+    deepest = 0;
+    for(r = 1; r < NUMREGS; r++){
+      if(!(reads & (1 << r)))
+        continue;
+      if(lastWrite[r] >= 0){
+        /* a true dependency inside the block */
+        dist = pc - lastWrite[r];
+        printf("  dep       %d -> %d r%d", lastWrite[r], pc, r);
+        if(dist < HAZARDWINDOW){
+          printf(", hazard: %d apart, needs %d", dist, HAZARDWINDOW);
+          numHazards++;
+          numStalls += HAZARDWINDOW - dist;
+        }
+        printf("\n");
+        if(depth[r] > deepest)
+          deepest = depth[r];
+        continue;
+      }
+      /* produced before the block: only the fall-through path is close enough */
+      for(d = 1, n = pc - blk->begin + 1; n + d - 1 < HAZARDWINDOW; d++){
+        dist = n + d - 1;
+        if(tail[d] & (1 << r)){
+          printf("  dep       B%d@%d -> %d r%d, hazard: %d apart, needs %d\n",
+                 blk->fallPred, prog.blocks[blk->fallPred].end - d, pc, r, dist, HAZARDWINDOW);
+          numHazards++;
+          numStalls += HAZARDWINDOW - dist;
+          break;
+        }
+      }
+    }
+    for(r = 1; r < NUMREGS; r++){
+      if(writes & (1 << r)){
+        lastWrite[r] = pc;
+        depth[r] = deepest + 1;
+        if(depth[r] > chain)
+          chain = depth[r];
+      }
+    }
+    defs |= writes;
+  }
+  __printRegs("live-in", liveIn);
+  __printRegs("writes", defs);
+  printf("  chain      %d (longest run of dependent results)\n", chain);
+}
+
+/* the cfg in Graphviz dot */
+void printGraph(){
+  const struct cfgBlock *blk;
+  int b;
+
+  printf("digraph cfg {\n  node [shape=box];\n");
+  for(b = 0; b < prog.numBlocks; b++){
+    blk = &prog.blocks[b];
+    printf("  B%d [label=\"B%d\\n%d..%d\"];\n", b, b, blk->begin, blk->end - 1);
+    if(blk->fall != CFG_NONE)
+      printf("  B%d -> B%d;\n", b, blk->fall);
+    if(blk->taken != CFG_NONE)
+      printf("  B%d -> B%d [style=dashed];\n", b, blk->taken);
+  }
+  printf("}\n");
+}
+
+///////////////////////////////////////////////////////////
+void raiseError(int code, const char msg[]){
+  fprintf(stderr, "[ERROR] %s %s\n", errorMsg[code], msg);
+  exit(1);
+}
+
+// End //////////////////////////////////////////////////////
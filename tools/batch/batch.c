@@ -0,0 +1,298 @@
+/* LC-2K batch runner: one program as many instances with different inputs */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../common/isa.h"
+#include "../../common/cfg.h"
+#include "simulate.h"
+
+/*
+ * Every instance is the same machine-code image with its own random
+ * inputs: with -r addr,len,max the words addr..addr+len-1 of instance i
+ * hold values below max drawn from the seed and i, so a run is
+ * reproducible and any instance can be rerun alone. The instances run
+ * through the batch engine of the functional simulator (simBatch*), or
+ * with -S one after another through its fast scalar run, which is the
+ * baseline the batch engine is measured against. -c runs both and
+ * compares every instance: registers, pc, memory, outcome and count.
+ */
+#define NUMREGS 8
+#define MEMBITS 16
+
+// Globals ///////////////////////////////////////////
+static int *words, numWords;
+static int inAddr, inLength, inMax;
+static unsigned long long seed = 1;
+static long maxSteps = LONG_MAX;
+static int flags;
+
+// Errors ///////////////////////////////////////////
+#define ER_NONE         0
+#define ER_WRONGUSAGE   1
+#define ER_OPENFILE     2
+#define ER_MCFORMAT     3
+#define ER_OUTOFMEMORY  4
+#define ER_MISMATCH     5
+
+char* errorMsg[] = {
+  [ER_NONE]         "",
+  [ER_WRONGUSAGE]   "usage: batch [-n instances] [-s seed] [-r addr,len,max] [-m max-instructions] [-x] [-c | -S] <machine-code-file>",
+  [ER_OPENFILE]     "error in opening file",
+  [ER_MCFORMAT]     "not a machine-code file",
+  [ER_OUTOFMEMORY]  "out of memory for instances:",
+  [ER_MISMATCH]     "batch and scalar runs differ on instance",
+};
+
+// Functions ///////////////////////////////////////////
+void    runBatch(int);
+void    runScalar(int);
+void    compare(int);
+void    raiseError(int, const char*);
+
+///////////////////////////////////////////////////////////
+//                      main start                       //
+///////////////////////////////////////////////////////////
+int main(int argc, char *argv[]){
+  FILE *inFilePtr;
+  int opt, instances = 1000, check = 0, scalar = 0;
+
+  while((opt = getopt(argc, argv, "n:s:r:m:xcS")) != -1){
+    switch(opt){
+      case 'n':
+        instances = atoi(optarg);
+        if(instances < 1)
+          raiseError(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        if(sscanf(optarg, "%d,%d,%d", &inAddr, &inLength, &inMax) != 3
+           || inAddr < 0 || inLength < 0 || inMax < 1)
+          raiseError(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'm':
+        maxSteps = atol(optarg);
+        if(maxSteps < 1)
+          raiseError(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'x':
+        flags |= SIM_ISAEXT;
+        break;
+      case 'c':
+        check = 1;
+        break;
+      case 'S':
+        scalar = 1;
+        break;
+      default:
+        raiseError(ER_WRONGUSAGE, argv[0]);
+    }
+  }
+  if(argc - optind != 1 || (check && scalar)){
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+
+  inFilePtr = fopen(argv[optind], "r");
+  if(inFilePtr == NULL){
+    raiseError(ER_OPENFILE, argv[optind]);
+  }
+  words = cfgLoadImage(inFilePtr, &numWords);
+  fclose(inFilePtr);
+  if(words == NULL || numWords > (1 << MEMBITS)){
+    raiseError(ER_MCFORMAT, argv[optind]);
+  }
+  /* inputs past the image are not written */
+  if(inAddr > numWords)
+    inAddr = numWords;
+  if(inLength > numWords - inAddr)
+    inLength = numWords - inAddr;
+
+  if(scalar)
+    runScalar(instances);
+  else
+    runBatch(instances);
+  if(check)
+    compare(instances);
+  free(words);
+  exit(0);
+}
+///////////////////////////////////////////////////////////
+//                      main end                         //
+///////////////////////////////////////////////////////////
+
+
+// Definitions ///////////////////////////////////////////
+/* xorshift64* seeded from the seed and the instance */
+static unsigned long long __inputState(int i){
+  return (seed + (unsigned long long)i) * 2654435761ull + 0x9e3779b97f4a7c15ull;
+}
+static int __input(unsigned long long *rng){
+  *rng ^= *rng >> 12;
+  *rng ^= *rng << 25;
+  *rng ^= *rng >> 27;
+  return (int)(((*rng * 2685821657736338717ull) >> 32) % (unsigned)inMax);
+}
+
+static double __seconds(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* FNV-1a over the words of one instance's result, folded into *sum */
+static void __mix(unsigned long long *sum, long v){
+  *sum = (*sum ^ (unsigned long long)v) * 1099511628211ull;
+}
+
+static void __report(const char *engine, int lanes, int instances, double seconds,
+                     long executed, int halted, int failed, unsigned long long sum){
+  printf("%s, %d lane%s: %d instances in %.3f s\n", engine, lanes, lanes > 1 ? "s" : "",
+         instances, seconds);
+  printf("%.0f instances/s, %.2f MIPS\n", instances / seconds, executed / seconds / 1e6);
+  printf("halted %d, failed %d, running %d, checksum %016llx\n",
+         halted, failed, instances - halted - failed, sum);
+  printf("total of %ld instructions executed\n", executed);
+}
+
+void runBatch(int instances){
+  simBatch *b;
+  unsigned long long rng, sum = 14695981039346656037ull;
+  long executed = 0;
+  int i, a, r, data, status, error, halted = 0, failed = 0;
+  double t0, t1;
+
+  t0 = __seconds();
+  b = simBatchOpen(words, numWords, instances, flags);
+  if(b == NULL){
+    raiseError(ER_OUTOFMEMORY, "batch");
+  }
+  for(i = 0; i < instances; i++){
+    rng = __inputState(i);
+    for(a = inAddr; a < inAddr + inLength; a++)
+      simBatchWriteMem(b, i, a, __input(&rng));
+  }
+  simBatchRun(b, maxSteps);
+  t1 = __seconds();
+
+  for(i = 0; i < instances; i++){
+    status = simBatchStatus(b, i, &error, &data);
+    halted += status == SIM_HALTED;
+    failed += status == SIM_ERROR;
+    executed += simBatchExecuted(b, i);
+    __mix(&sum, status == SIM_ERROR ? error : status);
+    __mix(&sum, simBatchGetPc(b, i));
+    for(r = 0; r < NUMREGS; r++)
+      __mix(&sum, simBatchGetReg(b, i, r));
+    for(a = 0; a < numWords; a++){
+      simBatchReadMem(b, i, a, &data);
+      __mix(&sum, data);
+    }
+  }
+  __report("batch", simBatchLanes(b), instances, t1 - t0, executed, halted, failed, sum);
+  simBatchClose(b);
+}
+
+/* runs instance i alone on sim; its outcome as simBatchStatus() has it */
+static int __runOne(simHandle *sim, int i, int *error){
+  unsigned long long rng = __inputState(i);
+  int a, status;
+
+  simLoad(sim, words, numWords);
+  for(a = inAddr; a < inAddr + inLength; a++)
+    simWriteMem(sim, a, __input(&rng));
+  status = maxSteps == LONG_MAX ? simRun(sim) : simStep(sim, maxSteps);
+  *error = simError(sim, NULL);
+  return status;
+}
+
+void runScalar(int instances){
+  simHandle *sim;
+  unsigned long long sum = 14695981039346656037ull;
+  long executed = 0;
+  int i, a, r, data, status, error, halted = 0, failed = 0;
+  double t0, t1, seconds = 0;
+
+  sim = simOpen(MEMBITS, flags | SIM_FAST);
+  if(sim == NULL){
+    raiseError(ER_OUTOFMEMORY, "scalar");
+  }
+  /* only the runs are timed, the checksum reads are not */
+  for(i = 0; i < instances; i++){
+    t0 = __seconds();
+    status = __runOne(sim, i, &error);
+    t1 = __seconds();
+    seconds += t1 - t0;
+    halted += status == SIM_HALTED;
+    failed += status == SIM_ERROR;
+    executed += simExecuted(sim);
+    __mix(&sum, status == SIM_ERROR ? error : status);
+    __mix(&sum, simGetPc(sim));
+    for(r = 0; r < NUMREGS; r++)
+      __mix(&sum, simGetReg(sim, r));
+    for(a = 0; a < numWords; a++){
+      simReadMem(sim, a, &data);
+      __mix(&sum, data);
+    }
+  }
+  __report("scalar", 1, instances, seconds, executed, halted, failed, sum);
+  simClose(sim);
+}
+
+void compare(int instances){
+  simBatch *b;
+  simHandle *sim;
+  unsigned long long rng;
+  char what[64];
+  int i, a, r, status, error, data, batchStatus, batchError, batchData;
+
+  b = simBatchOpen(words, numWords, instances, flags);
+  sim = simOpen(MEMBITS, flags | SIM_FAST);
+  if(b == NULL || sim == NULL){
+    raiseError(ER_OUTOFMEMORY, "compare");
+  }
+  for(i = 0; i < instances; i++){
+    rng = __inputState(i);
+    for(a = inAddr; a < inAddr + inLength; a++)
+      simBatchWriteMem(b, i, a, __input(&rng));
+  }
+  simBatchRun(b, maxSteps);
+
+  for(i = 0; i < instances; i++){
+    status = __runOne(sim, i, &error);
+    batchStatus = simBatchStatus(b, i, &batchError, &batchData);
+    what[0] = '\0';
+    if(status != batchStatus || (status == SIM_ERROR && error != batchError))
+      sprintf(what, "%d: outcome", i);
+    else if(simExecuted(sim) != simBatchExecuted(b, i))
+      sprintf(what, "%d: instructions executed", i);
+    else if(simGetPc(sim) != simBatchGetPc(b, i))
+      sprintf(what, "%d: pc", i);
+    for(r = 0; r < NUMREGS && what[0] == '\0'; r++)
+      if(simGetReg(sim, r) != simBatchGetReg(b, i, r))
+        sprintf(what, "%d: reg[%d]", i, r);
+    for(a = 0; a < numWords && what[0] == '\0'; a++){
+      simReadMem(sim, a, &data);
+      simBatchReadMem(b, i, a, &batchData);
+      if(data != batchData)
+        sprintf(what, "%d: mem[%d]", i, a);
+    }
+    if(what[0] != '\0'){
+      raiseError(ER_MISMATCH, what);
+    }
+  }
+  printf("all %d instances match the scalar simulator\n", instances);
+  simClose(sim);
+  simBatchClose(b);
+}
+
+void raiseError(int code, const char msg[]){
+  fprintf(stderr, "[ERROR] %s %s\n", errorMsg[code], msg);
+  exit(1);
+}
+
+// End //////////////////////////////////////////////////////
@@ -0,0 +1,239 @@
+/* LC-2K disassembler: turns a machine-code file back into assembly `assemble` accepts */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../common/isa.h"
+#include "../../common/cfg.h"
+
+#define MAXLABELADDR 99999  /* L00000..L99999 fit the 6-character labels */
+#define LINEBYTES    64     /* longest line we ever format */
+
+// Globals ///////////////////////////////////////////
+static struct cfg prog;
+static unsigned char *labeled; /* 1 when some instruction names the address */
+static int showAddress;
+
+// Errors ///////////////////////////////////////////
+#define ER_NONE         0
+#define ER_WRONGUSAGE   1
+#define ER_OPENFILE     2
+#define ER_MCFORMAT     3
+
+char* errorMsg[] = {
+  [ER_NONE]         "",
+  [ER_WRONGUSAGE]   "usage: disassemble [-a] [-x] <machine-code-file> [assembly-file]",
+  [ER_OPENFILE]     "error in opening file",
+  [ER_MCFORMAT]     "not a machine-code file",
+};
+
+// Functions ///////////////////////////////////////////
+void    findLabels();
+char*   disassemble(char*, int);
+void    raiseError(int, const char*);
+
+///////////////////////////////////////////////////////////
+//                      main start                       //
+///////////////////////////////////////////////////////////
+int main(int argc, char *argv[]){
+  FILE *inFilePtr, *outFilePtr = stdout;
+  int *words, size, ext = 0, opt, pc;
+  char *buf, *p;
+
+  while((opt = getopt(argc, argv, "ax")) != -1){
+    switch(opt){
+      case 'a':
+        showAddress = 1;
+        break;
+      case 'x':
+        ext = ISA_EXTALL;
+        break;
+      default:
+        raiseError(ER_WRONGUSAGE, argv[0]);
+    }
+  }
+  if(argc - optind != 1 && argc - optind != 2){
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+
+  inFilePtr = fopen(argv[optind], "r");
+  if(inFilePtr == NULL){
+    raiseError(ER_OPENFILE, argv[optind]);
+  }
+  words = cfgLoadImage(inFilePtr, &size);
+  fclose(inFilePtr);
+  if(words == NULL){
+    raiseError(ER_MCFORMAT, argv[optind]);
+  }
+  if(argc - optind == 2){
+    outFilePtr = fopen(argv[optind+1], "w");
+    if(outFilePtr == NULL){
+      raiseError(ER_OPENFILE, argv[optind+1]);
+    }
+  }
+
+  // 1. Tell code from data, then name every address something refers to
+  cfgBuild(&prog, words, size, ext);
+  findLabels();
+
+  // 2. One line per word into a single buffer, written at once
+  buf = (char*)malloc((size_t)size * LINEBYTES + 1);
+  for(p = buf, pc = 0; pc < size; pc++)
+    p = disassemble(p, pc);
+  fwrite(buf, 1, p - buf, outFilePtr);
+  if(outFilePtr != stdout)
+    fclose(outFilePtr);
+
+  free(buf);
+  free(labeled);
+  cfgFree(&prog);
+  free(words);
+  exit(0);
+}
+///////////////////////////////////////////////////////////
+//                      main end                         //
+///////////////////////////////////////////////////////////
+
+
+// Definitions ///////////////////////////////////////////
+/* the word re-encoded from its fields: anything else does not round-trip */
+int __canonical(unsigned w){
+  const struct isaEntry *e = isaDecode(isaOpcode(w, prog.ext));
+  unsigned op = (unsigned)e->opcode << ISA_OPSHIFT;
+
+  switch(e->format){
+    case RTYPE:
+      return w == (op | (isaRegA(w) << 19) | (isaRegB(w) << 16) | isaDest(w));
+    case ITYPE:
+      return w == isaEncode(e->opcode, isaRegA(w), isaRegB(w), isaOffset(w));
+    case JTYPE:
+      return w == (op | (isaRegA(w) << 19) | (isaRegB(w) << 16));
+    default:
+      return w == op;
+  }
+}
+int __isInstruction(int pc){
+  return prog.isCode[pc] && __canonical((unsigned)prog.words[pc]);
+}
+int __nameable(int addr){
+  return addr >= 0 && addr < prog.size && addr <= MAXLABELADDR;
+}
+
+void findLabels(){
+  unsigned w;
+  int pc, op, target;
+
+  labeled = (unsigned char*)calloc(prog.size + 1, 1);
+  for(pc = 0; pc < prog.size; pc++){
+    if(!__isInstruction(pc))
+      continue;
+    w = prog.words[pc];
+    op = isaOpcode(w, prog.ext);
+    if(op == OP_BEQ){
+      target = pc + 1 + isaOffset(w);
+      if(__nameable(target))
+        labeled[target] = 1;
+    } else if((op == OP_LW || op == OP_SW || op == OP_SWAP) && isaRegA(w) == 0){
+      /* absolute data addresses only; base + offset stays a number */
+      target = isaOffset(w);
+      if(__nameable(target) && !prog.isCode[target])
+        labeled[target] = 1;
+    }
+  }
+}
+
+char* __putInt(char *p, int v){
+  char digits[12];
+  unsigned u = v < 0 ? -(unsigned)v : (unsigned)v;
+  int n = 0;
+
+  if(v < 0)
+    *p++ = '-';
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while(u != 0);
+  while(n > 0)
+    *p++ = digits[--n];
+  return p;
+}
+char* __putStr(char *p, const char *s){
+  while(*s)
+    *p++ = *s++;
+  return p;
+}
+char* __putLabel(char *p, int addr){
+  int i;
+
+  *p++ = prog.isCode[addr] ? 'L' : 'D';
+  for(i = 10000; i > 0; i /= 10)
+    *p++ = '0' + addr / i % 10;
+  return p;
+}
+
+/* formats word pc as one line of assembly at p and returns the end of it */
+char* disassemble(char *p, int pc){
+  const struct isaEntry *e;
+  char *start = p;
+  unsigned w = prog.words[pc];
+  int target;
+
+  if(labeled[pc])
+    p = __putLabel(p, pc);
+  do {
+    *p++ = ' ';
+  } while(p - start < 8);
+
+  if(!__isInstruction(pc)){
+    p = __putStr(p, ".fill ");
+    p = __putInt(p, (int)w);
+  } else {
+    e = isaDecode(isaOpcode(w, prog.ext));
+    p = __putStr(p, e->name);
+    switch(e->format){
+      case RTYPE:
+        *p++ = ' ';
+        p = __putInt(p, isaRegA(w));
+        *p++ = ' ';
+        p = __putInt(p, isaRegB(w));
+        *p++ = ' ';
+        p = __putInt(p, isaDest(w));
+        break;
+      case ITYPE:
+        *p++ = ' ';
+        p = __putInt(p, isaRegA(w));
+        *p++ = ' ';
+        p = __putInt(p, isaRegB(w));
+        *p++ = ' ';
+        target = e->opcode == OP_BEQ ? pc + 1 + isaOffset(w) : isaOffset(w);
+        if((e->opcode == OP_BEQ || isaRegA(w) == 0)
+           && __nameable(target) && labeled[target])
+          p = __putLabel(p, target);
+        else
+          p = __putInt(p, isaOffset(w));
+        break;
+      case JTYPE:
+        *p++ = ' ';
+        p = __putInt(p, isaRegA(w));
+        *p++ = ' ';
+        p = __putInt(p, isaRegB(w));
+        break;
+      case OTYPE:
+        break;
+    }
+  }
+  if(showAddress){
+    p = __putStr(p, "\t\t");
+    p = __putInt(p, pc);
+  }
+  *p++ = '\n';
+  return p;
+}
+
+///////////////////////////////////////////////////////////
+void raiseError(int code, const char msg[]){
+  fprintf(stderr, "[ERROR] %s %s\n", errorMsg[code], msg);
+  exit(1);
+}
+
+// End //////////////////////////////////////////////////////
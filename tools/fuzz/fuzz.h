@@ -0,0 +1,104 @@
+/* In-process fuzzing of the LC-2K tools: shared harness support */
+#ifndef LC2K_FUZZ_H
+#define LC2K_FUZZ_H
+
+#define _GNU_SOURCE     /* memmem, fmemopen */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+
+/*
+ * A harness includes the tool it fuzzes as source. The simulators are
+ * built with LC2K_LIBRARY and driven through their library interface,
+ * which reports errors as codes; the assembler has main renamed and exit()
+ * turned into a jump back into the harness, since every one of its error
+ * paths ends in exit() and an input it rejects is not a crash.
+ * Built with libFuzzer:
+ *   clang -g -O1 -fsanitize=fuzzer,address tools/fuzz/fuzzAssemble.c -lpthread
+ * Built with -DFUZZ_STANDALONE instead, main() runs the harness once per
+ * file named on the command line, which replays a crash or runs over a
+ * corpus from tools/generator:
+ *   gcc -g -fsanitize=address -DFUZZ_STANDALONE tools/fuzz/fuzzAssemble.c -lpthread
+ * Tool output goes to /dev/null, error messages still go to stderr.
+ */
+#define FUZZMAXWORDS (1 << 16)  /* words of a machine-code input */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static jmp_buf fuzzTrap;
+static int fuzzArmed;   /* exit() jumps to fuzzTrap instead of exiting */
+
+static __attribute__((noreturn)) void fuzzExit(int code)
+{
+  if (fuzzArmed) {
+    fuzzArmed = 0;
+    longjmp(fuzzTrap, 1);
+  }
+  exit(code);
+}
+#define exit(code) fuzzExit(code)
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+  (void)argc;
+  (void)argv;
+  if (freopen("/dev/null", "w", stdout) == NULL)
+    return -1;
+  return 0;
+}
+
+/* parses a machine-code input, one decimal word per line; -1 when it is not one */
+static inline int fuzzWords(const uint8_t *data, size_t size, int *words)
+{
+  char *text, *line, *end;
+  int n = 0;
+
+  text = (char *)malloc(size + 1);
+  memcpy(text, data, size);
+  text[size] = '\0';
+  for (line = text; *line != '\0' && n < FUZZMAXWORDS; line = end) {
+    words[n++] = (int)strtol(line, &end, 10);
+    if (end == line || (*end != '\n' && *end != '\0')) {
+      n = -1;
+      break;
+    }
+    if (*end == '\n')
+      end++;
+  }
+  free(text);
+  return n;
+}
+
+#ifdef FUZZ_STANDALONE
+static int fuzzMain(int argc, char *argv[])
+{
+  FILE *fp;
+  uint8_t *buf;
+  long size;
+  int i;
+
+  LLVMFuzzerInitialize(&argc, &argv);
+  for (i = 1; i < argc; i++) {
+    fp = fopen(argv[i], "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "[ERROR] error in opening file %s\n", argv[i]);
+      return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    buf = (uint8_t *)malloc(size + 1);
+    if (fread(buf, 1, size, fp) != (size_t)size)
+      size = 0;
+    fclose(fp);
+    LLVMFuzzerTestOneInput(buf, size);
+    free(buf);
+    fprintf(stderr, "%s: done\n", argv[i]);
+  }
+  return 0;
+}
+#endif
+
+#endif
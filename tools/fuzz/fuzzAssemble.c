@@ -0,0 +1,61 @@
+/* Fuzz harness: the assembler's parser and both passes, on one input file */
+#include "fuzz.h"
+#define main assembleMain
+#include "../../project1/assembler/assemble.c"
+#undef main
+
+/*
+ * The input is an assembly file. Its length picks one of four runs, so
+ * a corpus exercises them all: stop at the first error, collect errors
+ * as with -e, or go on through the optimizer (-O) or scheduler (-S).
+ * .include is refused, it would read whatever file the input names.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+  static FILE *sink;
+  FILE *inFilePtr;
+  int mode = size % 4, i;
+
+  if(size == 0 || memmem(data, size, ".include", 8) != NULL)
+    return 0;
+  if(sink == NULL)
+    sink = fopen("/dev/null", "w");
+  inFilePtr = fmemopen((void*)data, size, "r");
+  if(inFilePtr == NULL)
+    return 0;
+
+  maxErrors = mode == 1 ? MAXINT16 : 0;
+  numErrors = 0;
+  fuzzArmed = 1;
+  if(setjmp(fuzzTrap) == 0){
+    readProgram(inFilePtr, "fuzz.as");
+    translateProgram(0, mode < 2);
+    if(mode < 2){
+      writeTranslation(sink);
+    } else if(mode == 2){
+      optimize(sink);
+    } else {
+      schedule(sink);
+    }
+  }
+  fuzzArmed = 0;
+  fclose(inFilePtr);
+
+  /* whatever an exit left behind */
+  if(chunks != NULL){
+    for(i = 0; i < numChunks; i++){
+      free(chunks[i].text);
+      free(chunks[i].errors);
+    }
+    free(chunks);
+    chunks = NULL;
+  }
+  freeProgram();
+  freeSymbols();
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char *argv[]){
+  return fuzzMain(argc, argv);
+}
+#endif
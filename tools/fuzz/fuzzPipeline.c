@@ -0,0 +1,39 @@
+/* Fuzz harness: the project2 pipeline simulator, on one machine-code input */
+#include "fuzz.h"
+#define LC2K_LIBRARY /* the engine and its library interface, no main() */
+#include "../../project2/simulator.c"
+
+#define FUZZMEMBITS 16
+#define FUZZCYCLES  100000
+
+/*
+ * The input is a machine-code file. Each one runs through the library
+ * interface, once single-issue and once 4-wide with two memory ports, for
+ * at most FUZZCYCLES cycles; errors have to come back as error codes.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static pipeHandle *sim[2];
+  static int words[FUZZMAXWORDS];
+  int i, n;
+
+  if ((n = fuzzWords(data, size, words)) <= 0)
+    return 0;
+  if (sim[0] == NULL) {
+    sim[0] = pipeOpen(FUZZMEMBITS, 1, 1, 0);
+    sim[1] = pipeOpen(FUZZMEMBITS, 4, 2, 0);
+  }
+  for (i = 0; i < 2; i++) {
+    if (pipeLoad(sim[i], words, n) == PIPE_OK)
+      pipeStep(sim[i], FUZZCYCLES);
+    printState(&sim[i]->state);
+  }
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char *argv[])
+{
+  return fuzzMain(argc, argv);
+}
+#endif
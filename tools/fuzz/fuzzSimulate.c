@@ -0,0 +1,54 @@
+/* Fuzz harness: the functional simulator, on one machine-code input */
+#include "fuzz.h"
+#define LC2K_LIBRARY /* the engine and its library interface, no main() */
+#include "../../project1/simulator/simulate.c"
+
+#define FUZZMEMBITS 16
+#define FUZZSTEPS   100000 /* generated programs halt well before this */
+
+/*
+ * The input is a machine-code file, so assembled programs from
+ * tools/generator make a corpus as they are. It runs through the library
+ * interface, which must come back with an error code rather than exit, cut
+ * off after FUZZSTEPS instructions since a random input need not halt.
+ * Odd-length inputs decode the extension opcodes. Every input also runs
+ * with SIM_STEPALL, and a skipped loop that leaves a different machine
+ * behind aborts.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static simHandle *sim[2], *ref[2];
+  static int words[FUZZMAXWORDS];
+  int n, i, r, a, b, ext = size & 1;
+
+  if ((n = fuzzWords(data, size, words)) <= 0)
+    return 0;
+  if (sim[ext] == NULL) {
+    sim[ext] = simOpen(FUZZMEMBITS, ext ? SIM_ISAEXT : 0);
+    ref[ext] = simOpen(FUZZMEMBITS, (ext ? SIM_ISAEXT : 0) | SIM_STEPALL);
+  }
+  if (simLoad(sim[ext], words, n) == SIM_OK) {
+    simLoad(ref[ext], words, n);
+    r = simStep(sim[ext], FUZZSTEPS);
+    if (r != simStep(ref[ext], FUZZSTEPS)
+        || (r == SIM_ERROR && simError(sim[ext], NULL) != simError(ref[ext], NULL))
+        || simExecuted(sim[ext]) != simExecuted(ref[ext])
+        || simGetPc(sim[ext]) != simGetPc(ref[ext]))
+      abort();
+    for (i = 0; i < NUMREGS; i++)
+      if (simGetReg(sim[ext], i) != simGetReg(ref[ext], i))
+        abort();
+    for (i = 0; simReadMem(sim[ext], i, &a) == SIM_OK; i++)
+      if (simReadMem(ref[ext], i, &b) != SIM_OK || a != b)
+        abort();
+  }
+  printState(&sim[ext]->state);
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char *argv[])
+{
+  return fuzzMain(argc, argv);
+}
+#endif
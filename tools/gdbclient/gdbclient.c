@@ -0,0 +1,171 @@
+/* LC-2K gdb client: a scripted session against the stub of `simulate -g` */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Reads a session from stdin, one exchange per line:
+ *
+ *   packet  expected-reply
+ *
+ * Each packet is framed, checksummed and sent, the reply is acknowledged
+ * and compared with what the line expects: the reply itself, "-" for an
+ * empty one, or a prefix ending in "*". Blank lines and lines starting
+ * with '#' are skipped. Every exchange is echoed as it happens; the
+ * first mismatch ends the session with status 1. The address is a port
+ * on the loopback interface or a unix socket path, as given to -g, and
+ * the client keeps trying to connect for a few seconds so the simulator
+ * can be started just before it.
+ */
+#define BUFSIZE      4096
+#define CONNECTTRIES 50 /* 100ms apart */
+
+// Globals ///////////////////////////////////////////
+static int fd;
+
+// Errors ///////////////////////////////////////////
+#define ER_NONE         0
+#define ER_WRONGUSAGE   1
+#define ER_CONNECT      2
+#define ER_PROTOCOL     3
+#define ER_MISMATCH     4
+
+char* errorMsg[] = {
+  [ER_NONE]         "",
+  [ER_WRONGUSAGE]   "usage: gdbclient <port|socket-path> < session",
+  [ER_CONNECT]      "cannot connect to",
+  [ER_PROTOCOL]     "connection closed or malformed reply to",
+  [ER_MISMATCH]     "unexpected reply to",
+};
+
+// Functions ///////////////////////////////////////////
+int     connectStub(const char*);
+void    sendPacket(const char*);
+void    recvPacket(char*, const char*);
+int     matches(const char*, const char*);
+void    raiseError(int, const char*);
+
+///////////////////////////////////////////////////////////
+//                      main start                       //
+///////////////////////////////////////////////////////////
+int main(int argc, char *argv[]){
+  char line[BUFSIZE], pkt[BUFSIZE], expect[BUFSIZE], reply[BUFSIZE];
+  int n;
+
+  if(argc != 2)
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  fd = connectStub(argv[1]);
+  if(fd < 0)
+    raiseError(ER_CONNECT, argv[1]);
+
+  while(fgets(line, sizeof(line), stdin) != NULL){
+    n = sscanf(line, "%4095s %4095s", pkt, expect);
+    if(n < 1 || pkt[0] == '#')
+      continue;
+    if(n < 2)
+      strcpy(expect, "*");
+    sendPacket(pkt);
+    recvPacket(reply, pkt);
+    printf("%-24s %s\n", pkt, reply[0] ? reply : "-");
+    if(!matches(reply, expect))
+      raiseError(ER_MISMATCH, pkt);
+  }
+  close(fd);
+  return 0;
+}
+///////////////////////////////////////////////////////////
+//                      main end                         //
+///////////////////////////////////////////////////////////
+
+int connectStub(const char *addr){
+  struct timespec wait = {0, 100000000};
+  struct sockaddr_in in = {0,};
+  struct sockaddr_un un = {0,};
+  struct sockaddr *sa;
+  socklen_t len;
+  char *end;
+  long port = strtol(addr, &end, 10);
+  int s, i;
+
+  if(*addr != '\0' && *end == '\0'){
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa = (struct sockaddr*)&in;
+    len = sizeof(in);
+  } else {
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, addr, sizeof(un.sun_path)-1);
+    sa = (struct sockaddr*)&un;
+    len = sizeof(un);
+  }
+  for(i = 0; i < CONNECTTRIES; i++){
+    s = socket(sa->sa_family, SOCK_STREAM, 0);
+    if(s < 0)
+      return -1;
+    if(connect(s, sa, len) == 0)
+      return s;
+    close(s);
+    nanosleep(&wait, NULL);
+  }
+  return -1;
+}
+int __getc(){
+  unsigned char c;
+
+  return read(fd, &c, 1) == 1 ? c : -1;
+}
+/* $packet#checksum, until the stub acknowledges it with '+' */
+void sendPacket(const char *pkt){
+  char frame[BUFSIZE + 4];
+  unsigned char sum = 0;
+  const char *p;
+  int c;
+
+  for(p = pkt; *p; p++)
+    sum += (unsigned char)*p;
+  snprintf(frame, sizeof(frame), "$%s#%02x", pkt, sum);
+  do {
+    if(write(fd, frame, strlen(frame)) != (ssize_t)strlen(frame))
+      raiseError(ER_PROTOCOL, pkt);
+    c = __getc();
+  } while(c == '-');
+  if(c != '+')
+    raiseError(ER_PROTOCOL, pkt);
+}
+void recvPacket(char *reply, const char *pkt){
+  int c, len = 0;
+
+  while((c = __getc()) != '$')
+    if(c < 0)
+      raiseError(ER_PROTOCOL, pkt);
+  while((c = __getc()) != '#'){
+    if(c < 0 || len == BUFSIZE - 1)
+      raiseError(ER_PROTOCOL, pkt);
+    reply[len++] = c;
+  }
+  reply[len] = '\0';
+  if(__getc() < 0 || __getc() < 0)
+    raiseError(ER_PROTOCOL, pkt);
+  if(write(fd, "+", 1) != 1)
+    raiseError(ER_PROTOCOL, pkt);
+}
+int matches(const char *reply, const char *expect){
+  size_t n = strlen(expect);
+
+  if(!strcmp(expect, "-"))
+    return reply[0] == '\0';
+  if(n > 0 && expect[n-1] == '*')
+    return !strncmp(reply, expect, n-1);
+  return !strcmp(reply, expect);
+}
+void raiseError(int code, const char *detail){
+  fprintf(stderr, "[ERROR] %s %s\n", errorMsg[code], detail);
+  exit(1);
+}
@@ -0,0 +1,377 @@
+/* LC-2K program generator: random, valid programs that always halt */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Programs are built from nested blocks. A block is straight-line code
+ * with forward beqs to labels later in the same block, and counted loops
+ * as blocks of their own:
+ *
+ *           lw    0 c  Tk      ; Tk holds k, 1 <= k <= MAXTRIP
+ *   Ln      <body block>
+ *           add   c 6  c       ; r6 holds -1
+ *           beq   c 0  1
+ *           beq   0 0  Ln
+ *
+ * Only loop tails branch backwards and only they write the counters, so
+ * every program halts after at most MAXTRIP^MAXDEPTH times its length.
+ * The data area comes first, behind a jump to the code, so that lw and
+ * sw reach all of it with an absolute 16-bit offset however long the
+ * code is. They only address its scratch words: never code, trip counts
+ * or r6's -1. Forward branches land within MAXFORWARD statements. The
+ * `arith` profile also uses mul, div, sll and srl (run them with -x).
+ */
+#define MAXDEPTH   2
+#define MAXTRIP    8
+#define MAXBODY    64   /* statements in one loop body */
+#define MAXFORWARD 256  /* statements a forward beq may skip, about */
+#define MAXDATA    30000
+#define DATAREGS   4    /* r1..r4 hold data */
+#define NEGREG     6
+#define LABELBASE  36   /* labels are a letter and up to 5 base-36 digits */
+
+// Types ///////////////////////////////////////////
+enum kind {K_ADD, K_NOR, K_LW, K_SW, K_BEQ, K_NOOP, K_ARITH, NUMKINDS};
+
+struct profile{
+  const char *name;
+  int weight[NUMKINDS];
+  int loopPct;    /* chance a statement starts a loop instead */
+  int labelPct;   /* chance a statement gets a label of its own */
+  int hazardPct;  /* chance a source is one of the last results */
+  int dataRatio;  /* instructions per data word */
+};
+
+// Globals ///////////////////////////////////////////
+static const struct profile profiles[] = {
+  /*               add nor lw  sw  beq noop ext  loop label hazard data */
+  {"mix",       {  30, 10, 20, 10, 10,  5,  0 },   2,    0,    10,   8 },
+  {"labels",    {  20,  5, 25, 15, 30,  5,  0 },   3,  100,    10,   2 },
+  {"hazards",   {  40, 15, 20, 10,  5,  0,  0 },   2,    0,    90,  16 },
+  {"arith",     {  15,  5, 15, 10, 10,  0, 30 },   2,    0,    50,   8 },
+};
+static struct profile prof;
+static FILE *out, *code;   /* code is generated first, then written behind the data */
+static char *codeText;
+static size_t codeLength;
+static unsigned long long rng;
+static int emitted;
+static int numLoops, numForward, numCode, numData;
+static int recent[3];                 /* data registers written last */
+static char nextLabel[8];             /* label for the next statement */
+
+// Errors ///////////////////////////////////////////
+#define ER_NONE         0
+#define ER_WRONGUSAGE   1
+#define ER_OPENFILE     2
+
+char* errorMsg[] = {
+  [ER_NONE]         "",
+  [ER_WRONGUSAGE]   "usage: generate [-n instructions] [-s seed] [-p mix|labels|hazards|arith] [-w add,nor,lw,sw,beq,noop[,ext]] [assembly-file]",
+  [ER_OPENFILE]     "error in opening file",
+};
+
+// Functions ///////////////////////////////////////////
+void    genCode(int);
+void    genBlock(int, int);
+void    genData();
+void    raiseError(int, const char*);
+
+///////////////////////////////////////////////////////////
+//                      main start                       //
+///////////////////////////////////////////////////////////
+int main(int argc, char *argv[]){
+  const char *profileName = "mix";
+  int *w, opt, i, size = 100, custom = 0, weights[NUMKINDS];
+  unsigned long long seed = 1;
+
+  while((opt = getopt(argc, argv, "n:p:s:w:")) != -1){
+    switch(opt){
+      case 'n':
+        size = atoi(optarg);
+        if(size < 1)
+          raiseError(ER_WRONGUSAGE, argv[0]);
+        break;
+      case 'p':
+        profileName = optarg;
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'w':
+        w = weights;
+        w[K_ARITH] = 0;
+        custom = sscanf(optarg, "%d,%d,%d,%d,%d,%d,%d", w, w+1, w+2, w+3, w+4, w+5, w+6) >= NUMKINDS - 1;
+        for(i = 0; custom && i < NUMKINDS; i++)
+          custom = weights[i] >= 0;
+        if(!custom)
+          raiseError(ER_WRONGUSAGE, argv[0]);
+        break;
+      default:
+        raiseError(ER_WRONGUSAGE, argv[0]);
+    }
+  }
+  if(argc - optind > 1){
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+  for(i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++){
+    if(!strcmp(profiles[i].name, profileName))
+      break;
+  }
+  if(i == (int)(sizeof(profiles) / sizeof(profiles[0]))){
+    raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+  prof = profiles[i];
+  if(custom){
+    memcpy(prof.weight, weights, sizeof(weights));
+    for(i = 0; i < NUMKINDS && weights[i] == 0; i++)
+      ;
+    if(i == NUMKINDS)
+      raiseError(ER_WRONGUSAGE, argv[0]);
+  }
+
+  out = stdout;
+  if(argc - optind == 1){
+    out = fopen(argv[optind], "w");
+    if(out == NULL){
+      raiseError(ER_OPENFILE, argv[optind]);
+    }
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 16);
+  rng = seed * 2654435761ull + 0x9e3779b97f4a7c15ull;
+  numData = size / prof.dataRatio + 1;
+  if(numData > MAXDATA)
+    numData = MAXDATA;
+
+  code = open_memstream(&codeText, &codeLength);
+  genCode(size);
+  fclose(code);
+
+  fprintf(out, "        beq     0       0       start\n");
+  genData();
+  fwrite(codeText, 1, codeLength, out);
+  free(codeText);
+  if(out != stdout)
+    fclose(out);
+  exit(0);
+}
+///////////////////////////////////////////////////////////
+//                      main end                         //
+///////////////////////////////////////////////////////////
+
+
+// Definitions ///////////////////////////////////////////
+/* xorshift64*: the same program for the same seed everywhere */
+unsigned __random(){
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (unsigned)((rng * 2685821657736338717ull) >> 32);
+}
+int __below(int n){
+  return n > 0 ? (int)(__random() % (unsigned)n) : 0;
+}
+int __chance(int pct){
+  return __below(100) < pct;
+}
+
+char* __labelName(char *buf, char prefix, int n){
+  char digits[8];
+  int i, k = 0;
+
+  do {
+    digits[k++] = "0123456789abcdefghijklmnopqrstuvwxyz"[n % LABELBASE];
+    n /= LABELBASE;
+  } while(n > 0);
+  buf[0] = prefix;
+  for(i = 0; i < k; i++)
+    buf[1+i] = digits[k-1-i];
+  buf[k+1] = '\0';
+  return buf;
+}
+
+/* one line, carrying nextLabel if there is one */
+void __emit(const char *opcode, const char *args){
+  fprintf(code, "%-8s%-8s%s\n", nextLabel, opcode, args);
+  nextLabel[0] = '\0';
+  emitted++;
+}
+/* nextLabel is taken: put the old one on a noop first */
+void __setLabel(const char *name){
+  if(nextLabel[0] != '\0')
+    __emit("noop", "");
+  strcpy(nextLabel, name);
+}
+
+int __dataReg(){
+  return 1 + __below(DATAREGS);
+}
+/* a source register: often one just written with the hazard profile */
+int __srcReg(){
+  int r;
+
+  if(__chance(prof.hazardPct) && recent[0] != 0){
+    r = recent[__below(3)];
+    return r != 0 ? r : recent[0];
+  }
+  return __below(DATAREGS + 1);   /* r0 too */
+}
+int __destReg(){
+  int r = __dataReg();
+
+  recent[2] = recent[1];
+  recent[1] = recent[0];
+  recent[0] = r;
+  return r;
+}
+int __pickKind(){
+  int i, total = 0, x;
+
+  for(i = 0; i < NUMKINDS; i++)
+    total += prof.weight[i];
+  x = __below(total);
+  for(i = 0; x >= prof.weight[i]; i++)
+    x -= prof.weight[i];
+  return i;
+}
+
+void __emitLoop(int depth, int body){
+  char args[32], name[8];
+  int n = numLoops++, counter = depth == 0 ? 7 : 5;
+
+  sprintf(args, "0       %d       %s", counter, __labelName(name, 'T', 1 + __below(MAXTRIP)));
+  __emit("lw", args);
+  __setLabel(__labelName(name, 'L', n));
+  genBlock(depth + 1, body);
+  sprintf(args, "%d       %d       %d", counter, NEGREG, counter);
+  __emit("add", args);
+  sprintf(args, "%d       0       1", counter);
+  __emit("beq", args);
+  sprintf(args, "0       0       %s", __labelName(name, 'L', n));
+  __emit("beq", args);
+}
+
+void __emitInstruction(int kind, int *pending, int *pendingAt, int *numPending){
+  static const char *arith[] = {"mul", "div", "sll", "srl"};
+  char args[32], name[8];
+  int a, b;
+
+  switch(kind){
+    case K_ADD:
+    case K_NOR:
+      a = __srcReg();
+      b = __srcReg();
+      sprintf(args, "%d       %d       %d", a, b, __destReg());
+      __emit(kind == K_ADD ? "add" : "nor", args);
+      break;
+    case K_ARITH:
+      a = __srcReg();
+      b = __srcReg();
+      sprintf(args, "%d       %d       %d", a, b, __destReg());
+      __emit(arith[__below(4)], args);
+      break;
+    case K_LW:
+      sprintf(args, "0       %d       %s", __destReg(), __labelName(name, 'D', __below(numData)));
+      __emit("lw", args);
+      break;
+    case K_SW:
+      sprintf(args, "0       %d       %s", __srcReg(), __labelName(name, 'D', __below(numData)));
+      __emit("sw", args);
+      break;
+    case K_BEQ:
+      pendingAt[*numPending] = emitted;
+      pending[(*numPending)++] = numForward;
+      a = __srcReg();
+      b = __srcReg();
+      sprintf(args, "%d       %d       %s", a, b, __labelName(name, 'F', numForward++));
+      __emit("beq", args);
+      break;
+    default:
+      __emit("noop", "");
+      break;
+  }
+}
+
+/* `budget` statements, give or take the noops that carry extra labels */
+void genBlock(int depth, int budget){
+  char name[8];
+  int *pending = (int*)malloc((budget + 1) * sizeof(int));
+  int *pendingAt = (int*)malloc((budget + 1) * sizeof(int));
+  int numPending = 0, end = emitted + budget, body, i;
+
+  while(emitted < end){
+    /* the oldest branch must not get out of reach */
+    if(numPending > 0 && emitted - pendingAt[0] > MAXFORWARD){
+      __setLabel(__labelName(name, 'F', pending[0]));
+      numPending--;
+      memmove(pending, pending + 1, numPending * sizeof(int));
+      memmove(pendingAt, pendingAt + 1, numPending * sizeof(int));
+    }
+    /* land a forward branch here, or give the statement a label anyway */
+    if(nextLabel[0] == '\0' && numPending > 0 && __chance(25)){
+      i = __below(numPending);
+      strcpy(nextLabel, __labelName(name, 'F', pending[i]));
+      numPending--;
+      memmove(pending + i, pending + i + 1, (numPending - i) * sizeof(int));
+      memmove(pendingAt + i, pendingAt + i + 1, (numPending - i) * sizeof(int));
+    } else if(nextLabel[0] == '\0' && __chance(prof.labelPct)){
+      strcpy(nextLabel, __labelName(name, 'C', numCode++));
+    }
+    if(depth < MAXDEPTH && end - emitted > 8 && __chance(prof.loopPct)){
+      body = 4 + __below((end - emitted - 4 < MAXBODY ? end - emitted - 4 : MAXBODY) - 3);
+      __emitLoop(depth, body);
+      continue;
+    }
+    __emitInstruction(__pickKind(), pending, pendingAt, &numPending);
+  }
+  /* branches still in flight land at the end of the block */
+  while(numPending > 0)
+    __setLabel(__labelName(name, 'F', pending[--numPending]));
+  free(pending);
+  free(pendingAt);
+}
+
+void genCode(int size){
+  strcpy(nextLabel, "start");
+  __emit("lw", "0       6       neg1");
+  genBlock(0, size > 3 ? size - 3 : 0);
+  __emit("halt", "");
+}
+
+void genData(){
+  char name[8];
+  int i, v;
+
+  fprintf(out, "neg1    .fill   -1\n");
+  for(i = 1; i <= MAXTRIP; i++)
+    fprintf(out, "%-8s.fill   %d\n", __labelName(name, 'T', i), i);
+  for(i = 0; i < numData; i++){
+    fprintf(out, "%-8s.fill   ", __labelName(name, 'D', i));
+    if(numCode > 0 && __chance(10)){
+      /* code addresses as data, for the label-heavy programs */
+      fprintf(out, "%s\n", __labelName(name, 'C', __below(numCode)));
+      continue;
+    }
+    switch(__below(8)){
+      case 0:
+        v = (int)__random();    /* anything 32 bits hold */
+        break;
+      case 1:
+        v = __below(2) ? 32767 : -32768;
+        break;
+      default:
+        v = __below(2001) - 1000;
+    }
+    fprintf(out, "%d\n", v);
+  }
+}
+
+///////////////////////////////////////////////////////////
+void raiseError(int code, const char msg[]){
+  fprintf(stderr, "[ERROR] %s %s\n", errorMsg[code], msg);
+  exit(1);
+}
+
+// End //////////////////////////////////////////////////////